@@ -300,6 +300,18 @@ pub fn build(b: *Build) !void {
     b.installArtifact(main_tests);
     const test_step = b.step("test", "Run library tests");
     test_step.dependOn(&b.addRunArtifact(main_tests).step);
+
+    const bench_exe = b.addExecutable(.{
+        .name = "dxcompiler-bench",
+        .root_source_file = b.path("src/bench.zig"),
+        .target = target,
+        .optimize = optimize,
+    });
+    bench_exe.root_module.addImport("mach-dxcompiler", mach_dxcompiler);
+    bench_exe.addIncludePath(b.path("src"));
+
+    const bench_step = b.step("bench", "Run compile benchmarks");
+    bench_step.dependOn(&b.addRunArtifact(bench_exe).step);
 }
 
 fn buildShared(b: *Build, lib: *Build.Step.Compile, optimize: std.builtin.OptimizeMode, target: std.Build.ResolvedTarget) void {
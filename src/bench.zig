@@ -0,0 +1,439 @@
+//! Microbenchmarks for the C API, run with `zig build bench -Dfrom_source -Doptimize=ReleaseFast`.
+const std = @import("std");
+const builtin = @import("builtin");
+const Compiler = @import("mach-dxcompiler").Compiler;
+
+const c = @cImport(
+    @cInclude("mach_dxc.h"),
+);
+
+const trivial_code = "float4 main() : SV_Target { return float4(1, 0, 0, 1); }";
+const trivial_args = &[_][*:0]const u8{ "-E", "main", "-T", "ps_6_0" };
+
+pub fn main() !void {
+    var gpa = std.heap.GeneralPurposeAllocator(.{}){};
+    defer _ = gpa.deinit();
+    const allocator = gpa.allocator();
+
+    try benchInitDeinit();
+    try benchCompileOverhead();
+    try benchTimingOverhead();
+    try benchBatchScaling(allocator);
+    try benchPinnedIncludes(allocator);
+    try benchArenaRss();
+    try benchPrefixHeader(allocator);
+    try benchEntryPoints(allocator);
+}
+
+/// Measures machDxcInit/machDxcDeinit latency, first with no other compiler alive so that every
+/// cycle sets up and tears down global state, then with the globals held by machDxcGlobalInit.
+fn benchInitDeinit() !void {
+    const iterations = 50;
+
+    var timer = try std.time.Timer.start();
+    for (0..iterations) |_| Compiler.init().deinit();
+    const cold = timer.read();
+
+    Compiler.globalInit();
+    defer Compiler.globalDeinit();
+    timer.reset();
+    for (0..iterations) |_| Compiler.init().deinit();
+    const warm = timer.read();
+
+    std.debug.print("init/deinit: {d} ns/cycle with global setup, {d} ns/cycle with globals held\n", .{
+        cold / iterations,
+        warm / iterations,
+    });
+}
+
+/// Compiles a trivial shader in a loop. Almost no time is spent in the compiler proper, so the
+/// per-call cost reported here is dominated by the fixed overhead of machDxcCompile.
+fn benchCompileOverhead() !void {
+    const compiler = Compiler.init();
+    defer compiler.deinit();
+
+    for (0..16) |_| compiler.compile(trivial_code, trivial_args).deinit();
+
+    const iterations = 2000;
+    var timer = try std.time.Timer.start();
+    for (0..iterations) |_| compiler.compile(trivial_code, trivial_args).deinit();
+    const elapsed = timer.read();
+
+    std.debug.print("compile overhead: {d} compiles, {d} ns/compile\n", .{ iterations, elapsed / iterations });
+}
+
+const scaling_code =
+    \\ cbuffer Params : register(b0) { float4 scale; uint count; };
+    \\ Texture2D<float4> tex : register(t0);
+    \\ SamplerState samp : register(s0);
+    \\
+    \\ float4 main(float2 uv : TEXCOORD) : SV_Target
+    \\ {
+    \\   float4 r = 0;
+    \\   [loop] for (uint i = 0; i < count; i++)
+    \\     r += tex.Sample(samp, uv + i * scale.xy) * VARIANT;
+    \\   return r;
+    \\ }
+;
+
+/// Compiles shader permutations on a single instance at each level of collect_timings, reporting
+/// the cost of tracing relative to compiling without it.
+fn benchTimingOverhead() !void {
+    const compiler = Compiler.initPool(1);
+    defer compiler.deinit();
+
+    const iterations = 64;
+    var define: [32:0]u8 = undefined;
+    const args = [_][*:0]const u8{ "-E", "main", "-T", "ps_6_0", "-D", &define };
+    var baseline: u64 = 0;
+    for ([_]Compiler.TimingDetail{ .none, .phases, .passes }) |detail| {
+        _ = try std.fmt.bufPrintZ(&define, "VARIANT=0", .{});
+        for (0..8) |_| compiler.compileJob(.{ .code = scaling_code, .args = &args, .collect_timings = detail }).deinit();
+
+        var timer = try std.time.Timer.start();
+        for (0..iterations) |i| {
+            _ = try std.fmt.bufPrintZ(&define, "VARIANT={d}", .{i});
+            compiler.compileJob(.{ .code = scaling_code, .args = &args, .collect_timings = detail }).deinit();
+        }
+        const elapsed = timer.read();
+        if (detail == .none) baseline = elapsed;
+
+        std.debug.print("timing overhead: collect_timings={s}, {d} us/compile, {d:.1}% over none\n", .{
+            @tagName(detail),
+            elapsed / iterations / std.time.ns_per_us,
+            (@as(f64, @floatFromInt(elapsed)) / @as(f64, @floatFromInt(baseline)) - 1) * 100,
+        });
+    }
+}
+
+/// Compiles the same set of shader permutations with machDxcCompileBatch at increasing thread
+/// counts and reports throughput for each.
+fn benchBatchScaling(allocator: std.mem.Allocator) !void {
+    const num_jobs = 256;
+
+    var defines: [num_jobs][32:0]u8 = undefined;
+    var args: [num_jobs][6][*:0]const u8 = undefined;
+    var jobs: [num_jobs]Compiler.Job = undefined;
+    for (&jobs, &args, &defines, 0..) |*job, *job_args, *define, i| {
+        _ = try std.fmt.bufPrintZ(define, "VARIANT={d}", .{i});
+        job_args.* = .{ "-E", "main", "-T", "ps_6_0", "-D", define };
+        job.* = .{ .code = scaling_code, .args = job_args };
+    }
+
+    const compiler = Compiler.init();
+    defer compiler.deinit();
+
+    var results: [num_jobs]Compiler.Result = undefined;
+    const cpu_count = try std.Thread.getCpuCount();
+    for ([_]usize{ 1, 2, 4, 8, cpu_count }) |num_threads| {
+        var timer = try std.time.Timer.start();
+        try compiler.compileBatch(allocator, &jobs, &results, num_threads);
+        const elapsed = timer.read();
+        for (results) |result| result.deinit();
+
+        const per_second = @as(f64, num_jobs) / (@as(f64, @floatFromInt(elapsed)) / std.time.ns_per_s);
+        std.debug.print("batch scaling: {d} threads, {d} compiles in {d} ms, {d:.1} compiles/s\n", .{
+            num_threads,
+            num_jobs,
+            elapsed / std.time.ns_per_ms,
+            per_second,
+        });
+    }
+}
+
+const LargeHeader = struct {
+    data: [:0]const u8,
+    result: c.MachDxcIncludeResult = undefined,
+
+    fn include(ctx: ?*anyopaque, header_name: [*c]const u8) callconv(.C) [*c]c.MachDxcIncludeResult {
+        _ = header_name;
+        const header: *LargeHeader = @ptrCast(@alignCast(ctx));
+        header.result = .{ .header_data = header.data.ptr, .header_length = header.data.len };
+        return &header.result;
+    }
+
+    fn free(ctx: ?*anyopaque, result: [*c]c.MachDxcIncludeResult) callconv(.C) c_int {
+        _ = ctx;
+        _ = result;
+        return 0;
+    }
+};
+
+/// Compiles a multi-megabyte source that includes a multi-megabyte header, with and without
+/// pin_includes, and reports the bytes the C API copied per compile alongside wall time.
+fn benchPinnedIncludes(allocator: std.mem.Allocator) !void {
+    const padding_line = "// Generated padding to make this file large, as machine-generated uber-shaders are.\n";
+    const target_size = 3 * 1024 * 1024;
+
+    var header = std.ArrayList(u8).init(allocator);
+    defer header.deinit();
+    while (header.items.len < target_size) try header.appendSlice(padding_line);
+    try header.appendSlice("float4 helper(float4 v) { return v * 2; }\n");
+    const header_data = try header.toOwnedSliceSentinel(0);
+    defer allocator.free(header_data);
+
+    var source = std.ArrayList(u8).init(allocator);
+    defer source.deinit();
+    try source.appendSlice("#include \"large.hlsli\"\n");
+    while (source.items.len < target_size) try source.appendSlice(padding_line);
+    try source.appendSlice("float4 main(float4 v : COLOR) : SV_Target { return helper(v); }\n");
+
+    var large_header = LargeHeader{ .data = header_data };
+    var callbacks = c.MachDxcIncludeCallbacks{
+        .include_ctx = &large_header,
+        .include_func = LargeHeader.include,
+        .free_func = LargeHeader.free,
+        .version_func = null,
+    };
+    const args = [_][*c]const u8{ "-E", "main", "-T", "ps_6_0" };
+
+    const compiler = c.machDxcInit();
+    defer c.machDxcDeinit(compiler);
+
+    for ([_]c_int{ 0, 1 }) |pin_includes| {
+        var options = c.MachDxcCompileOptions{
+            .code = source.items.ptr,
+            .code_len = source.items.len,
+            .args = &args,
+            .args_len = args.len,
+            .include_callbacks = &callbacks,
+            .base_args = null,
+            .prefix_header = null,
+            .pin_includes = pin_includes,
+            .collect_timings = 0,
+            .collect_trace = 0,
+            .use_arena = 0,
+        };
+
+        const iterations = 8;
+        var bytes_copied: u64 = 0;
+        var timer = try std.time.Timer.start();
+        for (0..iterations) |_| {
+            const result = c.machDxcCompile(compiler, &options);
+            bytes_copied += c.machDxcCompileResultGetMemoryStats(result).copied_bytes;
+            c.machDxcCompileResultDeinit(result);
+        }
+        const elapsed = timer.read();
+        bytes_copied /= iterations;
+        std.debug.print("pinned includes: pin_includes={d}, {d} KiB source + {d} KiB header, {d} KiB copied/compile, {d} ms/compile\n", .{
+            pin_includes,
+            source.items.len / 1024,
+            header_data.len / 1024,
+            bytes_copied / 1024,
+            elapsed / iterations / std.time.ns_per_ms,
+        });
+    }
+}
+
+/// The resident set size of the process in bytes, or its peak where the current size isn't
+/// available. Null on Windows.
+fn residentBytes() ?usize {
+    switch (builtin.os.tag) {
+        .windows => return null,
+        .linux => {
+            var buf: [128]u8 = undefined;
+            const statm = std.fs.cwd().readFile("/proc/self/statm", &buf) catch return null;
+            var fields = std.mem.tokenizeScalar(u8, statm, ' ');
+            _ = fields.next();
+            const pages = std.fmt.parseInt(usize, fields.next() orelse return null, 10) catch return null;
+            return pages * std.mem.page_size;
+        },
+        else => {
+            const usage = std.posix.getrusage(std.posix.rusage.SELF);
+            const scale: usize = if (builtin.os.tag.isDarwin()) 1 else 1024;
+            return @as(usize, @intCast(usage.maxrss)) * scale;
+        },
+    }
+}
+
+/// Runs 10k permutation compiles on a single instance with and without use_arena, reporting
+/// throughput and how much the resident set grew over the run.
+fn benchArenaRss() !void {
+    const iterations = 10_000;
+
+    for ([_]bool{ false, true }) |use_arena| {
+        const compiler = Compiler.initPool(1);
+        defer compiler.deinit();
+
+        var define: [32:0]u8 = undefined;
+        const args = [_][*:0]const u8{ "-E", "main", "-T", "ps_6_0", "-D", &define };
+        _ = try std.fmt.bufPrintZ(&define, "VARIANT=0", .{});
+        for (0..16) |_| compiler.compileJob(.{ .code = scaling_code, .args = &args, .use_arena = use_arena }).deinit();
+
+        const rss_before = residentBytes();
+        var timer = try std.time.Timer.start();
+        for (0..iterations) |i| {
+            _ = try std.fmt.bufPrintZ(&define, "VARIANT={d}", .{i});
+            compiler.compileJob(.{ .code = scaling_code, .args = &args, .use_arena = use_arena }).deinit();
+        }
+        const elapsed = timer.read();
+        const rss_after = residentBytes();
+
+        std.debug.print("arena: use_arena={}, {d} compiles, {d} us/compile", .{ use_arena, iterations, elapsed / iterations / std.time.ns_per_us });
+        if (rss_before != null and rss_after != null) {
+            std.debug.print(", RSS {d} KiB -> {d} KiB", .{ rss_before.? / 1024, rss_after.? / 1024 });
+        }
+        std.debug.print("\n", .{});
+    }
+}
+
+const CommonHeaders = struct {
+    names: []const []const u8,
+    texts: []const [:0]const u8,
+    result: c.MachDxcIncludeResult = undefined,
+
+    fn include(ctx: ?*anyopaque, header_name: [*c]const u8) callconv(.C) [*c]c.MachDxcIncludeResult {
+        const headers: *CommonHeaders = @ptrCast(@alignCast(ctx));
+        const name = std.mem.span(header_name);
+        for (headers.names, headers.texts) |header, text| {
+            if (std.mem.endsWith(u8, name, header)) {
+                headers.result = .{ .header_data = text.ptr, .header_length = text.len };
+                return &headers.result;
+            }
+        }
+        return null;
+    }
+
+    fn free(ctx: ?*anyopaque, result: [*c]c.MachDxcIncludeResult) callconv(.C) c_int {
+        _ = ctx;
+        _ = result;
+        return 0;
+    }
+};
+
+/// Compiles permutations that share a ~15k-line common header set, first resolving the headers
+/// through include callbacks and then from a prefix header, and reports per compile the time of
+/// DXC's front-end spans (preprocessing, header loads and parsing, from -ftime-trace), how much of
+/// it went to include callbacks, and wall time.
+fn benchPrefixHeader(allocator: std.mem.Allocator) !void {
+    const names = [_][]const u8{ "common.hlsli", "lighting.hlsli", "material.hlsli" };
+    var texts: [names.len][:0]const u8 = undefined;
+    for (&texts, 0..) |*text, header| {
+        var lines = std.ArrayList(u8).init(allocator);
+        defer lines.deinit();
+        if (header == 0) try lines.appendSlice("#include \"lighting.hlsli\"\n#include \"material.hlsli\"\n");
+        for (0..5_000) |i| {
+            try lines.writer().print("float helper{d}_{d}(float v) {{ return v * {d}.0 + QUALITY; }}\n", .{ header, i, i });
+        }
+        text.* = try lines.toOwnedSliceSentinel(0);
+    }
+    defer for (texts) |text| allocator.free(text);
+
+    var headers = CommonHeaders{ .names = &names, .texts = &texts };
+    var callbacks = c.MachDxcIncludeCallbacks{
+        .include_ctx = &headers,
+        .include_func = CommonHeaders.include,
+        .free_func = CommonHeaders.free,
+        .version_func = null,
+    };
+
+    const compiler = c.machDxcInitPool(1);
+    defer c.machDxcDeinit(compiler);
+    const prefix_headers = [_][*c]const u8{"common.hlsli"};
+    const prefix_defines = [_][*c]const u8{"QUALITY=2"};
+    const prefix_header = c.machDxcPrefixHeaderInit(compiler, &callbacks, &prefix_headers, prefix_headers.len, &prefix_defines, prefix_defines.len);
+    defer c.machDxcPrefixHeaderDeinit(prefix_header);
+
+    const iterations = 16;
+    var define: [32:0]u8 = undefined;
+    for ([_]bool{ false, true }) |use_prefix| {
+        const code = if (use_prefix)
+            "float4 main() : SV_Target { return helper0_1(VARIANT); }"
+        else
+            "#include \"common.hlsli\"\nfloat4 main() : SV_Target { return helper0_1(VARIANT); }";
+        const prefix_args = [_][*c]const u8{ "-E", "main", "-T", "ps_6_0", "-D", &define };
+        const include_args = [_][*c]const u8{ "-E", "main", "-T", "ps_6_0", "-D", "QUALITY=2", "-D", &define };
+        const args: []const [*c]const u8 = if (use_prefix) &prefix_args else &include_args;
+        var options = c.MachDxcCompileOptions{
+            .code = code.ptr,
+            .code_len = code.len,
+            .args = args.ptr,
+            .args_len = args.len,
+            .include_callbacks = if (use_prefix) null else &callbacks,
+            .base_args = null,
+            .prefix_header = if (use_prefix) prefix_header else null,
+            .pin_includes = 0,
+            .collect_timings = c.MachDxcTimingsPhases,
+            .collect_trace = 0,
+            .use_arena = 0,
+        };
+
+        var frontend_ns: u64 = 0;
+        var include_ns: u64 = 0;
+        var timer = try std.time.Timer.start();
+        for (0..iterations) |i| {
+            _ = try std.fmt.bufPrintZ(&define, "VARIANT={d}", .{i});
+            const result = c.machDxcCompile(compiler, &options);
+            defer c.machDxcCompileResultDeinit(result);
+            const timings = c.machDxcCompileResultGetTimings(result);
+            frontend_ns += timings.parse_ns;
+            include_ns += timings.include_callbacks_ns;
+        }
+        const elapsed = timer.read();
+
+        std.debug.print("prefix header: use_prefix={}, {d} front-end us/compile ({d} us in include callbacks), {d} us/compile\n", .{
+            use_prefix,
+            frontend_ns / iterations / std.time.ns_per_us,
+            include_ns / iterations / std.time.ns_per_us,
+            elapsed / iterations / std.time.ns_per_us,
+        });
+    }
+}
+
+/// Compiles the four entry points of a material with a large shared body of helpers, once as
+/// four separate compiles and once with machDxcCompileEntryPoints, which parses the source once as
+/// a library and links each entry point out of it. Both run on one thread, so the difference is
+/// the front-end work saved.
+fn benchEntryPoints(allocator: std.mem.Allocator) !void {
+    var source = std.ArrayList(u8).init(allocator);
+    defer source.deinit();
+    for (0..5_000) |i| try source.writer().print("float helper{d}(float v) {{ return v * {d}.0; }}\n", .{ i, i });
+    try source.appendSlice(
+        \[shader("vertex")] float4 vs_main(float4 position : POSITION) : SV_Position { return position * helper1(1); }
+        \[shader("pixel")] float4 ps_main() : SV_Target { return helper2(1); }
+        \[shader("pixel")] float4 ps_shadow() : SV_Target { return helper3(1); }
+        \[shader("compute")] [numthreads(8, 8, 1)] void cs_main() {}
+        \
+    );
+
+    const names = [_][*:0]const u8{ "vs_main", "ps_main", "ps_shadow", "cs_main" };
+    const profiles = [_][*:0]const u8{ "vs_6_0", "ps_6_0", "ps_6_0", "cs_6_0" };
+    var entry_points: [names.len]Compiler.EntryPoint = undefined;
+    var entry_args: [names.len][4][*:0]const u8 = undefined;
+    var jobs: [names.len]Compiler.Job = undefined;
+    for (&entry_points, &entry_args, &jobs, names, profiles) |*entry_point, *args, *job, name, profile| {
+        entry_point.* = .{ .name = name, .target_profile = profile };
+        args.* = .{ "-E", name, "-T", profile };
+        job.* = .{ .code = source.items, .args = args, .collect_timings = .phases };
+    }
+
+    const compiler = Compiler.initPool(1);
+    defer compiler.deinit();
+
+    const iterations = 4;
+    var results: [entry_points.len]Compiler.Result = undefined;
+    var separate: u64 = 0;
+    var frontend_ns: u64 = 0;
+    var linked: u64 = 0;
+    for (0..iterations + 1) |i| {
+        var timer = try std.time.Timer.start();
+        try compiler.compileBatch(allocator, &jobs, &results, 1);
+        if (i != 0) separate += timer.read();
+        for (results) |result| {
+            if (i != 0) frontend_ns += result.getTimings().parse_ns;
+            result.deinit();
+        }
+
+        timer.reset();
+        try compiler.compileEntryPoints(allocator, .{ .code = source.items, .args = &.{} }, &entry_points, &results, 1);
+        if (i != 0) linked += timer.read();
+        for (results) |result| result.deinit();
+    }
+
+    std.debug.print("entry points: {d} separate compiles in {d} ms ({d} ms front end), linked from one library in {d} ms\n", .{
+        entry_points.len,
+        separate / iterations / std.time.ns_per_ms,
+        frontend_ns / iterations / std.time.ns_per_ms,
+        linked / iterations / std.time.ns_per_ms,
+    });
+}
@@ -16,112 +16,4385 @@
 // Avoid __declspec(dllimport) since dxcompiler is static.
 #define DXC_API_IMPORT
 #include <dxcapi.h>
+#include <d3d12shader.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <stddef.h>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__APPLE__)
+#include <malloc/malloc.h>
+#else
+#include <malloc.h>
+#endif
+
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "mach_dxc.h"
+#include "dxc/DxilContainer/DxilContainer.h"
+#include "dxc/DxilContainer/DxilPipelineStateValidation.h"
 #include "dxc/Support/FileIOHelper.h"
+#include "dxc/Support/Global.h"
+#include "llvm/Support/MD5.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-// Dynamic allocation for multibyte string conversion.
-char* wcstombsAlloc(const wchar_t* inval) 
-{
-    size_t size = std::wcslen(inval);
-    size_t outsz = (size + 1) * MB_CUR_MAX;
-   
-    auto buf = (char*)std::malloc(outsz);
-    std::memset(buf, 0, outsz);
-    std::setlocale(LC_CTYPE,""); 
-    size = std::wcstombs(buf, inval, size * sizeof(wchar_t));
-
-    if (size == (size_t)(-1)) {
-        std::free(buf);
-        buf = nullptr;
-    } else {
-        buf = (char*)std::realloc(buf, size + 1);
+// Decodes UTF-8 into wchar_t (UTF-16 where wchar_t is 16 bits wide, UTF-32 elsewhere) without
+// depending on the C locale. Invalid sequences decode to U+FFFD. Returns the number of wchar_t
+// produced, not counting a terminator; when `out` is null they are only counted.
+static size_t utf8ToWide(const char* utf8, size_t len, wchar_t* out) {
+    size_t count = 0;
+    size_t i = 0;
+    while (i < len) {
+        uint8_t lead = (uint8_t)utf8[i];
+        uint32_t code_point;
+        size_t seq_len;
+        if (lead < 0x80) {
+            code_point = lead;
+            seq_len = 1;
+        } else if ((lead & 0xE0) == 0xC0) {
+            code_point = lead & 0x1F;
+            seq_len = 2;
+        } else if ((lead & 0xF0) == 0xE0) {
+            code_point = lead & 0x0F;
+            seq_len = 3;
+        } else if ((lead & 0xF8) == 0xF0) {
+            code_point = lead & 0x07;
+            seq_len = 4;
+        } else {
+            code_point = 0xFFFD;
+            seq_len = 1;
+        }
+
+        if (seq_len > 1) {
+            bool valid = i + seq_len <= len;
+            for (size_t k = 1; valid && k < seq_len; k++) {
+                uint8_t continuation = (uint8_t)utf8[i + k];
+                valid = (continuation & 0xC0) == 0x80;
+                code_point = (code_point << 6) | (continuation & 0x3F);
+            }
+            static const uint32_t min_code_point[5] = {0, 0, 0x80, 0x800, 0x10000};
+            if (!valid || code_point < min_code_point[seq_len] || code_point > 0x10FFFF ||
+                (code_point >= 0xD800 && code_point <= 0xDFFF)) {
+                code_point = 0xFFFD;
+                seq_len = 1;
+            }
+        }
+        i += seq_len;
+
+        if (sizeof(wchar_t) == 2 && code_point >= 0x10000) {
+            if (out != nullptr) {
+                out[count] = (wchar_t)(0xD800 + ((code_point - 0x10000) >> 10));
+                out[count + 1] = (wchar_t)(0xDC00 + ((code_point - 0x10000) & 0x3FF));
+            }
+            count += 2;
+        } else {
+            if (out != nullptr)
+                out[count] = (wchar_t)code_point;
+            count++;
+        }
+    }
+    return count;
+}
+
+static std::wstring utf8ToWideString(const char* utf8) {
+    size_t len = std::strlen(utf8);
+    std::wstring wide(utf8ToWide(utf8, len, nullptr), L'\0');
+    utf8ToWide(utf8, len, &wide[0]);
+    return wide;
+}
+
+// Encodes a null-terminated wchar_t string as UTF-8 into `out`, reusing its storage. Unpaired
+// surrogates encode as U+FFFD.
+static void wideToUtf8(const wchar_t* wide, std::string& out) {
+    out.clear();
+    for (size_t i = 0; wide[i] != L'\0'; i++) {
+        uint32_t code_point = (uint32_t)wide[i];
+        if (sizeof(wchar_t) == 2 && code_point >= 0xD800 && code_point <= 0xDFFF) {
+            uint32_t low = (uint32_t)wide[i + 1];
+            if (code_point <= 0xDBFF && low >= 0xDC00 && low <= 0xDFFF) {
+                code_point = 0x10000 + ((code_point - 0xD800) << 10) + (low - 0xDC00);
+                i++;
+            } else {
+                code_point = 0xFFFD;
+            }
+        }
+        if (code_point > 0x10FFFF)
+            code_point = 0xFFFD;
+
+        if (code_point < 0x80) {
+            out.push_back((char)code_point);
+        } else if (code_point < 0x800) {
+            out.push_back((char)(0xC0 | (code_point >> 6)));
+            out.push_back((char)(0x80 | (code_point & 0x3F)));
+        } else if (code_point < 0x10000) {
+            out.push_back((char)(0xE0 | (code_point >> 12)));
+            out.push_back((char)(0x80 | ((code_point >> 6) & 0x3F)));
+            out.push_back((char)(0x80 | (code_point & 0x3F)));
+        } else {
+            out.push_back((char)(0xF0 | (code_point >> 18)));
+            out.push_back((char)(0x80 | ((code_point >> 12) & 0x3F)));
+            out.push_back((char)(0x80 | ((code_point >> 6) & 0x3F)));
+            out.push_back((char)(0x80 | (code_point & 0x3F)));
+        }
+    }
+}
+
+// A 128-bit content hash, used to key cached compile results.
+struct MachDxcHash {
+    uint8_t bytes[16];
+
+    bool operator==(const MachDxcHash& other) const {
+        return std::memcmp(bytes, other.bytes, sizeof(bytes)) == 0;
+    }
+};
+
+struct MachDxcHashHasher {
+    size_t operator()(const MachDxcHash& hash) const {
+        size_t value;
+        std::memcpy(&value, hash.bytes, sizeof(value));
+        return value;
+    }
+};
+
+static void hashUpdate(llvm::MD5& md5, const void* data, size_t len) {
+    md5.update(llvm::ArrayRef<uint8_t>((const uint8_t*)data, len));
+}
+
+static MachDxcHash hashFinal(llvm::MD5& md5) {
+    llvm::MD5::MD5Result digest;
+    md5.final(digest);
+    MachDxcHash hash;
+    std::memcpy(hash.bytes, &digest[0], sizeof(hash.bytes));
+    return hash;
+}
+
+static MachDxcHash hashBytes(const void* data, size_t len) {
+    llvm::MD5 md5;
+    hashUpdate(md5, data, len);
+    return hashFinal(md5);
+}
+
+// A header resolved through MachDxcIncludeCallbacks during a compile, and the hash of the content
+// it resolved to.
+struct MachDxcIncludeRecord {
+    std::string name;
+    MachDxcHash hash;
+};
+
+static IMalloc* heapMalloc();
+
+// While DXC runs, it installs the compiler's IMalloc as the thread's allocator for operator new
+// and delete. Our own objects created or destroyed from within DXC, such as by the include
+// handler, may outlive the call or predate it, so this puts the C heap back for its scope. The
+// same scope covers releasing DXC objects from outside of DXC: whatever they free goes back to
+// the allocator it came from, see heapMalloc().
+class MachDxcHeapScope {
+public:
+    MachDxcHeapScope() { DxcSwapThreadMalloc(heapMalloc(), &prior); }
+    ~MachDxcHeapScope() { DxcSwapThreadMalloc(prior, nullptr); }
+
+    MachDxcHeapScope(const MachDxcHeapScope&) = delete;
+    MachDxcHeapScope& operator=(const MachDxcHeapScope&) = delete;
+
+private:
+    IMalloc* prior = nullptr;
+};
+
+// A blob over memory owned by something else, which is kept alive through `owner` for as long as
+// the blob is referenced. Text blobs are also exposed as IDxcBlobUtf8 and must include the null
+// terminator in their size.
+class MachDxcViewBlob : public IDxcBlobUtf8
+{
+public:
+    MachDxcViewBlob(const void* data, size_t size, bool is_text, std::shared_ptr<void> owner)
+        : data(data), size(size), is_text(is_text), owner(std::move(owner)) {}
+
+    ULONG STDMETHODCALLTYPE AddRef() override { return ++ref_count; }
+    ULONG STDMETHODCALLTYPE Release() override {
+        ULONG count = --ref_count;
+        if (count == 0) {
+            MachDxcHeapScope heap;
+            delete this;
+        }
+        return count;
+    }
+
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void **ppvObject) override {
+        if (riid == __uuidof(IUnknown) || riid == __uuidof(IDxcBlob) ||
+            (is_text && (riid == __uuidof(IDxcBlobEncoding) || riid == __uuidof(IDxcBlobUtf8)))) {
+            AddRef();
+            *ppvObject = this;
+            return S_OK;
+        }
+        *ppvObject = nullptr;
+        return E_NOINTERFACE;
+    }
+
+    LPVOID STDMETHODCALLTYPE GetBufferPointer() override { return const_cast<void*>(data); }
+    SIZE_T STDMETHODCALLTYPE GetBufferSize() override { return size; }
+
+    HRESULT STDMETHODCALLTYPE GetEncoding(BOOL* pKnown, UINT32* pCodePage) override {
+        *pKnown = is_text ? TRUE : FALSE;
+        *pCodePage = is_text ? CP_UTF8 : 0;
+        return S_OK;
+    }
+
+    LPCSTR STDMETHODCALLTYPE GetStringPointer() override { return (LPCSTR)data; }
+    SIZE_T STDMETHODCALLTYPE GetStringLength() override { return size > 0 ? size - 1 : 0; }
+
+private:
+    const void* data;
+    size_t size;
+    bool is_text;
+    std::shared_ptr<void> owner;
+    std::atomic<ULONG> ref_count{0};
+};
+
+// Copies a blob into one backed by the C heap, for outputs that must outlive the arena DXC
+// allocated them from. Text blobs keep their null terminator.
+static MachDxcViewBlob* copyBlob(IDxcBlob* blob, bool is_text) {
+    const char* data = (const char*)blob->GetBufferPointer();
+    std::shared_ptr<std::vector<char>> copy = std::make_shared<std::vector<char>>(data, data + blob->GetBufferSize());
+    if (is_text && (copy->empty() || copy->back() != '\0'))
+        copy->push_back('\0');
+    return new MachDxcViewBlob(copy->data(), copy->size(), is_text, copy);
+}
+
+// A span in a Chrome trace, either read from the JSON written by -ftime-trace or recorded here.
+struct MachDxcTraceEvent {
+    std::string name;
+    std::string detail;
+    uint64_t ts_ns = 0;
+    uint64_t dur_ns = 0;
+};
+
+// Just enough of a JSON reader to pull the complete events out of a -ftime-trace document.
+// Anything unexpected makes it stop and keep the events read so far.
+class MachDxcTraceReader {
+public:
+    MachDxcTraceReader(const char* text, size_t len) : cursor(text), end(text + len) {}
+
+    void read(std::vector<MachDxcTraceEvent>* events) {
+        // {"traceEvents": [ {...}, ... ], ...}
+        if (!consume('{'))
+            return;
+        std::string key;
+        while (readString(&key) && consume(':')) {
+            if (key != "traceEvents") {
+                if (!skipValue())
+                    return;
+            } else if (consume('[')) {
+                if (consume(']'))
+                    continue;
+                do {
+                    MachDxcTraceEvent event;
+                    bool complete = false;
+                    if (!readEvent(&event, &complete))
+                        return;
+                    // Skip the "Total <name>" summaries, which aren't spans of this compile.
+                    if (complete && event.name.compare(0, 6, "Total ") != 0)
+                        events->push_back(std::move(event));
+                } while (consume(','));
+                if (!consume(']'))
+                    return;
+            }
+            if (!consume(','))
+                return;
+        }
+    }
+
+private:
+    bool readEvent(MachDxcTraceEvent* event, bool* complete) {
+        if (!consume('{'))
+            return false;
+        if (consume('}'))
+            return true;
+        std::string key, value;
+        do {
+            if (!readString(&key) || !consume(':'))
+                return false;
+            if (key == "name" || key == "ph") {
+                if (!readString(&value))
+                    return false;
+                if (key == "name")
+                    event->name = std::move(value);
+                else
+                    *complete = value == "X";
+            } else if (key == "ts" || key == "dur") {
+                double number;
+                if (!readNumber(&number))
+                    return false;
+                // Trace-event times are in microseconds.
+                (key == "ts" ? event->ts_ns : event->dur_ns) = number > 0 ? (uint64_t)(number * 1000) : 0;
+            } else if (key == "args") {
+                if (!consume('{'))
+                    return false;
+                if (!consume('}')) {
+                    do {
+                        if (!readString(&key) || !consume(':'))
+                            return false;
+                        if (key == "detail") {
+                            if (!readString(&event->detail))
+                                return false;
+                        } else if (!skipValue()) {
+                            return false;
+                        }
+                    } while (consume(','));
+                    if (!consume('}'))
+                        return false;
+                }
+            } else if (!skipValue()) {
+                return false;
+            }
+        } while (consume(','));
+        return consume('}');
+    }
+
+    void skipSpace() {
+        while (cursor < end && (*cursor == ' ' || *cursor == '\n' || *cursor == '\r' || *cursor == '\t'))
+            cursor++;
+    }
+
+    bool consume(char c) {
+        skipSpace();
+        if (cursor < end && *cursor == c) {
+            cursor++;
+            return true;
+        }
+        return false;
+    }
+
+    bool readString(std::string* out) {
+        out->clear();
+        if (!consume('"'))
+            return false;
+        while (cursor < end && *cursor != '"') {
+            char c = *cursor++;
+            if (c != '\\') {
+                out->push_back(c);
+                continue;
+            }
+            if (cursor == end)
+                return false;
+            c = *cursor++;
+            switch (c) {
+            case 'n': out->push_back('\n'); break;
+            case 't': out->push_back('\t'); break;
+            case 'r': out->push_back('\r'); break;
+            case 'b': out->push_back('\b'); break;
+            case 'f': out->push_back('\f'); break;
+            case 'u': {
+                if (end - cursor < 4)
+                    return false;
+                wchar_t unit = (wchar_t)std::strtoul(std::string(cursor, 4).c_str(), nullptr, 16);
+                cursor += 4;
+                wchar_t wide[2] = {unit, L'\0'};
+                std::string utf8;
+                wideToUtf8(wide, utf8);
+                out->append(utf8);
+                break;
+            }
+            default: out->push_back(c); break;
+            }
+        }
+        return consume('"');
+    }
+
+    bool readNumber(double* out) {
+        skipSpace();
+        char* number_end = nullptr;
+        std::string number(cursor, end - cursor < 64 ? end - cursor : 64);
+        *out = std::strtod(number.c_str(), &number_end);
+        if (number_end == number.c_str())
+            return false;
+        cursor += number_end - number.c_str();
+        return true;
+    }
+
+    bool skipValue() {
+        skipSpace();
+        if (cursor == end)
+            return false;
+        std::string ignored;
+        double number;
+        switch (*cursor) {
+        case '"':
+            return readString(&ignored);
+        case '{':
+        case '[': {
+            char close = *cursor == '{' ? '}' : ']';
+            cursor++;
+            if (consume(close))
+                return true;
+            do {
+                if (close == '}' && (!readString(&ignored) || !consume(':')))
+                    return false;
+                if (!skipValue())
+                    return false;
+            } while (consume(','));
+            return consume(close);
+        }
+        case 't': case 'f': case 'n':
+            while (cursor < end && *cursor >= 'a' && *cursor <= 'z')
+                cursor++;
+            return true;
+        default:
+            return readNumber(&number);
+        }
+    }
+
+    const char* cursor;
+    const char* end;
+};
+
+enum MachDxcPhase {
+    MachDxcPhaseNone,
+    MachDxcPhaseParse,
+    MachDxcPhaseCodeGen,
+    MachDxcPhaseOptimize,
+    MachDxcPhaseValidation,
+    MachDxcPhaseContainer,
+    MachDxcPhaseCount,
+};
+
+// Maps a -ftime-trace span to the compile phase it belongs to, or MachDxcPhaseNone for spans that
+// belong to whichever phase encloses them.
+static MachDxcPhase classifyTraceEvent(const std::string& name) {
+    if (name.find("Validat") != std::string::npos)
+        return MachDxcPhaseValidation;
+    if (name.find("Container") != std::string::npos)
+        return MachDxcPhaseContainer;
+    if (name == "Backend" || name == "OptModule" || name == "OptFunction" || name == "RunPass" ||
+        name == "RunLoopPass" || name == "PerModulePasses" || name == "PerFunctionPasses" ||
+        name == "CodeGenPasses")
+        return MachDxcPhaseOptimize;
+    if (name.compare(0, 7, "CodeGen") == 0)
+        return MachDxcPhaseCodeGen;
+    if (name == "Frontend" || name == "Source" || name == "ParseClass" || name == "ParseTemplate" ||
+        name == "InstantiateClass" || name == "InstantiateFunction" || name == "PerformPendingInstantiations")
+        return MachDxcPhaseParse;
+    return MachDxcPhaseNone;
+}
+
+// Orders events so that every event comes after the events enclosing it.
+static void sortTraceEvents(std::vector<MachDxcTraceEvent>& events) {
+    std::sort(events.begin(), events.end(), [](const MachDxcTraceEvent& a, const MachDxcTraceEvent& b) {
+        return a.ts_ns != b.ts_ns ? a.ts_ns < b.ts_ns : a.dur_ns > b.dur_ns;
+    });
+}
+
+// Splits the time covered by a compile's sorted trace events into phases. Events nest by time,
+// and each event's self time (its duration minus that of its children) counts towards the nearest
+// classified event enclosing it, so every microsecond is attributed to at most one phase.
+static void phaseTimesFromTrace(const std::vector<MachDxcTraceEvent>& events, uint64_t phase_ns[MachDxcPhaseCount]) {
+    int64_t self_ns[MachDxcPhaseCount] = {};
+    struct Open { uint64_t end_ns; MachDxcPhase phase; };
+    std::vector<Open> open;
+    for (const MachDxcTraceEvent& event : events) {
+        while (!open.empty() && open.back().end_ns <= event.ts_ns)
+            open.pop_back();
+        MachDxcPhase phase = classifyTraceEvent(event.name);
+        if (phase == MachDxcPhaseNone && !open.empty())
+            phase = open.back().phase;
+        self_ns[phase] += (int64_t)event.dur_ns;
+        if (!open.empty())
+            self_ns[open.back().phase] -= (int64_t)event.dur_ns;
+        open.push_back({event.ts_ns + event.dur_ns, phase});
+    }
+
+    for (int phase = 0; phase < MachDxcPhaseCount; phase++)
+        phase_ns[phase] = self_ns[phase] > 0 ? (uint64_t)self_ns[phase] : 0;
+}
+
+// The legacy pass manager wraps each pass it runs in a span named after the kind of pass, with the
+// pass name as its detail.
+static bool isPassTraceEvent(const std::string& name) {
+    return name == "RunPass" || name == "RunLoopPass";
+}
+
+// Sums the pass spans among a compile's sorted trace events by pass name. A pass's self time
+// excludes the passes nested in it, which is where pass managers spend nearly all of theirs.
+static void passTimesFromTrace(
+    const std::vector<MachDxcTraceEvent>& events,
+    std::vector<std::string>* names,
+    std::vector<MachDxcPassTiming>* timings
+) {
+    std::unordered_map<std::string, size_t> index;
+    struct Open { uint64_t end_ns; size_t pass; };
+    std::vector<Open> open;
+    std::vector<int64_t> self_ns;
+    for (const MachDxcTraceEvent& event : events) {
+        if (!isPassTraceEvent(event.name))
+            continue;
+        while (!open.empty() && open.back().end_ns <= event.ts_ns)
+            open.pop_back();
+
+        auto found = index.emplace(event.detail, timings->size());
+        if (found.second) {
+            names->push_back(event.detail);
+            timings->push_back({nullptr, 0, 0, 0});
+            self_ns.push_back(0);
+        }
+        size_t pass = found.first->second;
+        (*timings)[pass].runs++;
+        self_ns[pass] += (int64_t)event.dur_ns;
+        // A pass nested in a run of itself is already counted by the outer run.
+        bool recursive = false;
+        for (const Open& enclosing : open)
+            recursive = recursive || enclosing.pass == pass;
+        if (!recursive)
+            (*timings)[pass].total_ns += event.dur_ns;
+        if (!open.empty())
+            self_ns[open.back().pass] -= (int64_t)event.dur_ns;
+        open.push_back({event.ts_ns + event.dur_ns, pass});
+    }
+
+    for (size_t pass = 0; pass < timings->size(); pass++) {
+        (*timings)[pass].name = (*names)[pass].c_str();
+        (*timings)[pass].self_ns = self_ns[pass] > 0 ? (uint64_t)self_ns[pass] : 0;
+    }
+    std::stable_sort(timings->begin(), timings->end(), [](const MachDxcPassTiming& a, const MachDxcPassTiming& b) {
+        return a.self_ns > b.self_ns;
+    });
+}
+
+// Nanoseconds since the first call, the time base of every trace this process writes.
+static uint64_t traceNowNs() {
+    static const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+// A small, stable number for the calling thread, used as its track in traces.
+static uint32_t traceThreadId() {
+    static std::atomic<uint32_t> next_id{1};
+    static thread_local uint32_t id = next_id++;
+    return id;
+}
+
+static uint32_t traceProcessId() {
+#ifdef _WIN32
+    return (uint32_t)GetCurrentProcessId();
+#else
+    return (uint32_t)getpid();
+#endif
+}
+
+static void appendJsonString(std::string& out, const std::string& text) {
+    out.push_back('"');
+    for (char c : text) {
+        switch (c) {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            if ((unsigned char)c < 0x20) {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned)c);
+                out += escaped;
+            } else {
+                out.push_back(c);
+            }
+        }
+    }
+    out.push_back('"');
+}
+
+// Appends `events` on thread `tid` as trace-event JSON objects, each preceded by a comma unless
+// it is the first in the array.
+static void appendTraceEvents(std::string& out, const std::vector<MachDxcTraceEvent>& events, uint32_t tid, bool* first) {
+    char numbers[128];
+    for (const MachDxcTraceEvent& event : events) {
+        if (!*first)
+            out += ",\n";
+        *first = false;
+        snprintf(numbers, sizeof(numbers), "{\"pid\":%u,\"tid\":%u,\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"name\":",
+            traceProcessId(), tid, event.ts_ns / 1000.0, event.dur_ns / 1000.0);
+        out += numbers;
+        appendJsonString(out, event.name);
+        if (!event.detail.empty()) {
+            out += ",\"args\":{\"detail\":";
+            appendJsonString(out, event.detail);
+            out += "}";
+        }
+        out += "}";
+    }
+}
+
+static void appendThreadName(std::string& out, uint32_t tid, bool* first) {
+    char event[160];
+    snprintf(event, sizeof(event), "%s{\"pid\":%u,\"tid\":%u,\"ph\":\"M\",\"name\":\"thread_name\",\"args\":{\"name\":\"thread %u\"}}",
+        *first ? "" : ",\n", traceProcessId(), tid, tid);
+    out += event;
+    *first = false;
+}
+
+// Collects the spans of every compile in the process between machDxcTraceBegin and
+// machDxcTraceEnd.
+struct MachDxcTraceSession {
+    std::mutex lock;
+    std::map<uint32_t, std::vector<MachDxcTraceEvent>> tracks; // By thread.
+};
+
+static std::atomic<bool> trace_session_active{false};
+
+static MachDxcTraceSession& traceSession() {
+    static MachDxcTraceSession session;
+    return session;
+}
+
+static void beginTraceDocument(std::string& out) {
+    out += "{\"traceEvents\":[\n";
+}
+
+static void endTraceDocument(std::string& out) {
+    out += "\n],\"displayTimeUnit\":\"ns\"}\n";
+}
+
+// A header resolved through MachDxcIncludeCallbacks, held by the include cache.
+struct MachDxcCachedHeader {
+    std::string key;
+    CComPtr<IDxcBlobUtf8> blob; // Immutable, shared with every compile that includes it.
+    MachDxcHash hash;
+    uint64_t version = 0;
+    size_t size = 0;
+};
+
+// Headers shared by all compiles on a compiler, so that a batch of permutations resolves and
+// copies each header once rather than once per compile. An LRU list bounds the total size.
+class MachDxcIncludeCache {
+public:
+    MachDxcIncludeCache(MachDxcIncludeValidation validation, size_t max_bytes)
+        : validation(validation), max_bytes(max_bytes) {}
+
+    // Resolves `name` through the cache, calling back into `callbacks` only as far as the
+    // validation policy requires. Sets *hash to the content hash of the header and, if `blob` is
+    // not null, *blob to an AddRef'd blob of its text. Newly cached headers are pinned when
+    // `pin` is set and copied otherwise, adding the bytes copied to *copied_bytes if given.
+    void load(
+        MachDxcIncludeCallbacks* callbacks,
+        bool pin,
+        const std::string& name,
+        IDxcBlob** blob,
+        MachDxcHash* hash,
+        uint64_t* copied_bytes = nullptr
+    ) {
+        std::string key = name;
+        key.push_back('\0');
+        key.append((const char*)&callbacks->include_ctx, sizeof(callbacks->include_ctx));
+        key.append((const char*)&callbacks->include_func, sizeof(callbacks->include_func));
+
+        bool use_version = validation == MachDxcIncludeValidateVersion && callbacks->version_func != nullptr;
+        uint64_t version = use_version ? callbacks->version_func(callbacks->include_ctx, name.c_str()) : 0;
+
+        if (validation == MachDxcIncludeValidateNever || use_version) {
+            std::lock_guard<std::mutex> guard(lock);
+            auto it = index.find(key);
+            if (it != index.end() && (!use_version || (*it->second)->version == version)) {
+                hit(it->second, blob, hash);
+                return;
+            }
+        }
+
+        MachDxcIncludeResult* include_result = callbacks->include_func(callbacks->include_ctx, name.c_str());
+        const char* include_text = include_result != nullptr && include_result->header_data != nullptr ? include_result->header_data : u8"";
+        size_t include_len = include_result != nullptr ? include_result->header_length : 0;
+        MachDxcHash content_hash = hashBytes(include_text, include_len);
+
+        bool unchanged = false;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            auto it = index.find(key);
+            if (it != index.end() && (*it->second)->hash == content_hash) {
+                (*it->second)->version = version;
+                hit(it->second, blob, hash);
+                unchanged = true;
+            }
+        }
+        if (unchanged) {
+            callbacks->free_func(callbacks->include_ctx, include_result);
+            return;
+        }
+
+        std::shared_ptr<MachDxcCachedHeader> header = std::make_shared<MachDxcCachedHeader>();
+        header->key = std::move(key);
+        header->hash = content_hash;
+        header->version = version;
+        header->size = sizeof(MachDxcCachedHeader) + header->key.size() + include_len;
+        if (pin && include_result != nullptr && include_result->header_data != nullptr) {
+            MachDxcIncludeCallbacks owner_callbacks = *callbacks;
+            std::shared_ptr<void> owner(include_result, [owner_callbacks](MachDxcIncludeResult* result) {
+                owner_callbacks.free_func(owner_callbacks.include_ctx, result);
+            });
+            header->blob = new MachDxcViewBlob(include_text, include_len + 1, true, std::move(owner));
+        } else {
+            std::shared_ptr<std::string> copy = std::make_shared<std::string>(include_text, include_len);
+            header->blob = new MachDxcViewBlob(copy->c_str(), include_len + 1, true, copy);
+            callbacks->free_func(callbacks->include_ctx, include_result);
+            if (copied_bytes != nullptr)
+                *copied_bytes += include_len;
+        }
+
+        *hash = content_hash;
+        if (blob != nullptr)
+            *blob = CComPtr<IDxcBlob>(header->blob.p).Detach();
+
+        // Evicted headers may own pinned data, so let them go only once the lock is released.
+        std::vector<std::shared_ptr<MachDxcCachedHeader>> evicted;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            misses++;
+            auto it = index.find(header->key);
+            if (it != index.end()) {
+                bytes -= (*it->second)->size;
+                evicted.push_back(*it->second);
+                lru.erase(it->second);
+                index.erase(it);
+            }
+            if (header->size > max_bytes)
+                return;
+
+            lru.push_front(header);
+            index.emplace(header->key, lru.begin());
+            bytes += header->size;
+            while (bytes > max_bytes) {
+                std::shared_ptr<MachDxcCachedHeader> victim = lru.back();
+                index.erase(victim->key);
+                lru.pop_back();
+                bytes -= victim->size;
+                evictions++;
+                evicted.push_back(std::move(victim));
+            }
+        }
+    }
+
+    MachDxcIncludeCacheStats stats() {
+        std::lock_guard<std::mutex> guard(lock);
+        MachDxcIncludeCacheStats stats;
+        stats.hits = hits;
+        stats.misses = misses;
+        stats.evictions = evictions;
+        stats.entries = lru.size();
+        stats.bytes = bytes;
+        stats.bytes_saved = bytes_saved;
+        return stats;
+    }
+
+private:
+    typedef std::list<std::shared_ptr<MachDxcCachedHeader>> HeaderList;
+
+    // Serves a cached header. Must be called with the lock held.
+    void hit(HeaderList::iterator entry, IDxcBlob** blob, MachDxcHash* hash) {
+        const MachDxcCachedHeader& header = **entry;
+        hits++;
+        bytes_saved += header.blob->GetBufferSize() - 1;
+        lru.splice(lru.begin(), lru, entry);
+        *hash = header.hash;
+        if (blob != nullptr)
+            *blob = CComPtr<IDxcBlob>(header.blob.p).Detach();
+    }
+
+    std::mutex lock;
+    MachDxcIncludeValidation validation;
+    size_t max_bytes;
+    size_t bytes = 0;
+    HeaderList lru; // Most recently used first.
+    std::unordered_map<std::string, HeaderList::iterator> index;
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t evictions = 0;
+    size_t bytes_saved = 0;
+};
+
+// An #include directive found by scanIncludeDirectives.
+struct MachDxcIncludeDirective {
+    std::string name;
+    bool angled; // <name> rather than "name"
+};
+
+// Finds the #include directives in HLSL source without preprocessing it. Comments, string
+// literals and line continuations are handled, but conditional blocks aren't evaluated, so the
+// result is a superset of what a compile would include. Includes spelled through a macro aren't
+// found.
+static void scanIncludeDirectives(const char* text, size_t len, std::vector<MachDxcIncludeDirective>* out) {
+    const char* p = text;
+    const char* end = text + len;
+    bool line_start = true;
+    auto isSpace = [](char ch) { return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\f' || ch == '\v'; };
+
+    while (p < end) {
+        char ch = *p;
+        if (ch == '\n') {
+            line_start = true;
+            p++;
+        } else if (isSpace(ch)) {
+            p++;
+        } else if (ch == '\\' && p + 1 < end && (p[1] == '\n' || p[1] == '\r')) {
+            p += p[1] == '\r' && p + 2 < end && p[2] == '\n' ? 3 : 2;
+        } else if (ch == '/' && p + 1 < end && p[1] == '/') {
+            while (p < end && *p != '\n')
+                p++;
+        } else if (ch == '/' && p + 1 < end && p[1] == '*') {
+            p += 2;
+            while (p + 1 < end && !(p[0] == '*' && p[1] == '/'))
+                p++;
+            p = p + 1 < end ? p + 2 : end;
+        } else if (ch == '"' || ch == '\'') {
+            line_start = false;
+            p++;
+            while (p < end && *p != ch && *p != '\n')
+                p += *p == '\\' && p + 1 < end ? 2 : 1;
+            if (p < end && *p == ch)
+                p++;
+        } else if (ch == '#' && line_start) {
+            line_start = false;
+            p++;
+            while (p < end && isSpace(*p))
+                p++;
+            if (end - p < 7 || std::memcmp(p, "include", 7) != 0)
+                continue;
+            p += 7;
+            while (p < end && isSpace(*p))
+                p++;
+            if (p == end || (*p != '"' && *p != '<'))
+                continue;
+            char close = *p == '"' ? '"' : '>';
+            const char* name = ++p;
+            while (p < end && *p != close && *p != '\n')
+                p++;
+            if (p < end && *p == close) {
+                out->push_back({std::string(name, p - name), close == '>'});
+                p++;
+            }
+        } else {
+            line_start = false;
+            p++;
+        }
+    }
+}
+
+// Normalizes a '/' or '\' separated path to '/' separators without "." segments or ".."
+// segments that can be resolved, so that "a\b/./../c.hlsli" and "a/c.hlsli" name one file.
+static std::string normalizeIncludePath(const std::string& path) {
+    std::vector<std::string> segments;
+    size_t begin = 0;
+    while (begin <= path.size()) {
+        size_t end = path.find_first_of("/\\", begin);
+        if (end == std::string::npos)
+            end = path.size();
+        std::string segment = path.substr(begin, end - begin);
+        if (segment == ".." && !segments.empty() && !segments.back().empty() && segments.back() != "..")
+            segments.pop_back();
+        else if (segment != "." && (!segment.empty() || segments.empty()))
+            segments.push_back(std::move(segment));
+        begin = end + 1;
+    }
+
+    std::string normalized;
+    for (size_t i = 0; i < segments.size(); i++) {
+        if (i != 0)
+            normalized.push_back('/');
+        normalized += segments[i];
+    }
+    return normalized;
+}
+
+// Returns the path of the file named by `directive` in `includer`. Quoted names are relative to
+// the includer's directory and angled names are passed to the include callbacks as spelled.
+static std::string resolveIncludePath(const std::string& includer, const MachDxcIncludeDirective& directive) {
+    const std::string& name = directive.name;
+    bool absolute = (!name.empty() && (name[0] == '/' || name[0] == '\\')) || (name.size() > 1 && name[1] == ':');
+    size_t slash = includer.find_last_of("/\\");
+    if (directive.angled || absolute || slash == std::string::npos)
+        return normalizeIncludePath(name);
+    return normalizeIncludePath(includer.substr(0, slash + 1) + name);
+}
+
+// The include directives of files by content hash, shared by every dependency scan on a compiler
+// so that rescanning unchanged files skips lexing them.
+class MachDxcDirectiveCache {
+public:
+    typedef std::shared_ptr<const std::vector<MachDxcIncludeDirective>> Directives;
+
+    Directives find(const MachDxcHash& hash) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = entries.find(hash);
+        return it != entries.end() ? it->second : nullptr;
+    }
+
+    void insert(const MachDxcHash& hash, Directives directives) {
+        std::lock_guard<std::mutex> guard(lock);
+        // Directive lists are small, so bounding the entry count is enough; start over when full.
+        if (entries.size() >= max_entries)
+            entries.clear();
+        entries.emplace(hash, std::move(directives));
+    }
+
+private:
+    static const size_t max_entries = 65536;
+
+    std::mutex lock;
+    std::unordered_map<MachDxcHash, Directives, MachDxcHashHasher> entries;
+};
+
+// A header set snapshotted by machDxcPrefixHeaderInit. Immutable once built, so any number of
+// compiles may share it.
+struct MachDxcPrefixHeaderImpl {
+    std::unordered_map<std::string, CComPtr<IDxcBlob>> files; // By normalized name.
+    std::string preamble; // Includes the headers, then resets the line number for the source.
+    std::vector<std::wstring> defines;
+    std::vector<LPCWSTR> define_args; // "-D" and each define, passed to DXC ahead of base args.
+    MachDxcHash hash; // Of the defines and every snapshotted file.
+};
+
+// Provides a way for C applications to override file inclusion by offloading it to a function pointer
+class MachDxcIncludeHandler : public IDxcIncludeHandler 
+{
+public:
+    ULONG STDMETHODCALLTYPE AddRef() override { return 0; }
+    ULONG STDMETHODCALLTYPE Release() override { return 0; }
+
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void **ppvObject) override {
+        if (riid == __uuidof(IDxcIncludeHandler) || riid == __uuidof(IUnknown)) {
+            *ppvObject = this;
+            return S_OK;
+        }
+        *ppvObject = nullptr;
+        return E_NOINTERFACE;
+    }
+
+    MachDxcIncludeCallbacks* callbacks = nullptr;
+    IDxcUtils* utils = nullptr;
+
+    // When set, every header loaded is appended here so the compile can be cached.
+    std::vector<MachDxcIncludeRecord>* recorded_includes = nullptr;
+
+    // See MachDxcCompileOptions::pin_includes.
+    bool pin_includes = false;
+
+    // Null unless enabled with machDxcCompilerEnableIncludeCache.
+    MachDxcIncludeCache* include_cache = nullptr;
+
+    // Headers in here are served from it without calling back. See MachDxcCompileOptions.
+    MachDxcPrefixHeaderImpl* prefix_header = nullptr;
+
+    // Scratch buffer for the UTF-8 form of the header name being loaded.
+    std::string filename_utf8;
+
+    // Time spent resolving headers during the current compile.
+    uint64_t include_ns = 0;
+
+    // Header bytes copied during the current compile, see MachDxcMemoryStats::copied_bytes.
+    uint64_t copied_bytes = 0;
+
+    // When set, a span is recorded here for every header loaded.
+    std::vector<MachDxcTraceEvent>* trace_events = nullptr;
+
+    HRESULT STDMETHODCALLTYPE LoadSource(LPCWSTR filename, IDxcBlob **ppIncludeSource) override {
+        MachDxcHeapScope heap;
+        uint64_t start = traceNowNs();
+        HRESULT result = loadSource(filename, ppIncludeSource);
+        uint64_t duration = traceNowNs() - start;
+        include_ns += duration;
+        if (trace_events != nullptr)
+            trace_events->push_back({"Include", filename_utf8, start, duration});
+        return result;
+    }
+
+private:
+    HRESULT loadSource(LPCWSTR filename, IDxcBlob **ppIncludeSource) {
+        wideToUtf8(filename, filename_utf8);
+
+        // Prefix headers are covered by the prefix's hash in the cache key, so aren't recorded.
+        if (prefix_header != nullptr) {
+            auto it = prefix_header->files.find(normalizeIncludePath(filename_utf8));
+            if (it != prefix_header->files.end()) {
+                *ppIncludeSource = CComPtr<IDxcBlob>(it->second.p).Detach();
+                return S_OK;
+            }
+        }
+
+        if (callbacks == nullptr || callbacks->include_func == nullptr || callbacks->free_func == nullptr)
+            return E_POINTER;
+
+        if (include_cache != nullptr) {
+            MachDxcHash hash;
+            include_cache->load(callbacks, pin_includes, filename_utf8, ppIncludeSource, &hash, &copied_bytes);
+            if (recorded_includes != nullptr)
+                recorded_includes->push_back({filename_utf8, hash});
+            return S_OK;
+        }
+
+        MachDxcIncludeResult* include_result = callbacks->include_func(callbacks->include_ctx, filename_utf8.c_str());
+
+        const char* include_text = include_result != nullptr && include_result->header_data != nullptr ? include_result->header_data : u8"";
+        size_t include_len = include_result != nullptr ? include_result->header_length : 0;
+
+        if (recorded_includes != nullptr)
+            recorded_includes->push_back({filename_utf8, hashBytes(include_text, include_len)});
+
+        if (pin_includes && include_result != nullptr && include_result->header_data != nullptr) {
+            // Hand DXC the caller's memory, including its null terminator, and give the header
+            // back to the caller only once DXC lets go of it.
+            MachDxcIncludeCallbacks owner_callbacks = *callbacks;
+            std::shared_ptr<void> owner(include_result, [owner_callbacks](MachDxcIncludeResult* result) {
+                owner_callbacks.free_func(owner_callbacks.include_ctx, result);
+            });
+            MachDxcViewBlob* pinned_blob = new MachDxcViewBlob(include_text, include_len + 1, true, std::move(owner));
+            pinned_blob->AddRef();
+            *ppIncludeSource = pinned_blob;
+            return S_OK;
+        }
+
+        CComPtr<IDxcBlobEncoding> text_blob;
+        HRESULT result = utils->CreateBlob(include_text, include_len, CP_UTF8, &text_blob);
+
+        if (SUCCEEDED(result)) {
+            *ppIncludeSource = text_blob.Detach();
+            copied_bytes += include_len;
+        }
+            
+        callbacks->free_func(callbacks->include_ctx, include_result);
+
+        return S_OK;
+    }
+};  
+
+// Arguments converted once by machDxcArgsInit, to be shared by many compiles.
+struct MachDxcArgsImpl {
+    std::vector<std::string> utf8;
+    std::vector<const char*> utf8_pointers;
+    std::vector<std::wstring> wide;
+    std::vector<LPCWSTR> wide_pointers;
+};
+
+// The outputs of a compile. Results served from the cache share their blobs with the cache entry.
+struct MachDxcCompileResultImpl {
+    CComPtr<IDxcBlob> object;
+    CComPtr<IDxcBlobUtf8> errors;
+    MachDxcCompileTimings timings = {};
+    std::string trace; // Chrome trace-event JSON, if the compile collected one.
+    std::vector<std::string> pass_names; // Storage for the names in pass_timings.
+    std::vector<MachDxcPassTiming> pass_timings;
+    MachDxcMemoryStats memory = {};
+    std::vector<std::string> includes; // Headers resolved by machDxcPreprocess, in include order.
+    bool linked = false; // Whether the object was linked out of libraries.
+    HRESULT status = S_OK; // Fails if DXC itself failed, in which case the result isn't cached.
+
+    // Results are deleted from anywhere, including caches and worker threads.
+    ~MachDxcCompileResultImpl() {
+        MachDxcHeapScope heap;
+        object.Release();
+        errors.Release();
+    }
+};
+
+// A text blob holding `message`, for errors reported by us rather than by DXC.
+static IDxcBlobUtf8* errorBlob(const std::string& message) {
+    std::shared_ptr<std::string> text = std::make_shared<std::string>(message);
+    return new MachDxcViewBlob(text->c_str(), text->size() + 1, true, text);
+}
+
+// The error text for a DXC call that failed outright, such as by running out of memory, rather
+// than reporting diagnostics.
+static std::string failedCallMessage(const char* call, HRESULT hr) {
+    char message[96];
+    snprintf(message, sizeof(message), "error: %s failed with HRESULT 0x%08x", call, (unsigned)hr);
+    return message;
+}
+
+// A result holding only an error message, for failures that happen before DXC is called or that
+// keep it from producing a result at all.
+static MachDxcCompileResult errorResult(const std::string& message) {
+    MachDxcCompileResultImpl* result = new MachDxcCompileResultImpl();
+    result->errors = errorBlob(message);
+    return result;
+}
+
+struct MachDxcCacheEntry {
+    MachDxcHash inputs;
+    std::vector<MachDxcIncludeRecord> includes;
+    CComPtr<IDxcBlob> object;
+    CComPtr<IDxcBlobUtf8> errors;
+    size_t size;
+};
+
+// Hashes an argument list. Options that take a value are normalized so that the joined and
+// separated spellings ("-DX=1" and "-D X=1", "/E main" and "-Emain") hash the same.
+static void hashArgs(llvm::MD5& md5, char const* const* args, size_t args_len) {
+    for (size_t i = 0; i < args_len; i++) {
+        const char* arg = args[i];
+        bool is_option = arg[0] == '-' || arg[0] == '/';
+        if (is_option) {
+            hashUpdate(md5, "-", 1);
+            arg++;
+        }
+        hashUpdate(md5, arg, std::strlen(arg));
+
+        bool takes_value = is_option && (std::strcmp(arg, "D") == 0 || std::strcmp(arg, "E") == 0 ||
+            std::strcmp(arg, "T") == 0 || std::strcmp(arg, "I") == 0);
+        if (takes_value && i + 1 < args_len) {
+            const char* value = args[++i];
+            hashUpdate(md5, value, std::strlen(value));
+        }
+
+        // Hash the terminator as a separator so that {"ab", "c"} and {"a", "bc"} differ.
+        hashUpdate(md5, "", 1);
+    }
+}
+
+// Hashes the inputs of a compile that are known before it runs: the source and the arguments.
+static MachDxcHash hashCompileInputs(MachDxcCompileOptions* options) {
+    llvm::MD5 md5;
+    uint64_t code_len = options->code_len;
+    hashUpdate(md5, &code_len, sizeof(code_len));
+    hashUpdate(md5, options->code, options->code_len);
+
+    // Base args are hashed as if they were at the front of args, since that is how DXC sees them.
+    if (options->base_args != nullptr)
+        hashArgs(md5, options->base_args->utf8_pointers.data(), options->base_args->utf8_pointers.size());
+    hashArgs(md5, options->args, options->args_len);
+    if (options->prefix_header != nullptr)
+        hashUpdate(md5, options->prefix_header->hash.bytes, sizeof(options->prefix_header->hash.bytes));
+    return hashFinal(md5);
+}
+
+// Returns true if every recorded header still resolves to the same content. Headers are resolved
+// through the include cache when there is one, so checking them may not call back at all.
+static bool includesUnchanged(
+    const std::vector<MachDxcIncludeRecord>& includes,
+    MachDxcIncludeCallbacks* callbacks,
+    MachDxcIncludeCache* include_cache
+) {
+    if (includes.empty())
+        return true;
+    if (callbacks == nullptr || callbacks->include_func == nullptr || callbacks->free_func == nullptr)
+        return false;
+
+    for (const MachDxcIncludeRecord& include : includes) {
+        if (include_cache != nullptr) {
+            MachDxcHash hash;
+            include_cache->load(callbacks, false, include.name, nullptr, &hash);
+            if (!(hash == include.hash))
+                return false;
+            continue;
+        }
+
+        MachDxcIncludeResult* include_result = callbacks->include_func(callbacks->include_ctx, include.name.c_str());
+        const char* include_text = include_result != nullptr && include_result->header_data != nullptr ? include_result->header_data : u8"";
+        size_t include_len = include_result != nullptr ? include_result->header_length : 0;
+        bool unchanged = hashBytes(include_text, include_len) == include.hash;
+        callbacks->free_func(callbacks->include_ctx, include_result);
+        if (!unchanged)
+            return false;
+    }
+    return true;
+}
+
+// A size-bounded LRU cache of compile results, safe to use from several threads at once.
+//
+// Entries are found by hashing the source and arguments, then confirmed by re-resolving the
+// headers the original compile included and comparing their content hashes. The same source and
+// arguments may therefore have several entries, one per distinct set of header contents.
+class MachDxcCompileCache {
+public:
+    explicit MachDxcCompileCache(size_t max_bytes) : max_bytes(max_bytes) {}
+
+    // Returns a new result for a matching entry, or nullptr on a miss.
+    MachDxcCompileResultImpl* lookup(const MachDxcHash& inputs, MachDxcIncludeCallbacks* callbacks, MachDxcIncludeCache* include_cache) {
+        // Header callbacks may be slow, so check candidates without holding the lock.
+        std::vector<std::shared_ptr<MachDxcCacheEntry>> candidates;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            auto range = index.equal_range(inputs);
+            for (auto it = range.first; it != range.second; ++it)
+                candidates.push_back(*it->second);
+        }
+
+        for (const std::shared_ptr<MachDxcCacheEntry>& candidate : candidates) {
+            if (!includesUnchanged(candidate->includes, callbacks, include_cache))
+                continue;
+
+            std::lock_guard<std::mutex> guard(lock);
+            hits++;
+            auto range = index.equal_range(inputs);
+            for (auto it = range.first; it != range.second; ++it) {
+                if (it->second->get() == candidate.get()) {
+                    lru.splice(lru.begin(), lru, it->second);
+                    break;
+                }
+            }
+
+            MachDxcCompileResultImpl* result = new MachDxcCompileResultImpl();
+            result->object = candidate->object;
+            result->errors = candidate->errors;
+            return result;
+        }
+
+        std::lock_guard<std::mutex> guard(lock);
+        misses++;
+        return nullptr;
+    }
+
+    void insert(const MachDxcHash& inputs, std::vector<MachDxcIncludeRecord> includes, MachDxcCompileResultImpl* result) {
+        std::shared_ptr<MachDxcCacheEntry> entry = std::make_shared<MachDxcCacheEntry>();
+        entry->inputs = inputs;
+        entry->includes = std::move(includes);
+        entry->object = result->object;
+        entry->errors = result->errors;
+        entry->size = sizeof(MachDxcCacheEntry);
+        if (entry->object != nullptr)
+            entry->size += entry->object->GetBufferSize();
+        if (entry->errors != nullptr)
+            entry->size += entry->errors->GetBufferSize();
+        for (const MachDxcIncludeRecord& include : entry->includes)
+            entry->size += sizeof(MachDxcIncludeRecord) + include.name.size();
+
+        if (entry->size > max_bytes)
+            return;
+
+        std::lock_guard<std::mutex> guard(lock);
+        lru.push_front(entry);
+        index.emplace(inputs, lru.begin());
+        bytes += entry->size;
+
+        while (bytes > max_bytes) {
+            std::shared_ptr<MachDxcCacheEntry> victim = lru.back();
+            auto range = index.equal_range(victim->inputs);
+            for (auto it = range.first; it != range.second; ++it) {
+                if (it->second->get() == victim.get()) {
+                    index.erase(it);
+                    break;
+                }
+            }
+            lru.pop_back();
+            bytes -= victim->size;
+            evictions++;
+        }
+    }
+
+    MachDxcCacheStats stats() {
+        std::lock_guard<std::mutex> guard(lock);
+        MachDxcCacheStats stats;
+        stats.hits = hits;
+        stats.misses = misses;
+        stats.evictions = evictions;
+        stats.entries = lru.size();
+        stats.bytes = bytes;
+        return stats;
+    }
+
+private:
+    typedef std::list<std::shared_ptr<MachDxcCacheEntry>> EntryList;
+
+    std::mutex lock;
+    size_t max_bytes;
+    size_t bytes = 0;
+    EntryList lru; // Most recently used first.
+    std::unordered_multimap<MachDxcHash, EntryList::iterator, MachDxcHashHasher> index;
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t evictions = 0;
+};
+
+//-------------------
+// Disk cache support
+//-------------------
+
+// A read-only mapping of a whole file.
+struct MachDxcFileMapping {
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+
+    ~MachDxcFileMapping() {
+        if (data == nullptr)
+            return;
+#ifdef _WIN32
+        UnmapViewOfFile(data);
+#else
+        munmap(const_cast<uint8_t*>(data), size);
+#endif
+    }
+};
+
+// Maps `path` read-only, or returns null if it doesn't exist or is empty.
+static std::shared_ptr<MachDxcFileMapping> mapFileReadOnly(const std::string& path) {
+    std::shared_ptr<MachDxcFileMapping> mapping = std::make_shared<MachDxcFileMapping>();
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return nullptr;
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+        CloseHandle(file);
+        return nullptr;
+    }
+    HANDLE file_mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file);
+    if (file_mapping == nullptr)
+        return nullptr;
+    void* data = MapViewOfFile(file_mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(file_mapping);
+    if (data == nullptr)
+        return nullptr;
+    mapping->data = (const uint8_t*)data;
+    mapping->size = (size_t)file_size.QuadPart;
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+    void* data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return nullptr;
+    mapping->data = (const uint8_t*)data;
+    mapping->size = (size_t)st.st_size;
+#endif
+    return mapping;
+}
+
+static uint64_t fileSize(const std::string& path) {
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &attributes))
+        return 0;
+    return ((uint64_t)attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow;
+#else
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return 0;
+    return (uint64_t)st.st_size;
+#endif
+}
+
+// Appends `data` to the file at `path`, first padding the file with zeros up to a multiple of
+// eight bytes. Returns the offset the data was written at, or UINT64_MAX on failure. Callers
+// must hold the cache's write lock.
+static uint64_t appendToFile(const std::string& path, const std::vector<uint8_t>& data) {
+    uint64_t offset = fileSize(path);
+    uint64_t padding = (8 - offset % 8) % 8;
+    static const uint8_t zeros[8] = {};
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), FILE_APPEND_DATA, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return UINT64_MAX;
+    DWORD written = 0;
+    bool ok = (padding == 0 || WriteFile(file, zeros, (DWORD)padding, &written, nullptr)) &&
+        WriteFile(file, data.data(), (DWORD)data.size(), &written, nullptr) && written == data.size();
+    CloseHandle(file);
+#else
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+        return UINT64_MAX;
+    bool ok = padding == 0 || write(fd, zeros, padding) == (ssize_t)padding;
+    size_t total = 0;
+    while (ok && total < data.size()) {
+        ssize_t written = write(fd, data.data() + total, data.size() - total);
+        if (written <= 0)
+            ok = false;
+        else
+            total += (size_t)written;
+    }
+    close(fd);
+#endif
+    return ok ? offset + padding : UINT64_MAX;
+}
+
+// Returns true if the file is gone, including if it never existed. On Windows, deleting a file
+// fails while another process has it mapped.
+static bool removeFile(const std::string& path) {
+#ifdef _WIN32
+    return DeleteFileA(path.c_str()) || GetLastError() == ERROR_FILE_NOT_FOUND;
+#else
+    return unlink(path.c_str()) == 0 || errno == ENOENT;
+#endif
+}
+
+// An exclusive lock on a file, shared between processes. Used to serialize writers to a disk
+// cache directory; readers never take it.
+class MachDxcFileLock {
+public:
+    explicit MachDxcFileLock(const std::string& path) {
+#ifdef _WIN32
+        handle = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (handle != INVALID_HANDLE_VALUE) {
+            OVERLAPPED overlapped = {};
+            locked = LockFileEx(handle, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &overlapped);
+        }
+#else
+        fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd >= 0)
+            locked = flock(fd, LOCK_EX) == 0;
+#endif
+    }
+
+    ~MachDxcFileLock() {
+#ifdef _WIN32
+        if (handle != INVALID_HANDLE_VALUE) {
+            if (locked) {
+                OVERLAPPED overlapped = {};
+                UnlockFileEx(handle, 0, 1, 0, &overlapped);
+            }
+            CloseHandle(handle);
+        }
+#else
+        if (fd >= 0) {
+            if (locked)
+                flock(fd, LOCK_UN);
+            close(fd);
+        }
+#endif
+    }
+
+    bool isLocked() const { return locked; }
+
+private:
+#ifdef _WIN32
+    HANDLE handle = INVALID_HANDLE_VALUE;
+#else
+    int fd = -1;
+#endif
+    bool locked = false;
+};
+
+//-----------
+// Disk cache
+//-----------
+
+// On-disk layout of a cache directory:
+//
+//   lock      Empty file, locked by writers to serialize them across processes.
+//   index     A MachDxcDiskIndexHeader followed by an open-addressed hash table of
+//             MachDxcDiskIndexSlot, memory-mapped by every process using the cache.
+//   pack-N    Append-only files of records, each a MachDxcDiskRecordHeader followed by the
+//             include table, the object and the null-terminated error text, each padded to eight
+//             bytes. Records are written before the index slot pointing at them.
+//
+// Readers never lock. A slot torn by a concurrent writer, a record torn by a crash or a pack
+// deleted by eviction all show up as a record that fails validation against its slot's key and
+// the checksum in its header, and are treated as a miss. Eviction deletes whole packs, oldest
+// first, once their total size exceeds the configured limit, and then compacts the index to drop
+// the slots that pointed into them. Packs that can't be deleted yet, because another process
+// still has them mapped, are retried on later evictions and whenever the cache is opened.
+static const uint32_t kDiskIndexMagic = 0x4958444d; // "MDXI"
+static const uint32_t kDiskRecordMagic = 0x5258444d; // "MDXR"
+static const uint32_t kDiskCacheVersion = 1;
+static const uint32_t kDiskIndexCapacity = 1 << 16;
+static const uint32_t kDiskIndexMaxProbes = 16;
+
+struct MachDxcDiskIndexHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity;
+    uint32_t current_pack;
+    uint32_t oldest_pack;
+    uint32_t first_undeleted_pack; // evicted packs from here up to oldest_pack may still exist
+};
+
+struct MachDxcDiskIndexSlot {
+    uint8_t key[16];
+    uint32_t pack;
+    uint32_t reserved;
+    uint64_t offset;
+    uint64_t size; // 0 for an empty slot.
+};
+
+struct MachDxcDiskRecordHeader {
+    uint32_t magic;
+    uint32_t include_count;
+    uint8_t key[16];
+    uint64_t includes_size;
+    uint64_t object_size;
+    uint64_t errors_size;
+    uint8_t checksum[16]; // MD5 of everything following the header.
+};
+
+static size_t alignTo8(size_t size) {
+    return (size + 7) & ~(size_t)7;
+}
+
+class MachDxcDiskCache {
+public:
+    // Opens (creating if needed) the cache in `directory`. Returns null if the directory or index
+    // can't be set up.
+    static MachDxcDiskCache* open(const char* directory, size_t max_bytes) {
+        std::unique_ptr<MachDxcDiskCache> cache(new MachDxcDiskCache());
+        cache->directory = directory;
+        cache->max_bytes = max_bytes;
+#ifdef _WIN32
+        CreateDirectoryA(directory, nullptr);
+#else
+        mkdir(directory, 0755);
+#endif
+
+        size_t index_size = sizeof(MachDxcDiskIndexHeader) + sizeof(MachDxcDiskIndexSlot) * kDiskIndexCapacity;
+        MachDxcFileLock file_lock(cache->path("lock"));
+        if (!file_lock.isLocked())
+            return nullptr;
+        if (!cache->mapIndex(index_size))
+            return nullptr;
+
+        MachDxcDiskIndexHeader* header = cache->indexHeader();
+        if (header->magic != kDiskIndexMagic || header->version != kDiskCacheVersion || header->capacity != kDiskIndexCapacity) {
+            // New or incompatible: start over with an empty table.
+            std::memset(cache->index_data, 0, index_size);
+            header->magic = kDiskIndexMagic;
+            header->version = kDiskCacheVersion;
+            header->capacity = kDiskIndexCapacity;
+        }
+        cache->removeEvictedPacks();
+        return cache.release();
+    }
+
+    ~MachDxcDiskCache() {
+        if (index_data == nullptr)
+            return;
+#ifdef _WIN32
+        UnmapViewOfFile(index_data);
+#else
+        munmap(index_data, index_size);
+#endif
+    }
+
+    // Returns a new result for a matching record, or nullptr on a miss. The object and errors of
+    // the result point directly into the mapped pack file.
+    MachDxcCompileResultImpl* lookup(
+        const MachDxcHash& inputs,
+        MachDxcIncludeCallbacks* callbacks,
+        MachDxcIncludeCache* include_cache,
+        std::vector<MachDxcIncludeRecord>* includes
+    ) {
+        MachDxcDiskIndexSlot slot;
+        if (!findSlot(inputs, &slot)) {
+            misses++;
+            return nullptr;
+        }
+
+        std::shared_ptr<MachDxcFileMapping> mapping = mapPack(slot.pack, slot.offset + slot.size);
+        if (mapping == nullptr || !validRecord(mapping.get(), slot, inputs)) {
+            misses++;
+            return nullptr;
+        }
+
+        const uint8_t* record = mapping->data + slot.offset;
+        MachDxcDiskRecordHeader header;
+        std::memcpy(&header, record, sizeof(header));
+
+        includes->clear();
+        const uint8_t* cursor = record + sizeof(header);
+        const uint8_t* includes_end = cursor + header.includes_size;
+        for (uint32_t i = 0; i < header.include_count; i++) {
+            MachDxcIncludeRecord include;
+            uint32_t name_len;
+            if (includes_end - cursor < (ptrdiff_t)(sizeof(include.hash) + sizeof(name_len))) {
+                misses++;
+                return nullptr;
+            }
+            std::memcpy(include.hash.bytes, cursor, sizeof(include.hash.bytes));
+            std::memcpy(&name_len, cursor + sizeof(include.hash.bytes), sizeof(name_len));
+            cursor += sizeof(include.hash.bytes) + sizeof(name_len);
+            if ((size_t)(includes_end - cursor) < name_len) {
+                misses++;
+                return nullptr;
+            }
+            include.name.assign((const char*)cursor, name_len);
+            cursor += name_len;
+            includes->push_back(std::move(include));
+        }
+
+        if (!includesUnchanged(*includes, callbacks, include_cache)) {
+            misses++;
+            return nullptr;
+        }
+
+        MachDxcCompileResultImpl* result = new MachDxcCompileResultImpl();
+        const uint8_t* object = record + sizeof(header) + alignTo8(header.includes_size);
+        const uint8_t* errors = object + alignTo8(header.object_size);
+        if (header.object_size > 0)
+            result->object = new MachDxcViewBlob(object, header.object_size, false, mapping);
+        if (header.errors_size > 0)
+            result->errors = new MachDxcViewBlob(errors, header.errors_size, true, mapping);
+        hits++;
+        return result;
+    }
+
+    void insert(const MachDxcHash& inputs, const std::vector<MachDxcIncludeRecord>& includes, MachDxcCompileResultImpl* result) {
+        MachDxcDiskRecordHeader header = {};
+        header.magic = kDiskRecordMagic;
+        header.include_count = (uint32_t)includes.size();
+        std::memcpy(header.key, inputs.bytes, sizeof(header.key));
+        for (const MachDxcIncludeRecord& include : includes)
+            header.includes_size += sizeof(include.hash.bytes) + sizeof(uint32_t) + include.name.size();
+        header.object_size = result->object != nullptr ? result->object->GetBufferSize() : 0;
+        header.errors_size = result->errors != nullptr ? result->errors->GetStringLength() + 1 : 0;
+
+        size_t body_size = alignTo8(header.includes_size) + alignTo8(header.object_size) + alignTo8(header.errors_size);
+        std::vector<uint8_t> record(sizeof(header) + body_size, 0);
+        uint8_t* cursor = record.data() + sizeof(header);
+        for (const MachDxcIncludeRecord& include : includes) {
+            uint32_t name_len = (uint32_t)include.name.size();
+            std::memcpy(cursor, include.hash.bytes, sizeof(include.hash.bytes));
+            std::memcpy(cursor + sizeof(include.hash.bytes), &name_len, sizeof(name_len));
+            std::memcpy(cursor + sizeof(include.hash.bytes) + sizeof(name_len), include.name.data(), name_len);
+            cursor += sizeof(include.hash.bytes) + sizeof(name_len) + name_len;
+        }
+        cursor = record.data() + sizeof(header) + alignTo8(header.includes_size);
+        if (header.object_size > 0)
+            std::memcpy(cursor, result->object->GetBufferPointer(), header.object_size);
+        cursor += alignTo8(header.object_size);
+        if (header.errors_size > 0)
+            std::memcpy(cursor, result->errors->GetStringPointer(), header.errors_size - 1);
+
+        MachDxcHash checksum = hashBytes(record.data() + sizeof(header), body_size);
+        std::memcpy(header.checksum, checksum.bytes, sizeof(header.checksum));
+        std::memcpy(record.data(), &header, sizeof(header));
+
+        if (record.size() > max_bytes)
+            return;
+
+        MachDxcFileLock file_lock(path("lock"));
+        if (!file_lock.isLocked())
+            return;
+
+        // Each pack holds roughly a quarter of the cache, so eviction drops about a quarter at a
+        // time.
+        MachDxcDiskIndexHeader* index_header = indexHeader();
+        uint64_t pack_limit = max_bytes / 4;
+        if (fileSize(packPath(index_header->current_pack)) + record.size() > pack_limit &&
+            fileSize(packPath(index_header->current_pack)) > 0)
+            index_header->current_pack++;
+
+        uint32_t pack = index_header->current_pack;
+        uint64_t offset = appendToFile(packPath(pack), record);
+        if (offset == UINT64_MAX)
+            return;
+
+        MachDxcDiskIndexSlot slot = {};
+        std::memcpy(slot.key, inputs.bytes, sizeof(slot.key));
+        slot.pack = pack;
+        slot.offset = offset;
+        slot.size = record.size();
+        storeSlot(inputs, slot);
+
+        uint64_t total = 0;
+        for (uint32_t p = index_header->oldest_pack; p <= index_header->current_pack; p++)
+            total += fileSize(packPath(p));
+        uint32_t oldest_pack = index_header->oldest_pack;
+        while (total > max_bytes && index_header->oldest_pack < index_header->current_pack) {
+            total -= fileSize(packPath(index_header->oldest_pack));
+            index_header->oldest_pack++;
+            evictions++;
+        }
+        if (index_header->oldest_pack != oldest_pack) {
+            compactIndex();
+            removeEvictedPacks();
+        }
+    }
+
+    MachDxcCacheStats stats() {
+        MachDxcCacheStats stats = {};
+        stats.hits = hits;
+        stats.misses = misses;
+        stats.evictions = evictions;
+
+        MachDxcDiskIndexHeader* header = indexHeader();
+        for (uint32_t i = 0; i < kDiskIndexCapacity; i++) {
+            if (indexSlots()[i].size != 0 && indexSlots()[i].pack >= header->oldest_pack)
+                stats.entries++;
+        }
+        for (uint32_t p = header->oldest_pack; p <= header->current_pack; p++)
+            stats.bytes += (size_t)fileSize(packPath(p));
+        return stats;
+    }
+
+private:
+    MachDxcDiskCache() = default;
+
+    std::string path(const char* name) const {
+        return directory + "/" + name;
+    }
+
+    std::string packPath(uint32_t pack) const {
+        return directory + "/pack-" + std::to_string(pack);
+    }
+
+    MachDxcDiskIndexHeader* indexHeader() {
+        return (MachDxcDiskIndexHeader*)index_data;
+    }
+
+    MachDxcDiskIndexSlot* indexSlots() {
+        return (MachDxcDiskIndexSlot*)(index_data + sizeof(MachDxcDiskIndexHeader));
+    }
+
+    // Maps the index file read-write, growing it to `size` if it is smaller. Callers must hold
+    // the write lock.
+    bool mapIndex(size_t size) {
+        std::string index_path = path("index");
+#ifdef _WIN32
+        HANDLE file = CreateFileA(index_path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+        HANDLE file_mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, 0, (DWORD)size, nullptr);
+        CloseHandle(file);
+        if (file_mapping == nullptr)
+            return false;
+        void* data = MapViewOfFile(file_mapping, FILE_MAP_WRITE, 0, 0, size);
+        CloseHandle(file_mapping);
+        if (data == nullptr)
+            return false;
+#else
+        int fd = ::open(index_path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || ((size_t)st.st_size < size && ftruncate(fd, (off_t)size) != 0)) {
+            close(fd);
+            return false;
+        }
+        void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED)
+            return false;
+#endif
+        index_data = (uint8_t*)data;
+        index_size = size;
+        return true;
+    }
+
+    // Deletes the evicted packs still on disk, stopping short of the first that can't be deleted
+    // yet so that it is retried next time. Callers must hold the write lock.
+    void removeEvictedPacks() {
+        MachDxcDiskIndexHeader* header = indexHeader();
+        bool contiguous = true;
+        for (uint32_t p = header->first_undeleted_pack; p < header->oldest_pack; p++) {
+            bool removed = removeFile(packPath(p));
+            contiguous = contiguous && removed;
+            if (contiguous)
+                header->first_undeleted_pack = p + 1;
+        }
+    }
+
+    // Rebuilds the index without the slots pointing into evicted packs, so that they stop taking
+    // up room in probe sequences. Readers racing with this see misses. Callers must hold the
+    // write lock.
+    void compactIndex() {
+        std::vector<MachDxcDiskIndexSlot> live;
+        for (uint32_t i = 0; i < kDiskIndexCapacity; i++) {
+            const MachDxcDiskIndexSlot& slot = indexSlots()[i];
+            if (slot.size != 0 && slot.pack >= indexHeader()->oldest_pack)
+                live.push_back(slot);
+        }
+        std::memset(indexSlots(), 0, sizeof(MachDxcDiskIndexSlot) * kDiskIndexCapacity);
+        for (const MachDxcDiskIndexSlot& slot : live) {
+            MachDxcHash key;
+            std::memcpy(key.bytes, slot.key, sizeof(key.bytes));
+            storeSlot(key, slot);
+        }
+    }
+
+    bool findSlot(const MachDxcHash& inputs, MachDxcDiskIndexSlot* out) {
+        size_t start = MachDxcHashHasher()(inputs);
+        for (uint32_t probe = 0; probe < kDiskIndexMaxProbes; probe++) {
+            // Copy the slot out first, another process may be rewriting it.
+            std::memcpy(out, &indexSlots()[(start + probe) % kDiskIndexCapacity], sizeof(*out));
+            if (out->size == 0)
+                return false;
+            if (std::memcmp(out->key, inputs.bytes, sizeof(out->key)) == 0)
+                return true;
+        }
+        return false;
+    }
+
+    // Writes `slot` to the slot already holding its key, the first empty slot, or failing that
+    // the key's home slot. Callers must hold the write lock.
+    void storeSlot(const MachDxcHash& inputs, const MachDxcDiskIndexSlot& slot) {
+        size_t start = MachDxcHashHasher()(inputs);
+        size_t target = start % kDiskIndexCapacity;
+        for (uint32_t probe = 0; probe < kDiskIndexMaxProbes; probe++) {
+            size_t i = (start + probe) % kDiskIndexCapacity;
+            MachDxcDiskIndexSlot* existing = &indexSlots()[i];
+            if (existing->size == 0 || std::memcmp(existing->key, inputs.bytes, sizeof(existing->key)) == 0 ||
+                existing->pack < indexHeader()->oldest_pack) {
+                target = i;
+                break;
+            }
+        }
+        std::memcpy(&indexSlots()[target], &slot, sizeof(slot));
+    }
+
+    // Returns a mapping of `pack` covering at least `min_size` bytes, remapping if the pack has
+    // grown since it was last mapped.
+    std::shared_ptr<MachDxcFileMapping> mapPack(uint32_t pack, uint64_t min_size) {
+        std::lock_guard<std::mutex> guard(lock);
+
+        // Drop mappings of evicted packs, outstanding blobs keep their own reference.
+        for (auto it = pack_mappings.begin(); it != pack_mappings.end();) {
+            if (it->first < indexHeader()->oldest_pack)
+                it = pack_mappings.erase(it);
+            else
+                ++it;
+        }
+        if (pack < indexHeader()->oldest_pack)
+            return nullptr;
+
+        std::shared_ptr<MachDxcFileMapping>& mapping = pack_mappings[pack];
+        if (mapping == nullptr || mapping->size < min_size)
+            mapping = mapFileReadOnly(packPath(pack));
+        if (mapping == nullptr || mapping->size < min_size)
+            return nullptr;
+        return mapping;
+    }
+
+    bool validRecord(MachDxcFileMapping* mapping, const MachDxcDiskIndexSlot& slot, const MachDxcHash& inputs) {
+        if (slot.size < sizeof(MachDxcDiskRecordHeader) || slot.offset % 8 != 0)
+            return false;
+
+        MachDxcDiskRecordHeader header;
+        std::memcpy(&header, mapping->data + slot.offset, sizeof(header));
+        if (header.magic != kDiskRecordMagic || std::memcmp(header.key, inputs.bytes, sizeof(header.key)) != 0)
+            return false;
+
+        // Compare against the slot's size with overflow-safe arithmetic, the header may be garbage.
+        uint64_t body_size = slot.size - sizeof(header);
+        if (header.includes_size > body_size || header.object_size > body_size || header.errors_size > body_size ||
+            alignTo8(header.includes_size) + alignTo8(header.object_size) + alignTo8(header.errors_size) != body_size)
+            return false;
+
+        MachDxcHash checksum = hashBytes(mapping->data + slot.offset + sizeof(header), body_size);
+        return std::memcmp(checksum.bytes, header.checksum, sizeof(header.checksum)) == 0;
+    }
+
+    std::string directory;
+    size_t max_bytes = 0;
+    uint8_t* index_data = nullptr;
+    size_t index_size = 0;
+
+    std::mutex lock; // Guards pack_mappings.
+    std::unordered_map<uint32_t, std::shared_ptr<MachDxcFileMapping>> pack_mappings;
+
+    std::atomic<size_t> hits{0};
+    std::atomic<size_t> misses{0};
+    std::atomic<size_t> evictions{0};
+};
+
+static const size_t kArgumentArenaChunkSize = 16 * 1024;
+static const size_t kArgumentArenaBudget = 1024 * 1024;
+
+// Interns the wchar_t form of every argument a context has been given, so that arguments
+// repeated across compiles (entry point, profile, shared flags) are converted once and a
+// steady-state compile allocates nothing. Converted strings live in chunks that never move.
+class MachDxcArgumentArena {
+public:
+    // Empties the arena once it has grown past its budget, which can happen when every compile
+    // has unique defines. Invalidates previously interned pointers, so only call between compiles.
+    void trim() {
+        if (bytes <= kArgumentArenaBudget)
+            return;
+        interned.clear();
+        chunks.clear();
+        chunk_used = 0;
+        chunk_size = 0;
+        bytes = 0;
+    }
+
+    LPCWSTR intern(const char* arg) {
+        size_t len = std::strlen(arg);
+        auto it = interned.find(std::string_view(arg, len));
+        if (it != interned.end())
+            return it->second;
+
+        char* key = (char*)allocate(len, 1);
+        std::memcpy(key, arg, len);
+        size_t wide_len = utf8ToWide(arg, len, nullptr);
+        wchar_t* wide = (wchar_t*)allocate((wide_len + 1) * sizeof(wchar_t), alignof(wchar_t));
+        utf8ToWide(arg, len, wide);
+        wide[wide_len] = L'\0';
+
+        interned.emplace(std::string_view(key, len), wide);
+        return wide;
+    }
+
+private:
+    void* allocate(size_t size, size_t align) {
+        size_t offset = (chunk_used + align - 1) & ~(align - 1);
+        if (chunks.empty() || offset + size > chunk_size) {
+            chunk_size = size > kArgumentArenaChunkSize ? size : kArgumentArenaChunkSize;
+            chunks.emplace_back(new char[chunk_size]);
+            offset = 0;
+        }
+        chunk_used = offset + size;
+        bytes += size;
+        return chunks.back().get() + offset;
+    }
+
+    std::vector<std::unique_ptr<char[]>> chunks;
+    size_t chunk_used = 0;
+    size_t chunk_size = 0;
+    size_t bytes = 0;
+    std::unordered_map<std::string_view, LPCWSTR> interned;
+};
+
+//------------------
+// Memory accounting
+//------------------
+
+// Returns the usable size of a block from the C heap.
+static size_t heapBlockSize(void* block) {
+#if defined(_WIN32)
+    return _msize(block);
+#elif defined(__APPLE__)
+    return malloc_size(block);
+#else
+    return malloc_usable_size(block);
+#endif
+}
+
+// Where a block handed out by a MachDxcAllocator goes back to, and the size it was requested with.
+struct MachDxcBlockOwner {
+    const MachDxcAllocator* allocator;
+    size_t size;
+};
+
+// Every live block handed out by a MachDxcAllocator, keyed by address. DXC releases blocks through
+// whichever allocator is installed on the releasing thread at the time, which may belong to
+// another compiler, or be none at all, in which case it calls free. Looking the block up here is
+// how each one finds its way back to the functions it came from, with its size, whatever path it
+// took. Sharded by address, so concurrent compiles rarely contend for a lock.
+//
+// Each shard is an open-addressed table with linear probing, allocated with malloc rather than
+// operator new, which would recurse into the IMalloc doing the lookup.
+struct MachDxcBlockShard {
+    struct Slot {
+        void* block; // Null if the slot is empty.
+        MachDxcBlockOwner owner;
+    };
+
+    std::mutex lock;
+    Slot* slots = nullptr;
+    size_t capacity = 0; // A power of two.
+    size_t count = 0;
+};
+
+static const size_t block_shard_count = 64;
+static const size_t block_shard_min_capacity = 256;
+
+// Set once any compiler is created with a MachDxcAllocator, so that until then no block is
+// looked up.
+static std::atomic<bool> block_registry_used{false};
+
+// Mixes the address so that both the shard and the slot depend on all of its significant bits.
+static uint64_t blockHash(void* block) {
+    return (uint64_t)(uintptr_t)block * 0x9e3779b97f4a7c15ull;
+}
+
+static MachDxcBlockShard& blockShard(void* block) {
+    // Never destroyed, blocks may still be released while the process exits.
+    static MachDxcBlockShard* shards = [] {
+        MachDxcBlockShard* shards = (MachDxcBlockShard*)malloc(sizeof(MachDxcBlockShard) * block_shard_count);
+        assert(shards != nullptr);
+        for (size_t i = 0; i < block_shard_count; i++)
+            new (&shards[i]) MachDxcBlockShard();
+        return shards;
+    }();
+    return shards[blockHash(block) >> 58];
+}
+
+static size_t blockSlot(const MachDxcBlockShard& shard, void* block) {
+    return (size_t)(blockHash(block) >> 24) & (shard.capacity - 1);
+}
+
+// Returns the slot holding `block`, or the empty slot where it would go.
+static size_t findBlockSlot(const MachDxcBlockShard& shard, void* block) {
+    size_t slot = blockSlot(shard, block);
+    while (shard.slots[slot].block != nullptr && shard.slots[slot].block != block)
+        slot = (slot + 1) & (shard.capacity - 1);
+    return slot;
+}
+
+// Keeps the shard at most three quarters full, returning false only if it can't grow and has no
+// room left for another block.
+static bool reserveBlockSlot(MachDxcBlockShard& shard) {
+    if ((shard.count + 1) * 4 <= shard.capacity * 3)
+        return true;
+    size_t capacity = shard.capacity != 0 ? shard.capacity * 2 : block_shard_min_capacity;
+    MachDxcBlockShard::Slot* slots = (MachDxcBlockShard::Slot*)calloc(capacity, sizeof(MachDxcBlockShard::Slot));
+    if (slots == nullptr)
+        return shard.count + 1 < shard.capacity;
+    MachDxcBlockShard::Slot* old_slots = shard.slots;
+    size_t old_capacity = shard.capacity;
+    shard.slots = slots;
+    shard.capacity = capacity;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old_slots[i].block != nullptr)
+            shard.slots[findBlockSlot(shard, old_slots[i].block)] = old_slots[i];
+    }
+    free(old_slots);
+    return true;
+}
+
+// Returns false if there was no memory to record the block.
+static bool registerBlock(void* block, const MachDxcAllocator* allocator, size_t size) {
+    MachDxcBlockShard& shard = blockShard(block);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    if (!reserveBlockSlot(shard))
+        return false;
+    size_t slot = findBlockSlot(shard, block);
+    if (shard.slots[slot].block == nullptr)
+        shard.count++;
+    shard.slots[slot] = {block, {allocator, size}};
+    return true;
+}
+
+// Looks `block` up, returning false if it isn't a MachDxcAllocator's. If `remove` is set, it is
+// also removed, which must happen before it is freed, as the address may be handed out again at
+// once.
+static bool lookUpBlock(void* block, MachDxcBlockOwner* owner, bool remove) {
+    if (!block_registry_used.load(std::memory_order_acquire))
+        return false;
+    MachDxcBlockShard& shard = blockShard(block);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    if (shard.count == 0)
+        return false;
+    size_t slot = findBlockSlot(shard, block);
+    if (shard.slots[slot].block == nullptr)
+        return false;
+    *owner = shard.slots[slot].owner;
+    if (!remove)
+        return true;
+
+    // Shifts back the entries that follow in the same run, so that none of them ends up behind
+    // an empty slot that lookups would stop at.
+    size_t mask = shard.capacity - 1;
+    size_t next = slot;
+    for (;;) {
+        next = (next + 1) & mask;
+        if (shard.slots[next].block == nullptr)
+            break;
+        size_t home = blockSlot(shard, shard.slots[next].block);
+        bool stays = slot <= next ? (slot < home && home <= next) : (slot < home || home <= next);
+        if (!stays) {
+            shard.slots[slot] = shard.slots[next];
+            slot = next;
+        }
+    }
+    shard.slots[slot].block = nullptr;
+    shard.count--;
+    return true;
+}
+
+// Returns a copy of `allocator` that lives as long as the process, shared by every compiler
+// created with the same functions and context, so that registered blocks can refer to it after
+// the compiler that allocated them is gone.
+static const MachDxcAllocator* internAllocator(const MachDxcAllocator* allocator) {
+    struct Interned {
+        MachDxcAllocator allocator;
+        Interned* next;
+    };
+    static std::mutex lock;
+    static Interned* interned = nullptr;
+
+    std::lock_guard<std::mutex> guard(lock);
+    for (Interned* entry = interned; entry != nullptr; entry = entry->next) {
+        if (entry->allocator.ctx == allocator->ctx && entry->allocator.alloc_func == allocator->alloc_func &&
+            entry->allocator.realloc_func == allocator->realloc_func && entry->allocator.free_func == allocator->free_func)
+            return &entry->allocator;
+    }
+    Interned* entry = (Interned*)malloc(sizeof(Interned));
+    assert(entry != nullptr);
+    entry->allocator = *allocator;
+    entry->next = interned;
+    interned = entry;
+    block_registry_used.store(true, std::memory_order_release);
+    return &entry->allocator;
+}
+
+// Allocates from `allocator`, or from the C heap if it is null.
+static void* allocBlock(const MachDxcAllocator* allocator, size_t size) {
+    if (size == 0)
+        size = 1;
+    if (allocator == nullptr)
+        return malloc(size);
+    void* block = allocator->alloc_func(allocator->ctx, size);
+    if (block != nullptr && !registerBlock(block, allocator, size)) {
+        allocator->free_func(allocator->ctx, block);
+        return nullptr;
+    }
+    return block;
+}
+
+// Returns the size of a block from the C heap or any MachDxcAllocator, which for the latter is
+// the size it was requested with.
+static size_t anyBlockSize(void* block) {
+    MachDxcBlockOwner owner;
+    if (lookUpBlock(block, &owner, false))
+        return owner.size;
+    return heapBlockSize(block);
+}
+
+// Frees a block from the C heap or any MachDxcAllocator, returning its size.
+static size_t freeAnyBlock(void* block) {
+    MachDxcBlockOwner owner;
+    if (lookUpBlock(block, &owner, true)) {
+        owner.allocator->free_func(owner.allocator->ctx, block);
+        return owner.size;
+    }
+    size_t size = heapBlockSize(block);
+    free(block);
+    return size;
+}
+
+// Resizes a block from the C heap or any MachDxcAllocator, which stays with the allocator it came
+// from. Sets `old_size` and `new_size` on success.
+static void* reallocAnyBlock(void* block, size_t size, size_t* old_size, size_t* new_size) {
+    MachDxcBlockOwner owner;
+    if (lookUpBlock(block, &owner, true)) {
+        void* grown = owner.allocator->realloc_func(owner.allocator->ctx, block, size);
+        if (grown == nullptr) {
+            // A failed realloc leaves the block as it was, and the slot it had is free to reuse.
+            registerBlock(block, owner.allocator, owner.size);
+            return nullptr;
+        }
+        // The block has moved, so it can neither be handed back untracked nor given up.
+        if (!registerBlock(grown, owner.allocator, size))
+            std::abort();
+        *old_size = owner.size;
+        *new_size = size;
+        return grown;
+    }
+    *old_size = heapBlockSize(block);
+    void* grown = realloc(block, size);
+    if (grown != nullptr)
+        *new_size = heapBlockSize(grown);
+    return grown;
+}
+
+// The thread allocator installed by MachDxcHeapScope. New blocks come from the C heap, as they
+// would with no allocator installed, but blocks are released to whichever allocator they came
+// from. Stateless, so it stays usable while the process exits.
+class MachDxcHeapMalloc : public IMalloc
+{
+public:
+    ULONG STDMETHODCALLTYPE AddRef() override { return 1; }
+    ULONG STDMETHODCALLTYPE Release() override { return 1; }
+
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void **ppvObject) override {
+        if (riid == __uuidof(IUnknown) || riid == __uuidof(IMalloc)) {
+            *ppvObject = this;
+            return S_OK;
+        }
+        *ppvObject = nullptr;
+        return E_NOINTERFACE;
+    }
+
+    void* STDMETHODCALLTYPE Alloc(SIZE_T size) override { return allocBlock(nullptr, size); }
+
+    void* STDMETHODCALLTYPE Realloc(void* block, SIZE_T size) override {
+        if (block == nullptr)
+            return Alloc(size);
+        if (size == 0) {
+            Free(block);
+            return nullptr;
+        }
+        size_t old_size, new_size;
+        return reallocAnyBlock(block, size, &old_size, &new_size);
+    }
+
+    void STDMETHODCALLTYPE Free(void* block) override {
+        if (block != nullptr)
+            freeAnyBlock(block);
+    }
+
+    SIZE_T STDMETHODCALLTYPE GetSize(void* block) override {
+        return block != nullptr ? anyBlockSize(block) : (SIZE_T)-1;
+    }
+
+    int STDMETHODCALLTYPE DidAlloc(void*) override { return -1; }
+
+    void STDMETHODCALLTYPE HeapMinimize() override {}
+};
+
+static IMalloc* heapMalloc() {
+    static MachDxcHeapMalloc heap_malloc;
+    return &heap_malloc;
+}
+
+static const size_t memory_size_classes = sizeof(MachDxcMemoryStats::size_histogram) / sizeof(uint64_t);
+
+// The IMalloc a compile context's DXC instance is created with. DXC makes it the calling thread's
+// allocator for the duration of each call, and its operator new and delete overrides (dxcmem.cpp)
+// allocate through it, so it sees nearly every allocation made by a compile.
+//
+// By default blocks come straight from the C heap. With a MachDxcAllocator, they come from its
+// functions instead and are recorded in the block registry, so that each one goes back to those
+// functions whichever allocator DXC releases it with. The reverse also happens: DXC falls back to
+// malloc and free on threads without an allocator, so blocks from the C heap may be released or
+// resized here, and are returned to it. Blocks from earlier compiles can also be released by
+// other threads while a compile runs, which is why the counters are atomic and the live byte
+// count may drift below zero.
+//
+// Between beginArena() and endArena(), allocations made on the compiling thread are instead
+// bumped out of chunks that are recycled all at once by endArena(). Arena blocks are recognized by
+// address from any thread, at any time, and freeing them does nothing. Should any of them still be
+// live when the compile ends, such as state DXC set up lazily for the process, their chunks are
+// retired rather than recycled and the arena isn't used again.
+class MachDxcCountingMalloc : public IMalloc
+{
+public:
+    // `backend` is an allocator from internAllocator(), or null to allocate from the C heap.
+    explicit MachDxcCountingMalloc(const MachDxcAllocator* backend) : backend(backend) {}
+
+    ~MachDxcCountingMalloc() {
+        for (size_t i = 0; i < arena_max_chunks; i++) {
+            if (arena_ranges[i].size != 0)
+                freeAnyBlock(arena_ranges[i].begin);
+        }
+    }
+
+    ULONG STDMETHODCALLTYPE AddRef() override { return ++ref_count; }
+    ULONG STDMETHODCALLTYPE Release() override {
+        ULONG count = --ref_count;
+        if (count == 0) {
+            MachDxcHeapScope heap;
+            delete this;
+        }
+        return count;
+    }
+
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void **ppvObject) override {
+        if (riid == __uuidof(IUnknown) || riid == __uuidof(IMalloc)) {
+            AddRef();
+            *ppvObject = this;
+            return S_OK;
+        }
+        *ppvObject = nullptr;
+        return E_NOINTERFACE;
+    }
+
+    void* STDMETHODCALLTYPE Alloc(SIZE_T size) override {
+        if (onArenaThread()) {
+            void* block = arenaAlloc(size);
+            if (block != nullptr) {
+                arena_live += arenaBlockSize(block);
+                allocated(size, arenaBlockSize(block));
+                arena_allocations++;
+                arena_bytes += arenaBlockSize(block);
+                return block;
+            }
+        }
+        void* block = allocBlock(backend, size);
+        if (block != nullptr)
+            allocated(size, allocatedSize(block, size));
+        return block;
+    }
+
+    void* STDMETHODCALLTYPE Realloc(void* block, SIZE_T size) override {
+        if (block == nullptr)
+            return Alloc(size);
+        if (size == 0) {
+            Free(block);
+            return nullptr;
+        }
+        if (inArena(block)) {
+            size_t old_size = arenaBlockSize(block);
+            if (size <= old_size)
+                return block;
+            // Outside of the arena's compile the block moves to the heap, and its old copy is
+            // left for the arena to recycle.
+            bool arena = onArenaThread();
+            void* grown = arena ? arenaAlloc(size) : nullptr;
+            bool grown_in_arena = grown != nullptr;
+            if (grown == nullptr)
+                grown = allocBlock(backend, size);
+            if (grown == nullptr)
+                return nullptr;
+            memcpy(grown, block, old_size);
+            size_t new_size = grown_in_arena ? arenaBlockSize(grown) : allocatedSize(grown, size);
+            if (arena)
+                arena_live -= old_size;
+            if (grown_in_arena) {
+                arena_live += new_size;
+                arena_bytes += new_size - old_size;
+            }
+            resized(old_size, new_size);
+            return grown;
+        }
+        // The block stays with the allocator it came from, which may not be this one's.
+        size_t old_size = 0;
+        size_t new_size = 0;
+        void* grown = reallocAnyBlock(block, size, &old_size, &new_size);
+        if (grown == nullptr)
+            return nullptr;
+        resized(old_size, new_size);
+        return grown;
+    }
+
+    void STDMETHODCALLTYPE Free(void* block) override {
+        if (block == nullptr)
+            return;
+        if (inArena(block)) {
+            if (onArenaThread()) {
+                arena_live -= arenaBlockSize(block);
+                freed(arenaBlockSize(block));
+                arena_frees++;
+            }
+            return;
+        }
+        freed(freeAnyBlock(block));
+    }
+
+    SIZE_T STDMETHODCALLTYPE GetSize(void* block) override {
+        if (block == nullptr)
+            return (SIZE_T)-1;
+        return inArena(block) ? arenaBlockSize(block) : anyBlockSize(block);
+    }
+
+    // Blocks from this allocator and from malloc can't be told apart.
+    int STDMETHODCALLTYPE DidAlloc(void*) override { return -1; }
+
+    void STDMETHODCALLTYPE HeapMinimize() override {}
+
+    // Starts counting the allocations of a compile.
+    void begin() {
+        live_at_begin = live.load();
+        peak = live_at_begin;
+        allocated_bytes = 0;
+        allocations = 0;
+        frees = 0;
+        reallocations = 0;
+        arena_bytes = 0;
+        arena_allocations = 0;
+        arena_frees = 0;
+        for (std::atomic<uint64_t>& count : size_histogram)
+            count = 0;
+    }
+
+    // Returns what was counted since begin().
+    MachDxcMemoryStats end() {
+        MachDxcMemoryStats stats = {};
+        int64_t peak_bytes = peak.load() - live_at_begin;
+        int64_t retained_bytes = live.load() - live_at_begin;
+        stats.peak_bytes = peak_bytes > 0 ? (uint64_t)peak_bytes : 0;
+        stats.retained_bytes = retained_bytes > 0 ? (uint64_t)retained_bytes : 0;
+        stats.allocated_bytes = allocated_bytes;
+        stats.allocations = allocations;
+        stats.frees = frees;
+        stats.reallocations = reallocations;
+        stats.arena_bytes = arena_bytes;
+        stats.arena_allocations = arena_allocations;
+        stats.arena_frees = arena_frees;
+        for (size_t i = 0; i < memory_size_classes; i++)
+            stats.size_histogram[i] = size_histogram[i];
+        return stats;
+    }
+
+    // Serves allocations made on the calling thread from the arena until endArena(), unless the
+    // arena has been retired.
+    void beginArena() {
+        if (!arena_retired)
+            arena_thread = std::this_thread::get_id();
+    }
+
+    // Recycles the arena if everything allocated from it has been freed. Only the largest chunk
+    // is kept for the next compile, so one unusually large compile doesn't pin its memory.
+    // Otherwise the chunks stay allocated, and recognized as the arena's, for as long as this
+    // allocator lives, because whatever is left in them may still be in use.
+    void endArena() {
+        arena_thread = std::thread::id();
+        live -= arena_live;
+        bool recyclable = arena_live == 0;
+        arena_live = 0;
+
+        if (!recyclable) {
+            arena_retired = true;
+            arena_chunk_count = 0;
+            arena_top = nullptr;
+            arena_end = nullptr;
+            return;
+        }
+
+        size_t largest = 0;
+        for (size_t i = 1; i < arena_chunk_count; i++) {
+            if (arena_ranges[arena_chunks[i]].size > arena_ranges[arena_chunks[largest]].size)
+                largest = i;
+        }
+        for (size_t i = 0; i < arena_chunk_count; i++) {
+            if (i == largest)
+                continue;
+            // Forget the range before freeing it, the heap may hand its memory out again at once.
+            char* chunk = arena_ranges[arena_chunks[i]].begin;
+            arena_ranges[arena_chunks[i]].size = 0;
+            freeAnyBlock(chunk);
+        }
+        if (arena_chunk_count != 0) {
+            ArenaRange& kept = arena_ranges[arena_chunks[largest]];
+            arena_chunks[0] = arena_chunks[largest];
+            arena_chunk_count = 1;
+            arena_last_chunk = kept.size;
+            arena_top = kept.begin;
+            arena_end = kept.begin + kept.size;
+        }
+    }
+
+private:
+    // Keeps arena blocks aligned as well as malloc aligns them.
+    static const size_t block_header_size = 16;
+
+    static const size_t arena_min_chunk = (size_t)1 << 20;
+    static const size_t arena_max_chunk = (size_t)64 << 20;
+    static const size_t arena_max_chunks = 32;
+
+    // A chunk allocated for the arena, or an unused slot if size is 0. Written only on the arena
+    // thread, read by any thread freeing a block.
+    struct ArenaRange {
+        std::atomic<char*> begin{nullptr};
+        std::atomic<size_t> size{0};
+    };
+
+    static void* withHeader(void* base, size_t size) {
+        *(size_t*)base = size;
+        return (char*)base + block_header_size;
+    }
+
+    static void* headerOf(void* block) {
+        return (char*)block - block_header_size;
+    }
+
+    // The size of a block just allocated with allocBlock(), counted as requested for a
+    // MachDxcAllocator, whose usable size is unknown.
+    size_t allocatedSize(void* block, size_t size) const {
+        return backend != nullptr ? size : heapBlockSize(block);
+    }
+
+    bool onArenaThread() const {
+        return arena_thread.load(std::memory_order_relaxed) == std::this_thread::get_id();
+    }
+
+    // Whether `block` lies in a chunk of the current or a retired arena, from any thread. Chunks
+    // double in size, so there are few enough to search linearly.
+    bool inArena(void* block) const {
+        size_t used = arena_ranges_used.load(std::memory_order_acquire);
+        for (size_t i = 0; i < used; i++) {
+            size_t size = arena_ranges[i].size.load(std::memory_order_acquire);
+            char* begin = arena_ranges[i].begin.load(std::memory_order_relaxed);
+            if (size != 0 && (char*)block >= begin && (char*)block < begin + size)
+                return true;
+        }
+        return false;
+    }
+
+    // Records a new chunk of the current arena, returning false if there is no slot left for it.
+    bool addArenaChunk(char* chunk, size_t size) {
+        if (arena_chunk_count == arena_max_chunks)
+            return false;
+        for (size_t i = 0; i < arena_max_chunks; i++) {
+            if (arena_ranges[i].size.load(std::memory_order_relaxed) != 0)
+                continue;
+            arena_ranges[i].begin.store(chunk, std::memory_order_relaxed);
+            arena_ranges[i].size.store(size, std::memory_order_release);
+            if (arena_ranges_used.load(std::memory_order_relaxed) <= i)
+                arena_ranges_used.store(i + 1, std::memory_order_release);
+            arena_chunks[arena_chunk_count++] = i;
+            arena_last_chunk = size;
+            return true;
+        }
+        return false;
+    }
+
+    static size_t arenaBlockSize(void* block) {
+        return *(size_t*)headerOf(block);
+    }
+
+    void* arenaAlloc(size_t size) {
+        size_t rounded = (size + block_header_size - 1) & ~(block_header_size - 1);
+        size_t needed = rounded + block_header_size;
+        if ((size_t)(arena_end - arena_top) < needed) {
+            size_t chunk_size = arena_chunk_count == 0 ? arena_min_chunk : arena_last_chunk * 2;
+            if (chunk_size > arena_max_chunk)
+                chunk_size = arena_max_chunk;
+            if (chunk_size < needed)
+                chunk_size = needed;
+            char* chunk = (char*)allocBlock(backend, chunk_size);
+            if (chunk == nullptr)
+                return nullptr;
+            if (!addArenaChunk(chunk, chunk_size)) {
+                freeAnyBlock(chunk);
+                return nullptr;
+            }
+            arena_top = chunk;
+            arena_end = chunk + chunk_size;
+        }
+        void* block = withHeader(arena_top, rounded);
+        arena_top += needed;
+        return block;
+    }
+
+    void allocated(size_t requested, size_t size) {
+        int64_t now = live += (int64_t)size;
+        int64_t highest = peak.load(std::memory_order_relaxed);
+        while (now > highest && !peak.compare_exchange_weak(highest, now, std::memory_order_relaxed)) {}
+        allocated_bytes.fetch_add(size != 0 ? size : requested, std::memory_order_relaxed);
+        allocations.fetch_add(1, std::memory_order_relaxed);
+
+        size_t size_class = 0;
+        while (size_class + 1 < memory_size_classes && requested > ((size_t)16 << size_class))
+            size_class++;
+        size_histogram[size_class].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void freed(size_t size) {
+        live -= (int64_t)size;
+        frees.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // A block resized in place or moved by Realloc counts once, as a reallocation, with only
+    // its growth added to allocated_bytes.
+    void resized(size_t old_size, size_t new_size) {
+        int64_t now = live += (int64_t)new_size - (int64_t)old_size;
+        int64_t highest = peak.load(std::memory_order_relaxed);
+        while (now > highest && !peak.compare_exchange_weak(highest, now, std::memory_order_relaxed)) {}
+        if (new_size > old_size)
+            allocated_bytes.fetch_add(new_size - old_size, std::memory_order_relaxed);
+        reallocations.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    const MachDxcAllocator* backend;
+    std::atomic<ULONG> ref_count{0};
+    std::atomic<int64_t> live{0};
+    std::atomic<int64_t> peak{0};
+    int64_t live_at_begin = 0;
+    std::atomic<uint64_t> allocated_bytes{0};
+    std::atomic<uint64_t> allocations{0};
+    std::atomic<uint64_t> frees{0};
+    std::atomic<uint64_t> reallocations{0};
+    std::atomic<uint64_t> size_histogram[memory_size_classes] = {};
+
+    // Every chunk this allocator owns, from the current arena and any retired ones.
+    ArenaRange arena_ranges[arena_max_chunks];
+    std::atomic<size_t> arena_ranges_used{0};
+
+    // Only touched on the arena thread, or between compiles.
+    std::atomic<std::thread::id> arena_thread{};
+    size_t arena_chunks[arena_max_chunks]; // Indices into arena_ranges.
+    size_t arena_chunk_count = 0;
+    size_t arena_last_chunk = 0;
+    bool arena_retired = false;
+    char* arena_top = nullptr;
+    char* arena_end = nullptr;
+    int64_t arena_live = 0;
+    uint64_t arena_bytes = 0;
+    uint64_t arena_allocations = 0;
+    uint64_t arena_frees = 0;
+};
+
+// A DXC compiler instance plus the scratch state needed to drive it. A context is only ever used
+// by one thread at a time.
+struct MachDxcCompileContext {
+    CComPtr<IDxcCompiler3> compiler;
+    CComPtr<MachDxcCountingMalloc> allocator; // Counts the allocations of each compile.
+    MachDxcIncludeHandler include_handler;
+
+    // The argument list of the compile in progress, pointing into base args and the arena. It
+    // grows to fit the longest list seen so far and is then reused.
+    std::vector<LPCWSTR> arguments;
+    MachDxcArgumentArena argument_arena;
+
+    // The source of the compile in progress behind a prefix header's preamble, when it has one.
+    std::string prefixed_code;
+
+    // Spans of the compile in progress, when it is being traced.
+    std::vector<MachDxcTraceEvent>* trace_events = nullptr;
+
+    // Whether a compile has run on this context without the arena yet. DXC and LLVM initialize
+    // some process-wide state lazily on first use, which must not end up in an arena.
+    bool heap_compiled = false;
+
+    // Utilization, maintained by MachDxcContextPool.
+    std::chrono::steady_clock::time_point created_at;
+    std::chrono::steady_clock::time_point leased_at;
+    size_t leases = 0;
+    uint64_t busy_ns = 0;
+};
+
+static MachDxcCompileContext* createCompileContext(IDxcUtils* utils, const MachDxcAllocator* allocator) {
+    MachDxcCompileContext* context = new MachDxcCompileContext();
+    context->allocator = new MachDxcCountingMalloc(allocator);
+    // Should this fail, e.g. for lack of memory, runCompile tries again and reports the failure.
+    DxcCreateInstance2(context->allocator.p, CLSID_DxcCompiler, IID_PPV_ARGS(&context->compiler));
+    context->include_handler.utils = utils;
+    context->created_at = std::chrono::steady_clock::now();
+    return context;
+}
+
+static uint64_t elapsedNs(std::chrono::steady_clock::time_point since, std::chrono::steady_clock::time_point until) {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(until - since).count();
+}
+
+// The compile contexts of a compiler. Every compile leases one for its duration, so any number
+// of threads can compile through one handle. Contexts are created on demand up to max_contexts,
+// after which leases wait for one to be returned. The most recently returned context is handed
+// out first, as its DXC instance is the most likely to still be warm in cache.
+class MachDxcContextPool {
+public:
+    MachDxcContextPool(IDxcUtils* utils, size_t max_contexts, const MachDxcAllocator* allocator)
+        : utils(utils), max_contexts(max_contexts), allocator(allocator) {}
+
+    MachDxcCompileContext* lease() {
+        std::unique_lock<std::mutex> guard(lock);
+        if (idle.empty() && contexts.size() + creating >= max_contexts) {
+            std::chrono::steady_clock::time_point wait_start = std::chrono::steady_clock::now();
+            available.wait(guard, [&] { return !idle.empty() || contexts.size() + creating < max_contexts; });
+            uint64_t waited = elapsedNs(wait_start, std::chrono::steady_clock::now());
+            contended_leases++;
+            total_wait_ns += waited;
+            if (waited > max_wait_ns)
+                max_wait_ns = waited;
+        }
+        leases++;
+
+        MachDxcCompileContext* context;
+        if (!idle.empty()) {
+            context = idle.back();
+            idle.pop_back();
+        } else {
+            // Creating a DXC instance is slow, so don't hold up other leases meanwhile.
+            creating++;
+            guard.unlock();
+            context = createCompileContext(utils, allocator);
+            guard.lock();
+            creating--;
+            contexts.emplace_back(context);
+        }
+        context->leased_at = std::chrono::steady_clock::now();
+        context->leases++;
+        return context;
+    }
+
+    void release(MachDxcCompileContext* context) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            context->busy_ns += elapsedNs(context->leased_at, std::chrono::steady_clock::now());
+            idle.push_back(context);
+        }
+        available.notify_one();
+    }
+
+    size_t maxContexts() const { return max_contexts; }
+
+    MachDxcPoolStats stats() {
+        std::lock_guard<std::mutex> guard(lock);
+        MachDxcPoolStats stats;
+        stats.instances = contexts.size();
+        stats.max_instances = max_contexts;
+        stats.leases = leases;
+        stats.contended_leases = contended_leases;
+        stats.total_wait_ns = total_wait_ns;
+        stats.max_wait_ns = max_wait_ns;
+        return stats;
+    }
+
+    size_t instanceStats(MachDxcPoolInstanceStats* out, size_t capacity) {
+        std::lock_guard<std::mutex> guard(lock);
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < contexts.size() && i < capacity; i++) {
+            const MachDxcCompileContext& context = *contexts[i];
+            out[i].compiles = context.leases;
+            out[i].busy_ns = context.busy_ns;
+            out[i].age_ns = elapsedNs(context.created_at, now);
+        }
+        return contexts.size();
+    }
+
+private:
+    IDxcUtils* utils;
+    size_t max_contexts;
+    const MachDxcAllocator* allocator; // nullable, interned
+
+    std::mutex lock;
+    std::condition_variable available;
+    std::vector<std::unique_ptr<MachDxcCompileContext>> contexts;
+    std::vector<MachDxcCompileContext*> idle;
+    size_t creating = 0;
+    size_t leases = 0;
+    size_t contended_leases = 0;
+    uint64_t total_wait_ns = 0;
+    uint64_t max_wait_ns = 0;
+};
+
+// Holds a context leased from a pool for the lifetime of the scope.
+class MachDxcContextLease {
+public:
+    explicit MachDxcContextLease(MachDxcContextPool& pool) : pool(pool), context(pool.lease()) {}
+    ~MachDxcContextLease() { pool.release(context); }
+
+    MachDxcCompileContext* get() const { return context; }
+
+private:
+    MachDxcContextPool& pool;
+    MachDxcCompileContext* context;
+};
+
+class MachDxcExecutor;
+
+// The state behind a MachDxcCompiler handle. Everything here is created once and reused by every
+// compile, so that compiling in a loop does not create COM objects or allocate anything outside
+// of DXC itself.
+struct MachDxcCompilerImpl {
+    MachDxcCompilerImpl(IDxcUtils* utils, size_t max_contexts, const MachDxcAllocator* allocator)
+        : allocator(allocator),
+          utils(utils),
+          pool(utils, max_contexts, allocator) {}
+
+    // Null unless created with machDxcInitWithAllocator, interned with internAllocator().
+    const MachDxcAllocator* allocator;
+
+    CComPtr<IDxcUtils> utils;
+
+    // Every compile, whether blocking, batched or asynchronous, runs on a context leased from here.
+    MachDxcContextPool pool;
+
+    // Null unless enabled with machDxcCompilerEnableCache.
+    std::unique_ptr<MachDxcCompileCache> cache;
+
+    // Null unless enabled with machDxcCompilerEnableDiskCache.
+    std::unique_ptr<MachDxcDiskCache> disk_cache;
+
+    // Null unless enabled with machDxcCompilerEnableIncludeCache.
+    std::unique_ptr<MachDxcIncludeCache> include_cache;
+
+    // Include directives of files seen by machDxcScanDependencies, by content hash.
+    MachDxcDirectiveCache directive_cache;
+
+    // Runs machDxcCompileAsync requests, started by the first one. Declared last so that it is
+    // destroyed, finishing any compile in flight, before the caches those compiles use.
+    std::mutex executor_lock;
+    std::unique_ptr<MachDxcExecutor> executor;
+};
+
+static MachDxcCompileResult runCompile(
+    MachDxcCompileContext* context,
+    MachDxcCompileOptions* options,
+    MachDxcIncludeCache* include_cache,
+    std::vector<MachDxcIncludeRecord>* recorded_includes,
+    bool preprocess
+) {
+    // DXC wraps the buffer in a pinned blob internally, so there is no need to copy the source
+    // into a blob of our own first. It does copy a source that doesn't end in a null terminator,
+    // to add one.
+    DxcBuffer sourceBuffer;
+    sourceBuffer.Ptr = options->code;
+    sourceBuffer.Size = options->code_len;
+    sourceBuffer.Encoding = DXC_CP_UTF8;
+    uint64_t source_copied_bytes = options->code_len > 0 && options->code[options->code_len - 1] != '\0' ? options->code_len + 1 : 0;
+    if (options->prefix_header != nullptr) {
+        context->prefixed_code.assign(options->prefix_header->preamble);
+        context->prefixed_code.append(options->code, options->code_len);
+        // Passing the terminator along spares DXC from copying the source again.
+        sourceBuffer.Ptr = context->prefixed_code.data();
+        sourceBuffer.Size = context->prefixed_code.size() + 1;
+        source_copied_bytes = context->prefixed_code.size();
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    // We have args in char form, but dxcInstance->Compile expects wchar_t form.
+    context->argument_arena.trim();
+    context->arguments.clear();
+    if (options->prefix_header != nullptr) {
+        const std::vector<LPCWSTR>& defines = options->prefix_header->define_args;
+        context->arguments.insert(context->arguments.end(), defines.begin(), defines.end());
+    }
+    if (options->base_args != nullptr) {
+        const std::vector<LPCWSTR>& base = options->base_args->wide_pointers;
+        context->arguments.insert(context->arguments.end(), base.begin(), base.end());
+    }
+    for (size_t i = 0; i < options->args_len; i++)
+        context->arguments.push_back(context->argument_arena.intern(options->args[i]));
+    if (preprocess)
+        context->arguments.push_back(L"-P");
+    bool trace = options->collect_timings != 0 || context->trace_events != nullptr;
+    if (trace)
+        context->arguments.push_back(L"-ftime-trace");
+    // The profiler drops spans shorter than its granularity of 500us by default, which is most
+    // passes on most functions. Pass timings need all of them, phase timings make do with the
+    // phases that take long enough to matter.
+    bool pass_timings = options->collect_timings != MachDxcTimingsNone && options->collect_timings != MachDxcTimingsPhases;
+    if (pass_timings)
+        context->arguments.push_back(L"-ftime-trace-granularity=0");
+    std::chrono::steady_clock::time_point arguments_end = std::chrono::steady_clock::now();
+
+    // Leave include handler as default (nullptr) unless there's available callbacks
+    MachDxcIncludeHandler* handler = nullptr;
+    if (options->include_callbacks != nullptr || options->prefix_header != nullptr) {
+        handler = &context->include_handler;
+        handler->callbacks = options->include_callbacks;
+        handler->recorded_includes = recorded_includes;
+        handler->pin_includes = options->pin_includes != 0;
+        handler->include_cache = include_cache;
+        handler->prefix_header = options->prefix_header;
+        handler->trace_events = context->trace_events;
+    }
+
+    // DXC's profiler lives in a thread local, and a compile runs start to finish on the thread of
+    // its context, so traced compiles proceed in parallel like any other.
+    uint64_t compile_start = traceNowNs();
+    context->allocator->begin();
+    bool arena = options->use_arena != 0 && context->heap_compiled;
+    if (arena)
+        context->allocator->beginArena();
+
+    CComPtr<IDxcResult> pCompileResult;
+    const char* call = "DxcCreateInstance";
+    HRESULT hr = S_OK;
+    if (context->compiler == nullptr)
+        hr = DxcCreateInstance2(context->allocator.p, CLSID_DxcCompiler, IID_PPV_ARGS(&context->compiler));
+    if (SUCCEEDED(hr)) {
+        call = "Compile";
+        hr = context->compiler->Compile(
+            &sourceBuffer,
+            context->arguments.data(),
+            (uint32_t)context->arguments.size(),
+            handler,
+            IID_PPV_ARGS(&pCompileResult)
+        );
+    }
+    MachDxcMemoryStats memory = context->allocator->end();
+
+    MachDxcCompileResultImpl* result = new MachDxcCompileResultImpl();
+    result->memory = memory;
+    if (FAILED(hr) || pCompileResult == nullptr) {
+        pCompileResult.Release();
+        result->status = FAILED(hr) ? hr : E_POINTER;
+        result->errors = errorBlob(failedCallMessage(call, result->status));
+    } else {
+        if (preprocess)
+            pCompileResult->GetOutput(DXC_OUT_HLSL, IID_PPV_ARGS(&result->object), nullptr);
+        else
+            pCompileResult->GetResult(&result->object);
+        pCompileResult->GetOutput(DXC_OUT_ERRORS, IID_PPV_ARGS(&result->errors), nullptr);
+    }
+    if (arena) {
+        if (result->object != nullptr)
+            result->object = copyBlob(result->object, preprocess);
+        if (result->errors != nullptr)
+            result->errors = copyBlob(result->errors, true);
+    }
+
+    result->memory.copied_bytes = source_copied_bytes;
+    MachDxcCompileTimings& timings = result->timings;
+    timings.argument_conversion_ns = elapsedNs(start, arguments_end);
+    if (handler != nullptr) {
+        result->memory.copied_bytes += handler->copied_bytes;
+        handler->copied_bytes = 0;
+        timings.include_callbacks_ns = handler->include_ns;
+        handler->callbacks = nullptr;
+        handler->recorded_includes = nullptr;
+        handler->prefix_header = nullptr;
+        handler->include_ns = 0;
+        handler->trace_events = nullptr;
+    }
+
+    CComPtr<IDxcBlobUtf8> trace_json;
+    if (trace && pCompileResult != nullptr && SUCCEEDED(pCompileResult->GetOutput(DXC_OUT_TIME_TRACE, IID_PPV_ARGS(&trace_json), nullptr)) && trace_json != nullptr) {
+        std::vector<MachDxcTraceEvent> events;
+        MachDxcTraceReader(trace_json->GetStringPointer(), trace_json->GetStringLength()).read(&events);
+
+        // DXC starts its profiler just after parsing arguments, so its times are relative to a
+        // point slightly after compile_start.
+        if (context->trace_events != nullptr) {
+            for (const MachDxcTraceEvent& event : events) {
+                context->trace_events->push_back(event);
+                context->trace_events->back().ts_ns += compile_start;
+            }
+        }
+
+        // Spans of no phase only matter through the phase enclosing them, which covers their time
+        // already, so without pass timings they are dropped before sorting.
+        if (!pass_timings) {
+            events.erase(std::remove_if(events.begin(), events.end(), [](const MachDxcTraceEvent& event) {
+                return classifyTraceEvent(event.name) == MachDxcPhaseNone;
+            }), events.end());
+        }
+        sortTraceEvents(events);
+        uint64_t phase_ns[MachDxcPhaseCount];
+        phaseTimesFromTrace(events, phase_ns);
+        if (pass_timings)
+            passTimesFromTrace(events, &result->pass_names, &result->pass_timings);
+        timings.parse_ns = phase_ns[MachDxcPhaseParse];
+        timings.codegen_ns = phase_ns[MachDxcPhaseCodeGen];
+        timings.optimize_ns = phase_ns[MachDxcPhaseOptimize];
+        timings.validation_ns = phase_ns[MachDxcPhaseValidation];
+        timings.container_ns = phase_ns[MachDxcPhaseContainer];
+    }
+
+    if (arena) {
+        // Everything DXC allocated during the compile goes away with the arena.
+        trace_json.Release();
+        pCompileResult.Release();
+        context->allocator->endArena();
+    }
+    context->heap_compiled = true;
+    return result;
+}
+
+// Serves a compile from the caches if possible, compiling and filling them otherwise.
+static MachDxcCompileResult compileOrLookup(
+    MachDxcCompilerImpl* compiler,
+    MachDxcCompileContext* context,
+    MachDxcCompileOptions* options
+) {
+    MachDxcCompileCache* cache = compiler->cache.get();
+    MachDxcDiskCache* disk_cache = compiler->disk_cache.get();
+    MachDxcIncludeCache* include_cache = compiler->include_cache.get();
+    if (cache == nullptr && disk_cache == nullptr)
+        return runCompile(context, options, include_cache, nullptr, false);
+
+    MachDxcHash inputs = hashCompileInputs(options);
+    if (cache != nullptr) {
+        if (MachDxcCompileResult cached = cache->lookup(inputs, options->include_callbacks, include_cache))
+            return cached;
+    }
+
+    std::vector<MachDxcIncludeRecord> includes;
+    if (disk_cache != nullptr) {
+        if (MachDxcCompileResult cached = disk_cache->lookup(inputs, options->include_callbacks, include_cache, &includes)) {
+            if (cache != nullptr)
+                cache->insert(inputs, std::move(includes), cached);
+            return cached;
+        }
+        includes.clear();
+    }
+
+    MachDxcCompileResult result = runCompile(context, options, include_cache, &includes, false);
+    if (FAILED(result->status))
+        return result;
+    if (disk_cache != nullptr)
+        disk_cache->insert(inputs, includes, result);
+    if (cache != nullptr)
+        cache->insert(inputs, std::move(includes), result);
+    return result;
+}
+
+// Names a compile in traces by its target profile and entry point.
+static std::string describeCompile(MachDxcCompileOptions* options) {
+    std::string profile, entry;
+    auto scan = [&](char const* const* args, size_t args_len) {
+        for (size_t i = 0; i < args_len; i++) {
+            const char* arg = args[i];
+            if ((arg[0] != '-' && arg[0] != '/') || (arg[1] != 'T' && arg[1] != 'E'))
+                continue;
+            std::string& value = arg[1] == 'T' ? profile : entry;
+            if (arg[2] != '\0')
+                value = arg + 2;
+            else if (i + 1 < args_len)
+                value = args[++i];
+        }
+    };
+    if (options->base_args != nullptr)
+        scan(options->base_args->utf8_pointers.data(), options->base_args->utf8_pointers.size());
+    scan(options->args, options->args_len);
+    return entry.empty() ? profile : profile + " " + entry;
+}
+
+// Runs only the preprocessor on `context`, bypassing the compile caches, and keeps the headers it
+// resolved.
+static MachDxcCompileResult preprocessWithContext(
+    MachDxcCompilerImpl* compiler,
+    MachDxcCompileContext* context,
+    MachDxcCompileOptions* options
+) {
+    std::vector<MachDxcIncludeRecord> includes;
+    MachDxcCompileResult result = runCompile(context, options, compiler->include_cache.get(), &includes, true);
+    for (MachDxcIncludeRecord& include : includes) {
+        if (std::find(result->includes.begin(), result->includes.end(), include.name) == result->includes.end())
+            result->includes.push_back(std::move(include.name));
+    }
+    return result;
+}
+
+// Compiles or preprocesses on `context`, measuring the total time taken and recording a trace if
+// one was asked for by the compile or by a process-wide trace session.
+static MachDxcCompileResult compileWithContext(
+    MachDxcCompilerImpl* compiler,
+    MachDxcCompileContext* context,
+    MachDxcCompileOptions* options,
+    bool preprocess
+) {
+    bool trace = options->collect_trace != 0 || trace_session_active;
+    std::vector<MachDxcTraceEvent> trace_events;
+    context->trace_events = trace ? &trace_events : nullptr;
+
+    uint64_t start = traceNowNs();
+    MachDxcCompileResult result = preprocess
+        ? preprocessWithContext(compiler, context, options)
+        : compileOrLookup(compiler, context, options);
+    result->timings.total_ns = traceNowNs() - start;
+
+    context->trace_events = nullptr;
+    if (!trace)
+        return result;
+
+    const char* span = preprocess ? "Preprocess" : "Compile";
+    trace_events.insert(trace_events.begin(), {span, describeCompile(options), start, result->timings.total_ns});
+    uint32_t tid = traceThreadId();
+    if (options->collect_trace != 0) {
+        bool first = true;
+        beginTraceDocument(result->trace);
+        appendThreadName(result->trace, tid, &first);
+        appendTraceEvents(result->trace, trace_events, tid, &first);
+        endTraceDocument(result->trace);
+    }
+    if (trace_session_active) {
+        MachDxcTraceSession& session = traceSession();
+        std::lock_guard<std::mutex> guard(session.lock);
+        if (trace_session_active) {
+            std::vector<MachDxcTraceEvent>& track = session.tracks[tid];
+            track.insert(track.end(), trace_events.begin(), trace_events.end());
+        }
+    }
+    return result;
+}
+
+// A contiguous share of the indices handed to parallelFor, owned by one worker.
+struct MachDxcWorkRange {
+    std::mutex lock;
+    size_t begin = 0;
+    size_t end = 0;
+};
+
+// Takes the next index for worker `self`: the front of its own range if it has one, otherwise
+// the back half of whichever other range has the most work left. Returns false once all ranges
+// are empty.
+static bool takeWork(MachDxcWorkRange* ranges, size_t num_ranges, size_t self, size_t* index) {
+    {
+        std::lock_guard<std::mutex> guard(ranges[self].lock);
+        if (ranges[self].begin < ranges[self].end) {
+            *index = ranges[self].begin++;
+            return true;
+        }
+    }
+
+    for (;;) {
+        size_t victim = num_ranges;
+        size_t most_remaining = 0;
+        for (size_t i = 0; i < num_ranges; i++) {
+            if (i == self) continue;
+            std::lock_guard<std::mutex> guard(ranges[i].lock);
+            size_t remaining = ranges[i].end - ranges[i].begin;
+            if (remaining > most_remaining) {
+                most_remaining = remaining;
+                victim = i;
+            }
+        }
+        if (victim == num_ranges) return false;
+
+        size_t stolen_begin, stolen_end;
+        {
+            std::lock_guard<std::mutex> guard(ranges[victim].lock);
+            size_t remaining = ranges[victim].end - ranges[victim].begin;
+            if (remaining == 0) continue; // Drained while we were looking, pick another victim.
+            stolen_end = ranges[victim].end;
+            stolen_begin = stolen_end - (remaining + 1) / 2;
+            ranges[victim].end = stolen_begin;
+        }
+
+        std::lock_guard<std::mutex> guard(ranges[self].lock);
+        ranges[self].begin = stolen_begin + 1;
+        ranges[self].end = stolen_end;
+        *index = stolen_begin;
+        return true;
+    }
+}
+
+// Invokes fn(worker, index) for every index in [0, count) using num_threads workers, one of which
+// is the calling thread. Returns once every index has been processed.
+static void parallelFor(size_t count, size_t num_threads, const std::function<void(size_t, size_t)>& fn) {
+    std::unique_ptr<MachDxcWorkRange[]> ranges(new MachDxcWorkRange[num_threads]);
+    for (size_t w = 0; w < num_threads; w++) {
+        ranges[w].begin = count * w / num_threads;
+        ranges[w].end = count * (w + 1) / num_threads;
+    }
+
+    auto worker = [&](size_t w) {
+        size_t index;
+        while (takeWork(ranges.get(), num_threads, w, &index))
+            fn(w, index);
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(num_threads - 1);
+    for (size_t w = 1; w < num_threads; w++)
+        threads.emplace_back(worker, w);
+    worker(0);
+    for (std::thread& thread : threads)
+        thread.join();
+}
+
+// A file reached by machDxcScanDependencies.
+struct MachDxcDependencyNodeImpl {
+    std::string name;
+    MachDxcHash hash = {};
+    std::vector<size_t> includes; // Node indices.
+    CComPtr<IDxcBlob> content; // Only kept when building a prefix header.
+};
+
+struct MachDxcDependencyGraphImpl {
+    std::deque<MachDxcDependencyNodeImpl> nodes; // Entries first. A deque, so nodes never move.
+};
+
+// Walks the include graph of a set of entry files. Each file becomes a node once, claimed by
+// whichever thread reaches it first, which then loads and lexes it; threads that reach it later
+// only record the edge.
+class MachDxcDependencyScanner {
+public:
+    MachDxcDependencyScanner(
+        MachDxcDependencyGraphImpl* graph,
+        MachDxcIncludeCallbacks* callbacks,
+        MachDxcIncludeCache* include_cache,
+        MachDxcDirectiveCache* directive_cache,
+        bool keep_content
+    ) : graph(graph), callbacks(callbacks), include_cache(include_cache), directive_cache(directive_cache), keep_content(keep_content) {}
+
+    // Adds the node for an entry file. Every entry must be added before scanning starts.
+    void addEntry(const char* name) {
+        size_t index;
+        MachDxcDependencyNodeImpl* node = claim(normalizeIncludePath(name), &index);
+        assert(node != nullptr && "dependency scan entries must be distinct");
+        entries.push_back(node);
+    }
+
+    // Scans entry `entry` and every file reachable from it that no other thread has claimed.
+    void scan(size_t entry) {
+        std::vector<MachDxcDependencyNodeImpl*> pending(1, entries[entry]);
+        while (!pending.empty()) {
+            MachDxcDependencyNodeImpl* node = pending.back();
+            pending.pop_back();
+
+            MachDxcDirectiveCache::Directives directives = load(node);
+            for (const MachDxcIncludeDirective& directive : *directives) {
+                size_t index;
+                MachDxcDependencyNodeImpl* included = claim(resolveIncludePath(node->name, directive), &index);
+                if (std::find(node->includes.begin(), node->includes.end(), index) == node->includes.end())
+                    node->includes.push_back(index);
+                if (included != nullptr)
+                    pending.push_back(included);
+            }
+        }
+    }
+
+private:
+    // Sets *index to the node for `name`, adding it if there is none yet. Returns the node if this
+    // call added it, or null if it was already claimed.
+    MachDxcDependencyNodeImpl* claim(const std::string& name, size_t* index) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = indices.find(name);
+        if (it != indices.end()) {
+            *index = it->second;
+            return nullptr;
+        }
+        *index = graph->nodes.size();
+        indices.emplace(name, *index);
+        graph->nodes.emplace_back();
+        graph->nodes.back().name = name;
+        return &graph->nodes.back();
+    }
+
+    // Sets the content hash, and the content if it is kept, of `node` and returns its include
+    // directives.
+    MachDxcDirectiveCache::Directives load(MachDxcDependencyNodeImpl* node) {
+        if (include_cache != nullptr) {
+            // The blob is a reference to the cached header, so it costs nothing to take even when
+            // the directives turn out to be cached too.
+            CComPtr<IDxcBlob> blob;
+            include_cache->load(callbacks, false, node->name, &blob, &node->hash);
+            MachDxcDirectiveCache::Directives directives = directive_cache->find(node->hash);
+            if (keep_content)
+                node->content = blob;
+            if (directives != nullptr)
+                return directives;
+            return lex(node->hash, (const char*)blob->GetBufferPointer(), blob->GetBufferSize() - 1);
+        }
+
+        MachDxcIncludeResult* include_result = callbacks->include_func(callbacks->include_ctx, node->name.c_str());
+        const char* include_text = include_result != nullptr && include_result->header_data != nullptr ? include_result->header_data : u8"";
+        size_t include_len = include_result != nullptr ? include_result->header_length : 0;
+        node->hash = hashBytes(include_text, include_len);
+        if (keep_content) {
+            std::shared_ptr<std::string> copy = std::make_shared<std::string>(include_text, include_len);
+            node->content = new MachDxcViewBlob(copy->c_str(), include_len + 1, true, copy);
+        }
+        MachDxcDirectiveCache::Directives directives = directive_cache->find(node->hash);
+        if (directives == nullptr)
+            directives = lex(node->hash, include_text, include_len);
+        callbacks->free_func(callbacks->include_ctx, include_result);
+        return directives;
+    }
+
+    MachDxcDirectiveCache::Directives lex(const MachDxcHash& hash, const char* text, size_t len) {
+        std::shared_ptr<std::vector<MachDxcIncludeDirective>> directives = std::make_shared<std::vector<MachDxcIncludeDirective>>();
+        scanIncludeDirectives(text, len, directives.get());
+        directive_cache->insert(hash, directives);
+        return directives;
+    }
+
+    MachDxcDependencyGraphImpl* graph;
+    MachDxcIncludeCallbacks* callbacks;
+    MachDxcIncludeCache* include_cache;
+    MachDxcDirectiveCache* directive_cache;
+    bool keep_content;
+    std::vector<MachDxcDependencyNodeImpl*> entries;
+
+    std::mutex lock;
+    std::unordered_map<std::string, size_t> indices; // By name.
+};
+
+// Adds the include graph of `entries` to `graph`, scanning on up to num_threads threads (0
+// means one per CPU core).
+static void scanDependencies(
+    MachDxcCompiler compiler,
+    MachDxcIncludeCallbacks* callbacks,
+    char const* const* entries,
+    size_t entries_len,
+    size_t num_threads,
+    bool keep_content,
+    MachDxcDependencyGraphImpl* graph
+) {
+    if (num_threads == 0)
+        num_threads = std::thread::hardware_concurrency();
+    if (num_threads > entries_len)
+        num_threads = entries_len;
+    if (num_threads == 0)
+        num_threads = 1;
+
+    MachDxcDependencyScanner scanner(graph, callbacks, compiler->include_cache.get(), &compiler->directive_cache, keep_content);
+    for (size_t i = 0; i < entries_len; i++)
+        scanner.addEntry(entries[i]);
+    parallelFor(entries_len, num_threads, [&](size_t, size_t index) {
+        scanner.scan(index);
+    });
+}
+
+// Invokes fn(worker, context, index) for every index in [0, count) on up to num_threads workers
+// (0 means one per CPU core, and never more than the pool holds), each leasing one context for
+// the whole run. Workers are numbered from 0 and never more than count.
+static void parallelForOnContexts(
+    MachDxcCompilerImpl* compiler,
+    size_t count,
+    size_t num_threads,
+    const std::function<void(size_t, MachDxcCompileContext*, size_t)>& fn
+) {
+    if (num_threads == 0)
+        num_threads = std::thread::hardware_concurrency();
+    if (num_threads > compiler->pool.maxContexts())
+        num_threads = compiler->pool.maxContexts();
+    if (num_threads > count)
+        num_threads = count;
+    if (num_threads == 0)
+        num_threads = 1;
+
+    std::vector<MachDxcCompileContext*> contexts(num_threads, nullptr);
+    parallelFor(count, num_threads, [&](size_t worker, size_t index) {
+        if (contexts[worker] == nullptr)
+            contexts[worker] = compiler->pool.lease();
+        fn(worker, contexts[worker], index);
+    });
+    for (MachDxcCompileContext* context : contexts) {
+        if (context != nullptr)
+            compiler->pool.release(context);
+    }
+}
+
+// Include callbacks that resolve each header through the wrapped callbacks once and then hand the
+// same text to every compile, so that the permutations of machDxcCompilePermutations share header
+// reads. The text is owned by the memo, so compiles may pin it.
+class MachDxcIncludeMemo {
+public:
+    explicit MachDxcIncludeMemo(MachDxcIncludeCallbacks* callbacks) : wrapped(*callbacks) {
+        memo_callbacks.include_ctx = this;
+        memo_callbacks.include_func = include;
+        memo_callbacks.free_func = release;
+        memo_callbacks.version_func = nullptr;
+    }
+
+    MachDxcIncludeCallbacks* callbacks() { return &memo_callbacks; }
+
+private:
+    struct Header {
+        std::once_flag resolved;
+        bool found = false;
+        std::string text;
+        MachDxcIncludeResult result = {};
+    };
+
+    static MachDxcIncludeResult* include(void* ctx, const char* header_name) {
+        MachDxcIncludeMemo* memo = (MachDxcIncludeMemo*)ctx;
+        Header* header;
+        {
+            std::lock_guard<std::mutex> guard(memo->lock);
+            std::unique_ptr<Header>& slot = memo->headers[header_name];
+            if (slot == nullptr)
+                slot.reset(new Header());
+            header = slot.get();
+        }
+        std::call_once(header->resolved, [&] {
+            MachDxcIncludeResult* include_result = memo->wrapped.include_func(memo->wrapped.include_ctx, header_name);
+            if (include_result != nullptr && include_result->header_data != nullptr) {
+                header->text.assign(include_result->header_data, include_result->header_length);
+                header->found = true;
+            }
+            memo->wrapped.free_func(memo->wrapped.include_ctx, include_result);
+            header->result.header_data = header->text.c_str();
+            header->result.header_length = header->text.size();
+        });
+        return header->found ? &header->result : nullptr;
+    }
+
+    static int release(void*, MachDxcIncludeResult*) {
+        return 0;
+    }
+
+    MachDxcIncludeCallbacks wrapped;
+    MachDxcIncludeCallbacks memo_callbacks;
+    std::mutex lock;
+    std::unordered_map<std::string, std::unique_ptr<Header>> headers;
+};
+
+// Copies `args` to `out` without the single-letter options named in `letters`, joined or
+// separated from their values: with "ET", "-E main", "/Tps_6_0" and so on are left out.
+static void removeArgs(char const* const* args, size_t args_len, const char* letters, std::vector<const char*>* out) {
+    for (size_t i = 0; i < args_len; i++) {
+        const char* arg = args[i];
+        bool is_option = arg[0] == '-' || arg[0] == '/';
+        if (is_option && arg[1] != '\0' && std::strchr(letters, arg[1]) != nullptr) {
+            if (arg[2] == '\0')
+                i++;
+            continue;
+        }
+        out->push_back(arg);
+    }
+}
+
+// Hashes the arguments that matter once the source has been preprocessed, which is all of them
+// but -D, -U and -I and their values.
+static void hashCodeGenArgs(llvm::MD5& md5, char const* const* args, size_t args_len) {
+    std::vector<const char*> codegen_args;
+    removeArgs(args, args_len, "DUI", &codegen_args);
+    for (const char* arg : codegen_args)
+        hashUpdate(md5, arg, std::strlen(arg) + 1);
+}
+
+// Preprocesses a compile and hashes the result with the arguments that still matter, so that
+// compiles with the same key produce the same object. Returns false if preprocessing failed.
+static bool hashPreprocessedCompile(
+    MachDxcCompilerImpl* compiler,
+    MachDxcCompileContext* context,
+    MachDxcCompileOptions* options,
+    MachDxcHash* key,
+    uint64_t* preprocess_ns
+) {
+    MachDxcCompileResult preprocessed = compileWithContext(compiler, context, options, true);
+    *preprocess_ns = preprocessed->timings.total_ns;
+    bool keyed = preprocessed->object != nullptr;
+    if (keyed) {
+        llvm::MD5 md5;
+        hashUpdate(md5, preprocessed->object->GetBufferPointer(), preprocessed->object->GetBufferSize());
+        hashUpdate(md5, "", 1);
+        if (options->base_args != nullptr)
+            hashCodeGenArgs(md5, options->base_args->utf8_pointers.data(), options->base_args->utf8_pointers.size());
+        hashCodeGenArgs(md5, options->args, options->args_len);
+        *key = hashFinal(md5);
+    }
+    delete preprocessed;
+    return keyed;
+}
+
+// Returns the minor version of a shader model 6 target profile such as "ps_6_4", or -1 for any
+// other profile.
+static int shaderModel6Minor(const char* profile) {
+    const char* underscore = std::strchr(profile, '_');
+    if (underscore == nullptr || std::strncmp(underscore, "_6_", 3) != 0 || underscore[3] < '0' || underscore[3] > '9')
+        return -1;
+    return std::atoi(underscore + 3);
+}
+
+// Collects the names of the functions that `text` declares with a [shader("...")] attribute,
+// which are the only ones DXC exports from a library as entry points that can be linked. This
+// works on the source as written, so attributes spelled by macros, functions in headers and
+// functions in disabled #if blocks are all missed or found wrongly; linking sorts those out.
+static void scanShaderFunctions(const char* text, size_t len, std::vector<std::string>* out) {
+    const char* p = text;
+    const char* end = text + len;
+    auto isIdentifier = [](char ch) {
+        return ch == '_' || (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9');
+    };
+
+    size_t bracket_depth = 0;
+    bool in_shader_attribute = false;
+    bool attributed = false; // a shader attribute was closed and its function name is yet to come
+    std::string identifier; // the identifier just before p, if nothing else came after it
+    while (p < end) {
+        char ch = *p;
+        if (ch == '/' && p + 1 < end && p[1] == '/') {
+            while (p < end && *p != '\n')
+                p++;
+        } else if (ch == '/' && p + 1 < end && p[1] == '*') {
+            p += 2;
+            while (p + 1 < end && !(p[0] == '*' && p[1] == '/'))
+                p++;
+            p = p + 1 < end ? p + 2 : end;
+        } else if (ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n' || ch == '\f' || ch == '\v') {
+            p++;
+            continue;
+        } else if (isIdentifier(ch)) {
+            const char* start = p;
+            while (p < end && isIdentifier(*p))
+                p++;
+            identifier.assign(start, p - start);
+            continue;
+        } else if (ch == '"' || ch == '\'') {
+            p++;
+            while (p < end && *p != ch && *p != '\n')
+                p += *p == '\\' && p + 1 < end ? 2 : 1;
+            if (p < end && *p == ch)
+                p++;
+        } else if (ch == '#') {
+            while (p < end && *p != '\n')
+                p++;
+        } else if (ch == '(') {
+            if (bracket_depth > 0 && identifier == "shader") {
+                in_shader_attribute = true;
+            } else if (bracket_depth == 0 && attributed && !identifier.empty()) {
+                out->push_back(identifier);
+                attributed = false;
+            }
+            p++;
+        } else if (ch == '[') {
+            bracket_depth++;
+            p++;
+        } else if (ch == ']') {
+            if (bracket_depth > 0 && --bracket_depth == 0 && in_shader_attribute) {
+                in_shader_attribute = false;
+                attributed = true;
+            }
+            p++;
+        } else {
+            if (bracket_depth == 0 && (ch == ';' || ch == '{' || ch == '}'))
+                attributed = false;
+            p++;
+        }
+        identifier.clear();
+    }
+}
+
+// Prepends the diagnostics of the compile that produced a library to those of a result linked
+// from it, so that the result reports what a compile of its own would have.
+static void prependDiagnostics(MachDxcCompileResultImpl* result, IDxcBlobUtf8* diagnostics) {
+    if (hlsl::IsBlobNullOrEmpty(diagnostics) || diagnostics->GetStringLength() == 0)
+        return;
+    std::shared_ptr<std::string> text = std::make_shared<std::string>(diagnostics->GetStringPointer(), diagnostics->GetStringLength());
+    if (!hlsl::IsBlobNullOrEmpty(result->errors))
+        text->append(result->errors->GetStringPointer(), result->errors->GetStringLength());
+    result->errors = new MachDxcViewBlob(text->c_str(), text->size() + 1, true, text);
+}
+
+// Links one entry point out of libraries registered with `linker`. The result has no object if
+// linking failed.
+static MachDxcCompileResult linkEntryPoint(
+    IDxcLinker* linker,
+    IDxcUtils* utils,
+    LPCWSTR entry_point,
+    LPCWSTR target_profile,
+    const std::vector<LPCWSTR>& libraries,
+    const std::vector<LPCWSTR>& args
+) {
+    uint64_t start = traceNowNs();
+    CComPtr<IDxcOperationResult> link_result;
+    HRESULT hr = linker->Link(entry_point, target_profile, libraries.data(), (UINT32)libraries.size(),
+        args.data(), (UINT32)args.size(), &link_result);
+    if (FAILED(hr))
+        return errorResult("error: linking failed");
+
+    MachDxcCompileResultImpl* result = new MachDxcCompileResultImpl();
+    HRESULT status;
+    if (SUCCEEDED(link_result->GetStatus(&status)) && SUCCEEDED(status))
+        link_result->GetResult(&result->object);
+    result->linked = !hlsl::IsBlobNullOrEmpty(result->object);
+    CComPtr<IDxcBlobEncoding> errors;
+    if (SUCCEEDED(link_result->GetErrorBuffer(&errors)) && errors != nullptr)
+        utils->GetBlobAsUtf8(errors, &result->errors);
+    result->timings.total_ns = traceNowNs() - start;
+    return result;
+}
+
+// A library registered with a MachDxcLinker. Each registration under a name gets a new version, so
+// that linker instances holding an older one can tell.
+struct MachDxcLinkerLibrary {
+    CComPtr<IDxcBlob> module;
+    uint64_t version = 0;
+    // The preprocessed-source key the module was compiled from, if it was compiled by
+    // machDxcLinkerUpdateLibraries.
+    MachDxcHash key;
+    bool keyed = false;
+};
+
+// An IDxcLinker of a MachDxcLinker and the library versions registered with it so far.
+struct MachDxcLinkerInstance {
+    CComPtr<MachDxcCountingMalloc> allocator;
+    CComPtr<IDxcLinker> linker;
+    std::unordered_map<std::string, uint64_t> registered;
+};
+
+// DXC's linker is single-threaded, so a MachDxcLinker keeps a linker instance per concurrent link,
+// each catching up on the libraries registered since it was last used before it links. DXC can't
+// unregister a library, so an instance holding a replaced library is dropped instead.
+struct MachDxcLinkerImpl {
+    MachDxcCompilerImpl* compiler;
+
+    std::mutex lock;
+    std::unordered_map<std::string, MachDxcLinkerLibrary> libraries;
+    uint64_t next_version = 1;
+    std::vector<std::unique_ptr<MachDxcLinkerInstance>> idle;
+};
+
+// Returns true if `instance` has a version of a library other than the one in `libraries`.
+static bool linkerInstanceStale(
+    const MachDxcLinkerInstance* instance,
+    const std::vector<std::pair<std::string, MachDxcLinkerLibrary>>& libraries
+) {
+    for (const auto& library : libraries) {
+        auto it = instance->registered.find(library.first);
+        if (it != instance->registered.end() && it->second != library.second.version)
+            return true;
+    }
+    return false;
+}
+
+static MachDxcCompileResult linkWithLinker(MachDxcLinkerImpl* linker, const MachDxcLinkJob* job) {
+    std::vector<std::pair<std::string, MachDxcLinkerLibrary>> libraries;
+    std::unique_ptr<MachDxcLinkerInstance> instance;
+    {
+        std::lock_guard<std::mutex> guard(linker->lock);
+        for (size_t i = 0; i < job->libraries_len; i++) {
+            auto it = linker->libraries.find(job->libraries[i]);
+            if (it == linker->libraries.end())
+                return errorResult(std::string("error: library '") + job->libraries[i] + "' is not registered");
+            libraries.emplace_back(it->first, it->second);
+        }
+        while (instance == nullptr && !linker->idle.empty()) {
+            instance = std::move(linker->idle.back());
+            linker->idle.pop_back();
+            if (linkerInstanceStale(instance.get(), libraries))
+                instance.reset();
+        }
+    }
+
+    if (instance == nullptr) {
+        instance.reset(new MachDxcLinkerInstance());
+        instance->allocator = new MachDxcCountingMalloc(linker->compiler->allocator);
+        HRESULT hr = DxcCreateInstance2(instance->allocator.p, CLSID_DxcLinker, IID_PPV_ARGS(&instance->linker));
+        if (FAILED(hr))
+            return errorResult(failedCallMessage("DxcCreateInstance", hr));
+    }
+
+    std::vector<std::wstring> library_names;
+    for (const auto& library : libraries) {
+        library_names.push_back(utf8ToWideString(library.first.c_str()));
+        if (instance->registered.count(library.first) != 0)
+            continue;
+        if (FAILED(instance->linker->RegisterLibrary(library_names.back().c_str(), library.second.module)))
+            return errorResult("error: '" + library.first + "' is not a valid library");
+        instance->registered.emplace(library.first, library.second.version);
+    }
+
+    std::vector<LPCWSTR> library_pointers;
+    for (const std::wstring& name : library_names)
+        library_pointers.push_back(name.c_str());
+    std::vector<std::wstring> args;
+    for (size_t i = 0; i < job->args_len; i++)
+        args.push_back(utf8ToWideString(job->args[i]));
+    std::vector<LPCWSTR> arg_pointers;
+    for (const std::wstring& arg : args)
+        arg_pointers.push_back(arg.c_str());
+
+    MachDxcCompileResult result = linkEntryPoint(instance->linker, linker->compiler->utils,
+        utf8ToWideString(job->entry_point).c_str(), utf8ToWideString(job->target_profile).c_str(),
+        library_pointers, arg_pointers);
+
+    std::lock_guard<std::mutex> guard(linker->lock);
+    linker->idle.push_back(std::move(instance));
+    return result;
+}
+
+// An IDxcOptimizer of a MachDxcOptimizer, with the assembler that wraps its output in containers.
+struct MachDxcOptimizerInstance {
+    CComPtr<MachDxcCountingMalloc> allocator;
+    CComPtr<IDxcOptimizer> optimizer;
+    CComPtr<IDxcAssembler> assembler;
+};
+
+struct MachDxcOptimizerPassInfo {
+    std::string name;
+    std::string description;
+    std::vector<std::string> arg_names;
+    std::vector<std::string> arg_descriptions;
+    std::vector<const char*> arg_name_pointers;
+    std::vector<const char*> arg_description_pointers;
+};
+
+// Like MachDxcLinkerImpl, keeps an optimizer instance per concurrent run.
+struct MachDxcOptimizerImpl {
+    MachDxcCompilerImpl* compiler;
+    std::vector<MachDxcOptimizerPassInfo> passes;
+
+    std::mutex lock;
+    std::vector<std::unique_ptr<MachDxcOptimizerInstance>> idle;
+};
+
+// Returns null, with the reason in hr, if DXC's optimizer or assembler couldn't be created.
+static std::unique_ptr<MachDxcOptimizerInstance> leaseOptimizerInstance(MachDxcOptimizerImpl* optimizer, HRESULT* hr) {
+    {
+        std::lock_guard<std::mutex> guard(optimizer->lock);
+        if (!optimizer->idle.empty()) {
+            std::unique_ptr<MachDxcOptimizerInstance> instance = std::move(optimizer->idle.back());
+            optimizer->idle.pop_back();
+            return instance;
+        }
+    }
+
+    std::unique_ptr<MachDxcOptimizerInstance> instance(new MachDxcOptimizerInstance());
+    instance->allocator = new MachDxcCountingMalloc(optimizer->compiler->allocator);
+    *hr = DxcCreateInstance2(instance->allocator.p, CLSID_DxcOptimizer, IID_PPV_ARGS(&instance->optimizer));
+    if (SUCCEEDED(*hr))
+        *hr = DxcCreateInstance2(instance->allocator.p, CLSID_DxcAssembler, IID_PPV_ARGS(&instance->assembler));
+    if (FAILED(*hr))
+        return nullptr;
+    return instance;
+}
+
+// Converts a string DXC allocated with CoTaskMemAlloc, and frees it.
+static std::string takeTaskMemString(LPWSTR wide) {
+    std::string utf8;
+    if (wide != nullptr) {
+        wideToUtf8(wide, utf8);
+        CoTaskMemFree(wide);
+    }
+    return utf8;
+}
+
+static void enumerateOptimizerPasses(IDxcOptimizer* optimizer, std::vector<MachDxcOptimizerPassInfo>* passes) {
+    UINT32 count = 0;
+    optimizer->GetAvailablePassCount(&count);
+    passes->resize(count);
+    for (UINT32 i = 0; i < count; i++) {
+        MachDxcOptimizerPassInfo& info = (*passes)[i];
+        CComPtr<IDxcOptimizerPass> pass;
+        if (FAILED(optimizer->GetAvailablePass(i, &pass)))
+            continue;
+        LPWSTR text = nullptr;
+        pass->GetOptionName(&text);
+        info.name = takeTaskMemString(text);
+        text = nullptr;
+        pass->GetDescription(&text);
+        info.description = takeTaskMemString(text);
+
+        UINT32 arg_count = 0;
+        pass->GetOptionArgCount(&arg_count);
+        for (UINT32 arg = 0; arg < arg_count; arg++) {
+            text = nullptr;
+            pass->GetOptionArgName(arg, &text);
+            info.arg_names.push_back(takeTaskMemString(text));
+            text = nullptr;
+            pass->GetOptionArgDescription(arg, &text);
+            info.arg_descriptions.push_back(takeTaskMemString(text));
+        }
+        for (size_t arg = 0; arg < arg_count; arg++) {
+            info.arg_name_pointers.push_back(info.arg_names[arg].c_str());
+            info.arg_description_pointers.push_back(info.arg_descriptions[arg].c_str());
+        }
+    }
+}
+
+// Runs the optimizer once over `module` with `args` followed by `passes`. On failure, returns
+// null and appends what the optimizer printed to `text`.
+static CComPtr<IDxcBlob> runOptimizerPasses(
+    IDxcOptimizer* optimizer,
+    IDxcBlob* module,
+    const std::vector<std::wstring>& args,
+    const std::wstring* passes,
+    size_t passes_len,
+    std::string* text
+) {
+    std::vector<LPCWSTR> options;
+    for (const std::wstring& arg : args)
+        options.push_back(arg.c_str());
+    for (size_t i = 0; i < passes_len; i++)
+        options.push_back(passes[i].c_str());
+
+    CComPtr<IDxcBlob> output;
+    CComPtr<IDxcBlobEncoding> output_text;
+    HRESULT hr = optimizer->RunOptimizer(module, options.data(), (UINT32)options.size(), &output, &output_text);
+    if (output_text != nullptr && output_text->GetBufferSize() > 0) {
+        const char* data = (const char*)output_text->GetBufferPointer();
+        size_t size = output_text->GetBufferSize();
+        while (size > 0 && data[size - 1] == '\0')
+            size--;
+        text->append(data, size);
+    }
+    if (FAILED(hr) || hlsl::IsBlobNullOrEmpty(output))
+        return nullptr;
+    return output;
+}
+
+static MachDxcCompileResult optimizeWithOptimizer(MachDxcOptimizerImpl* optimizer, const MachDxcOptimizeOptions* options) {
+    uint64_t start = traceNowNs();
+    std::vector<std::wstring> args;
+    for (size_t i = 0; i < options->args_len; i++)
+        args.push_back(utf8ToWideString(options->args[i]));
+    std::vector<std::wstring> passes;
+    for (size_t i = 0; i < options->passes_len; i++)
+        passes.push_back(utf8ToWideString(options->passes[i]));
+
+    HRESULT hr = S_OK;
+    std::unique_ptr<MachDxcOptimizerInstance> instance = leaseOptimizerInstance(optimizer, &hr);
+    if (instance == nullptr)
+        return errorResult(failedCallMessage("DxcCreateInstance", hr));
+    MachDxcCompileResultImpl* result = new MachDxcCompileResultImpl();
+    CComPtr<IDxcBlob> module = new MachDxcViewBlob(options->module, options->module_len, false, nullptr);
+    std::string text;
+    if (options->collect_timings == 0 || passes.empty()) {
+        module = runOptimizerPasses(instance->optimizer, module, args, passes.data(), passes.size(), &text);
+    } else {
+        // The optimizer has no profiler of its own, so each pass is timed as a run of its own.
+        for (size_t i = 0; i < passes.size() && module != nullptr; i++) {
+            uint64_t pass_start = traceNowNs();
+            module = runOptimizerPasses(instance->optimizer, module, args, &passes[i], 1, &text);
+            uint64_t pass_ns = traceNowNs() - pass_start;
+            result->pass_names.push_back(options->passes[i]);
+            result->pass_timings.push_back({nullptr, 1, pass_ns, pass_ns});
+        }
+        for (size_t i = 0; i < result->pass_timings.size(); i++)
+            result->pass_timings[i].name = result->pass_names[i].c_str();
+        std::stable_sort(result->pass_timings.begin(), result->pass_timings.end(), [](const MachDxcPassTiming& a, const MachDxcPassTiming& b) {
+            return a.self_ns > b.self_ns;
+        });
+        result->timings.optimize_ns = traceNowNs() - start;
+    }
+
+    if (module != nullptr && options->assemble != 0) {
+        uint64_t container_start = traceNowNs();
+        CComPtr<IDxcOperationResult> assembled;
+        HRESULT status;
+        if (SUCCEEDED(instance->assembler->AssembleToContainer(module, &assembled)) &&
+            SUCCEEDED(assembled->GetStatus(&status)) && SUCCEEDED(status)) {
+            CComPtr<IDxcBlob> container;
+            assembled->GetResult(&container);
+            module = container;
+        } else {
+            CComPtr<IDxcBlobEncoding> errors;
+            if (assembled != nullptr && SUCCEEDED(assembled->GetErrorBuffer(&errors)) && errors != nullptr && errors->GetBufferSize() > 0)
+                text.append((const char*)errors->GetBufferPointer(), errors->GetBufferSize());
+            module = nullptr;
+        }
+        result->timings.container_ns = traceNowNs() - container_start;
+    }
+
+    result->object = module;
+    if (module == nullptr && text.empty())
+        text = "error: optimization failed";
+    if (!text.empty()) {
+        while (!text.empty() && text.back() == '\0')
+            text.pop_back();
+        std::shared_ptr<std::string> owned = std::make_shared<std::string>(std::move(text));
+        result->errors = new MachDxcViewBlob(owned->c_str(), owned->size() + 1, true, owned);
+    }
+    result->timings.total_ns = traceNowNs() - start;
+
+    std::lock_guard<std::mutex> guard(optimizer->lock);
+    optimizer->idle.push_back(std::move(instance));
+    return result;
+}
+
+// An asynchronous compile. Holds copies of the caller's code and arguments, so the caller doesn't
+// need to keep them alive. Referenced by the caller's handle and by the executor until it has
+// invoked the callback.
+struct MachDxcCompileRequestImpl {
+    std::atomic<int> ref_count{2};
+
+    std::string code;
+    std::vector<std::string> args;
+    std::vector<const char*> arg_pointers;
+    MachDxcCompileOptions options;
+    MachDxcCompileCallback callback;
+    void* user_data;
+
+    std::mutex lock;
+    std::condition_variable completed;
+    MachDxcCompileStatus status = MachDxcCompilePending;
+    bool started = false;
+    bool cancel_requested = false;
+    MachDxcCompileResult result = nullptr;
+};
+
+static void releaseRequest(MachDxcCompileRequestImpl* request) {
+    if (--request->ref_count != 0)
+        return;
+    delete request->result;
+    delete request;
+}
+
+// Moves a request out of pending, wakes its waiters and invokes its callback. `result` is
+// discarded if the request was cancelled while it compiled.
+static void completeRequest(MachDxcCompileRequestImpl* request, MachDxcCompileResult result) {
+    {
+        std::lock_guard<std::mutex> guard(request->lock);
+        if (request->cancel_requested) {
+            delete result;
+            request->status = MachDxcCompileCancelled;
+        } else {
+            request->result = result;
+            request->status = MachDxcCompileComplete;
+        }
     }
-
-    return buf;
+    request->completed.notify_all();
+    if (request->callback != nullptr)
+        request->callback(request->user_data, request);
 }
 
-// Provides a way for C applications to override file inclusion by offloading it to a function pointer
-class MachDxcIncludeHandler : public IDxcIncludeHandler 
-{
+// The worker threads behind machDxcCompileAsync. Workers are spawned on demand, up to one per
+// pooled context, and lease a context for each request they run.
+class MachDxcExecutor {
 public:
-    ULONG STDMETHODCALLTYPE AddRef() override { return 0; }
-    ULONG STDMETHODCALLTYPE Release() override { return 0; }
+    explicit MachDxcExecutor(MachDxcCompilerImpl* compiler)
+        : compiler(compiler), max_threads(compiler->pool.maxContexts()) {}
 
-    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void **ppvObject) override {
-        if (riid == __uuidof(IDxcIncludeHandler) || riid == __uuidof(IUnknown)) {
-            *ppvObject = this;
-            return S_OK;
+    // Cancels requests that have not started and waits for those that have.
+    ~MachDxcExecutor() {
+        std::deque<MachDxcCompileRequestImpl*> abandoned;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+            abandoned.swap(queue);
         }
-        *ppvObject = nullptr;
-        return E_NOINTERFACE;
+        work_available.notify_all();
+        for (MachDxcCompileRequestImpl* request : abandoned) {
+            if (startRequest(request)) {
+                {
+                    std::lock_guard<std::mutex> guard(request->lock);
+                    request->cancel_requested = true;
+                }
+                completeRequest(request, nullptr);
+            }
+            releaseRequest(request);
+        }
+        for (std::thread& thread : threads)
+            thread.join();
     }
 
-    MachDxcIncludeCallbacks* callbacks;
-    IDxcUtils* utils;
+    void submit(MachDxcCompileRequestImpl* request) {
+        std::lock_guard<std::mutex> guard(lock);
+        queue.push_back(request);
+        // Always wake an idle worker: the idle count includes workers that have been notified but
+        // not yet run, so a freshly spawned thread alone could leave a request waiting.
+        if (queue.size() > idle_threads && threads.size() < max_threads)
+            threads.emplace_back(&MachDxcExecutor::run, this);
+        work_available.notify_one();
+    }
 
-    MachDxcIncludeHandler(MachDxcIncludeCallbacks* callbacks_ptr, IDxcUtils* util_ptr) { 
-        callbacks = callbacks_ptr;
-        utils = util_ptr;
+    // Marks a request as started, returning false if it was cancelled before it got the chance.
+    static bool startRequest(MachDxcCompileRequestImpl* request) {
+        std::lock_guard<std::mutex> guard(request->lock);
+        if (request->status != MachDxcCompilePending)
+            return false;
+        request->started = true;
+        return true;
     }
 
-    HRESULT STDMETHODCALLTYPE LoadSource(LPCWSTR filename, IDxcBlob **ppIncludeSource) override {
-        if (callbacks->include_func == nullptr || callbacks->free_func == nullptr)
-            return E_POINTER;
-        
-        char* filename_utf8 = wcstombsAlloc(filename);
+private:
+    void run() {
+        for (;;) {
+            MachDxcCompileRequestImpl* request;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                idle_threads++;
+                work_available.wait(guard, [&] { return stopping || !queue.empty(); });
+                idle_threads--;
+                if (queue.empty())
+                    return;
+                request = queue.front();
+                queue.pop_front();
+            }
 
-        if (filename_utf8 == nullptr)
-            filename_utf8 = strdup(u8"");
+            if (startRequest(request)) {
+                MachDxcCompileResult result;
+                {
+                    MachDxcContextLease context(compiler->pool);
+                    result = compileWithContext(compiler, context.get(), &request->options, false);
+                }
+                completeRequest(request, result);
+            }
+            releaseRequest(request);
+        }
+    }
 
-        MachDxcIncludeResult* include_result = callbacks->include_func(callbacks->include_ctx, filename_utf8);
+    MachDxcCompilerImpl* compiler;
+    std::mutex lock;
+    std::condition_variable work_available;
+    std::deque<MachDxcCompileRequestImpl*> queue;
+    std::vector<std::thread> threads;
+    size_t max_threads;
+    size_t idle_threads = 0;
+    bool stopping = false;
+};
 
-        std::free(filename_utf8);
+// Mach change start: static dxcompiler/dxil
+BOOL MachDxcompilerInvokeDllMain();
+void MachDxcompilerInvokeDllShutdown();
 
-        const char* include_text = include_result != nullptr && include_result->header_data != nullptr ? include_result->header_data : u8"";
-        size_t include_len = include_result != nullptr ? include_result->header_length : 0;
+// DllMain sets up process-wide LLVM and DXC state, so it runs only when the first reference to
+// that state is taken, and its shutdown counterpart only when the last reference is dropped.
+// Every live compiler holds a reference, as does every machDxcGlobalInit call. The lock is held
+// through initialization so that no compiler can start before it is complete.
+static std::mutex global_lock;
+static size_t global_refs = 0;
 
-        CComPtr<IDxcBlobEncoding> text_blob;
-        HRESULT result = utils->CreateBlob(include_text, include_len, CP_UTF8, &text_blob);
+// Whether the state DXC creates on first use has been created since the globals were set up.
+static bool globals_warm = false;
 
-        if (SUCCEEDED(result)) 
-            *ppIncludeSource = text_blob.Detach();
-            
-        callbacks->free_func(callbacks->include_ctx, include_result);
+static void retainGlobals() {
+    std::lock_guard<std::mutex> guard(global_lock);
+    if (global_refs++ == 0) {
+        BOOL initialized = MachDxcompilerInvokeDllMain();
+        assert(initialized);
+    }
+}
 
-        return S_OK;
+static void releaseGlobals() {
+    std::lock_guard<std::mutex> guard(global_lock);
+    assert(global_refs > 0);
+    if (--global_refs == 0) {
+        MachDxcompilerInvokeDllShutdown();
+        globals_warm = false;
     }
-};  
+}
 
+// DXC creates some of its process-wide state, such as LLVM's option tables and pass registry, on
+// first use and through whatever allocator is installed at the time, and only frees it once the
+// globals are shut down, possibly after every compiler and MachDxcAllocator is gone. So that none
+// of it comes from a MachDxcAllocator, a trivial shader is compiled on the C heap before the first
+// compiler with one is created.
+static void warmUpGlobals() {
+    std::lock_guard<std::mutex> guard(global_lock);
+    if (globals_warm)
+        return;
+    globals_warm = true;
 
-// Mach change start: static dxcompiler/dxil
-BOOL MachDxcompilerInvokeDllMain();
-void MachDxcompilerInvokeDllShutdown();
+    CComPtr<IDxcCompiler3> compiler;
+    if (FAILED(DxcCreateInstance(CLSID_DxcCompiler, IID_PPV_ARGS(&compiler))))
+        return;
+    static const char code[] = "[numthreads(1, 1, 1)] void main() {}";
+    DxcBuffer buffer;
+    buffer.Ptr = code;
+    buffer.Size = sizeof(code);
+    buffer.Encoding = DXC_CP_UTF8;
+    LPCWSTR arguments[] = {L"-T", L"cs_6_0"};
+    CComPtr<IDxcResult> result;
+    compiler->Compile(&buffer, arguments, 2, nullptr, IID_PPV_ARGS(&result));
+}
+
+//--------
+// Globals
+//--------
+MACH_EXPORT void machDxcGlobalInit() {
+    retainGlobals();
+}
+
+MACH_EXPORT void machDxcGlobalDeinit() {
+    releaseGlobals();
+}
+
+//--------
+// Tracing
+//--------
+MACH_EXPORT void machDxcTraceBegin() {
+    MachDxcTraceSession& session = traceSession();
+    std::lock_guard<std::mutex> guard(session.lock);
+    session.tracks.clear();
+    trace_session_active = true;
+}
+
+MACH_EXPORT int machDxcTraceEnd(char const* path) {
+    std::string trace;
+    {
+        MachDxcTraceSession& session = traceSession();
+        std::lock_guard<std::mutex> guard(session.lock);
+        trace_session_active = false;
+
+        bool first = true;
+        beginTraceDocument(trace);
+        for (const auto& track : session.tracks)
+            appendThreadName(trace, track.first, &first);
+        for (const auto& track : session.tracks)
+            appendTraceEvents(trace, track.second, track.first, &first);
+        endTraceDocument(trace);
+        session.tracks.clear();
+    }
+
+    FILE* file = std::fopen(path, "wb");
+    if (file == nullptr)
+        return 0;
+    bool written = std::fwrite(trace.data(), 1, trace.size(), file) == trace.size();
+    return std::fclose(file) == 0 && written;
+}
 
 //----------------
 // MachDxcCompiler
 //----------------
 MACH_EXPORT MachDxcCompiler machDxcInit() {
-    MachDxcompilerInvokeDllMain();
-    CComPtr<IDxcCompiler3> dxcInstance;
-    HRESULT hr = DxcCreateInstance(CLSID_DxcCompiler, IID_PPV_ARGS(&dxcInstance));
-    assert(SUCCEEDED(hr));
-    return reinterpret_cast<MachDxcCompiler>(dxcInstance.Detach());
+    return machDxcInitPool(0);
+}
+
+static MachDxcCompiler createCompiler(size_t max_instances, const MachDxcAllocator* allocator) {
+    if (max_instances == 0)
+        max_instances = std::thread::hardware_concurrency();
+    if (max_instances == 0)
+        max_instances = 1;
+
+    retainGlobals();
+    CComPtr<IDxcUtils> utils;
+    HRESULT hr;
+    if (allocator != nullptr) {
+        allocator = internAllocator(allocator);
+        warmUpGlobals();
+        CComPtr<IMalloc> utils_allocator = new MachDxcCountingMalloc(allocator);
+        hr = DxcCreateInstance2(utils_allocator.p, CLSID_DxcUtils, IID_PPV_ARGS(&utils));
+    } else {
+        hr = DxcCreateInstance(CLSID_DxcUtils, IID_PPV_ARGS(&utils));
+    }
+    if (FAILED(hr)) {
+        releaseGlobals();
+        return nullptr;
+    }
+    return new MachDxcCompilerImpl(utils, max_instances, allocator);
+}
+
+MACH_EXPORT MachDxcCompiler machDxcInitPool(size_t max_instances) {
+    return createCompiler(max_instances, nullptr);
+}
+
+MACH_EXPORT MachDxcCompiler machDxcInitWithAllocator(const MachDxcAllocator* allocator) {
+    assert(allocator != nullptr && allocator->alloc_func != nullptr && allocator->realloc_func != nullptr && allocator->free_func != nullptr);
+    return createCompiler(0, allocator);
 }
 
 MACH_EXPORT void machDxcDeinit(MachDxcCompiler compiler) {
-    CComPtr<IDxcCompiler3> dxcInstance = CComPtr(reinterpret_cast<IDxcCompiler3*>(compiler));
-    dxcInstance.Release();
-    MachDxcompilerInvokeDllShutdown();
+    {
+        MachDxcHeapScope heap;
+        delete compiler;
+    }
+    releaseGlobals();
+}
+
+MACH_EXPORT MachDxcPoolStats machDxcCompilerGetPoolStats(MachDxcCompiler compiler) {
+    return compiler->pool.stats();
+}
+
+MACH_EXPORT size_t machDxcCompilerGetPoolInstanceStats(MachDxcCompiler compiler, MachDxcPoolInstanceStats* out, size_t capacity) {
+    return compiler->pool.instanceStats(out, capacity);
+}
+
+MACH_EXPORT void machDxcCompilerEnableCache(MachDxcCompiler compiler, size_t max_bytes) {
+    if (max_bytes == 0)
+        compiler->cache.reset();
+    else
+        compiler->cache.reset(new MachDxcCompileCache(max_bytes));
+}
+
+MACH_EXPORT MachDxcCacheStats machDxcCompilerGetCacheStats(MachDxcCompiler compiler) {
+    if (compiler->cache == nullptr)
+        return MachDxcCacheStats{};
+    return compiler->cache->stats();
+}
+
+MACH_EXPORT int machDxcCompilerEnableDiskCache(MachDxcCompiler compiler, char const* directory, size_t max_bytes) {
+    compiler->disk_cache.reset();
+    if (directory == nullptr)
+        return 1;
+    compiler->disk_cache.reset(MachDxcDiskCache::open(directory, max_bytes));
+    return compiler->disk_cache != nullptr;
+}
+
+MACH_EXPORT MachDxcCacheStats machDxcCompilerGetDiskCacheStats(MachDxcCompiler compiler) {
+    if (compiler->disk_cache == nullptr)
+        return MachDxcCacheStats{};
+    return compiler->disk_cache->stats();
+}
+
+MACH_EXPORT void machDxcCompilerEnableIncludeCache(MachDxcCompiler compiler, MachDxcIncludeValidation validation, size_t max_bytes) {
+    if (max_bytes == 0)
+        compiler->include_cache.reset();
+    else
+        compiler->include_cache.reset(new MachDxcIncludeCache(validation, max_bytes));
+}
+
+MACH_EXPORT MachDxcIncludeCacheStats machDxcCompilerGetIncludeCacheStats(MachDxcCompiler compiler) {
+    if (compiler->include_cache == nullptr)
+        return MachDxcIncludeCacheStats{};
+    return compiler->include_cache->stats();
+}
+
+//------------
+// MachDxcArgs
+//------------
+MACH_EXPORT MachDxcArgs machDxcArgsInit(char const* const* args, size_t args_len) {
+    MachDxcArgsImpl* impl = new MachDxcArgsImpl();
+    impl->utf8.assign(args, args + args_len);
+    impl->wide.resize(args_len);
+    for (size_t i = 0; i < args_len; i++) {
+        const std::string& arg = impl->utf8[i];
+        impl->wide[i].resize(utf8ToWide(arg.data(), arg.size(), nullptr));
+        utf8ToWide(arg.data(), arg.size(), &impl->wide[i][0]);
+    }
+    for (size_t i = 0; i < args_len; i++) {
+        impl->utf8_pointers.push_back(impl->utf8[i].c_str());
+        impl->wide_pointers.push_back(impl->wide[i].c_str());
+    }
+    return impl;
+}
+
+MACH_EXPORT void machDxcArgsDeinit(MachDxcArgs args) {
+    delete args;
+}
+
+//--------------------
+// MachDxcPrefixHeader
+//--------------------
+MACH_EXPORT MachDxcPrefixHeader machDxcPrefixHeaderInit(
+    MachDxcCompiler compiler,
+    MachDxcIncludeCallbacks* callbacks,
+    char const* const* headers,
+    size_t headers_len,
+    char const* const* defines,
+    size_t defines_len
+) {
+    assert(callbacks != nullptr && callbacks->include_func != nullptr && callbacks->free_func != nullptr);
+    MachDxcDependencyGraphImpl graph;
+    scanDependencies(compiler, callbacks, headers, headers_len, 0, true, &graph);
+
+    MachDxcPrefixHeaderImpl* prefix_header = new MachDxcPrefixHeaderImpl();
+    llvm::MD5 md5;
+    prefix_header->defines.resize(defines_len);
+    for (size_t i = 0; i < defines_len; i++) {
+        size_t define_len = std::strlen(defines[i]);
+        prefix_header->defines[i].resize(utf8ToWide(defines[i], define_len, nullptr));
+        utf8ToWide(defines[i], define_len, &prefix_header->defines[i][0]);
+        hashUpdate(md5, defines[i], define_len + 1);
+    }
+    for (const std::wstring& define : prefix_header->defines) {
+        prefix_header->define_args.push_back(L"-D");
+        prefix_header->define_args.push_back(define.c_str());
+    }
+
+    // Names are normalized by the scan, so the handler finds them however DXC spells them.
+    for (size_t i = 0; i < headers_len; i++)
+        prefix_header->preamble += "#include \"" + graph.nodes[i].name + "\"\n";
+    prefix_header->preamble += "#line 1\n";
+    hashUpdate(md5, prefix_header->preamble.data(), prefix_header->preamble.size());
+
+    for (MachDxcDependencyNodeImpl& node : graph.nodes) {
+        hashUpdate(md5, node.name.c_str(), node.name.size() + 1);
+        hashUpdate(md5, node.hash.bytes, sizeof(node.hash.bytes));
+        prefix_header->files.emplace(node.name, node.content);
+    }
+    prefix_header->hash = hashFinal(md5);
+    return prefix_header;
+}
+
+MACH_EXPORT void machDxcPrefixHeaderDeinit(MachDxcPrefixHeader prefix_header) {
+    MachDxcHeapScope heap;
+    delete prefix_header;
+}
+
+//--------------
+// MachDxcLinker
+//--------------
+MACH_EXPORT MachDxcLinker machDxcLinkerInit(MachDxcCompiler compiler) {
+    MachDxcLinkerImpl* linker = new MachDxcLinkerImpl();
+    linker->compiler = compiler;
+    return linker;
+}
+
+MACH_EXPORT void machDxcLinkerDeinit(MachDxcLinker linker) {
+    MachDxcHeapScope heap;
+    delete linker;
+}
+
+MACH_EXPORT int machDxcLinkerRegisterLibrary(MachDxcLinker linker, char const* name, MachDxcCompileObject library) {
+    std::lock_guard<std::mutex> guard(linker->lock);
+    MachDxcLinkerLibrary entry;
+    entry.module = reinterpret_cast<IDxcBlob*>(library);
+    entry.version = linker->next_version;
+    if (!linker->libraries.emplace(name, std::move(entry)).second)
+        return 0;
+    linker->next_version++;
+    return 1;
+}
+
+MACH_EXPORT void machDxcLinkerUpdateLibraries(
+    MachDxcLinker linker,
+    char const* const* names,
+    MachDxcCompileOptions* libraries,
+    size_t n,
+    MachDxcCompileResult* out,
+    size_t num_threads
+) {
+    MachDxcCompilerImpl* compiler = linker->compiler;
+    parallelForOnContexts(compiler, n, num_threads, [&](size_t, MachDxcCompileContext* context, size_t index) {
+        out[index] = nullptr;
+        MachDxcHash key;
+        uint64_t preprocess_ns;
+        bool keyed = hashPreprocessedCompile(compiler, context, &libraries[index], &key, &preprocess_ns);
+
+        // Reuse the module of any library compiled from the same preprocessed source, including
+        // this one if it is unchanged.
+        CComPtr<IDxcBlob> module;
+        if (keyed) {
+            std::lock_guard<std::mutex> guard(linker->lock);
+            auto it = linker->libraries.find(names[index]);
+            if (it != linker->libraries.end() && it->second.keyed && it->second.key == key)
+                return;
+            for (const auto& library : linker->libraries) {
+                if (library.second.keyed && library.second.key == key) {
+                    module = library.second.module;
+                    break;
+                }
+            }
+        }
+
+        MachDxcCompileResult result;
+        if (module != nullptr) {
+            result = new MachDxcCompileResultImpl();
+            result->object = module;
+            result->timings.total_ns = preprocess_ns;
+        } else {
+            result = compileWithContext(compiler, context, &libraries[index], false);
+            result->timings.total_ns += preprocess_ns;
+            if (hlsl::IsBlobNullOrEmpty(result->object)) {
+                out[index] = result;
+                return;
+            }
+        }
+
+        std::lock_guard<std::mutex> guard(linker->lock);
+        MachDxcLinkerLibrary& library = linker->libraries[names[index]];
+        library.module = result->object;
+        library.version = linker->next_version++;
+        library.key = key;
+        library.keyed = keyed;
+        out[index] = result;
+    });
+}
+
+MACH_EXPORT MachDxcCompileResult machDxcLinkerLink(MachDxcLinker linker, const MachDxcLinkJob* job) {
+    return linkWithLinker(linker, job);
+}
+
+MACH_EXPORT void machDxcLinkerLinkBatch(
+    MachDxcLinker linker,
+    const MachDxcLinkJob* jobs,
+    size_t n,
+    MachDxcCompileResult* out,
+    size_t num_threads
+) {
+    if (num_threads == 0)
+        num_threads = std::thread::hardware_concurrency();
+    if (num_threads > n)
+        num_threads = n;
+    if (num_threads == 0)
+        num_threads = 1;
+    parallelFor(n, num_threads, [&](size_t, size_t index) {
+        out[index] = linkWithLinker(linker, &jobs[index]);
+    });
+}
+
+//-----------------
+// MachDxcOptimizer
+//-----------------
+MACH_EXPORT MachDxcOptimizer machDxcOptimizerInit(MachDxcCompiler compiler) {
+    MachDxcOptimizerImpl* optimizer = new MachDxcOptimizerImpl();
+    optimizer->compiler = compiler;
+    HRESULT hr = S_OK;
+    std::unique_ptr<MachDxcOptimizerInstance> instance = leaseOptimizerInstance(optimizer, &hr);
+    if (instance == nullptr) {
+        delete optimizer;
+        return nullptr;
+    }
+    enumerateOptimizerPasses(instance->optimizer, &optimizer->passes);
+    optimizer->idle.push_back(std::move(instance));
+    return optimizer;
+}
+
+MACH_EXPORT void machDxcOptimizerDeinit(MachDxcOptimizer optimizer) {
+    MachDxcHeapScope heap;
+    delete optimizer;
+}
+
+MACH_EXPORT size_t machDxcOptimizerGetPassCount(MachDxcOptimizer optimizer) {
+    return optimizer->passes.size();
+}
+
+MACH_EXPORT MachDxcOptimizerPass machDxcOptimizerGetPass(MachDxcOptimizer optimizer, size_t index) {
+    assert(index < optimizer->passes.size());
+    const MachDxcOptimizerPassInfo& info = optimizer->passes[index];
+    MachDxcOptimizerPass pass;
+    pass.name = info.name.c_str();
+    pass.description = info.description.c_str();
+    pass.arg_names = info.arg_name_pointers.data();
+    pass.arg_descriptions = info.arg_description_pointers.data();
+    pass.args_len = info.arg_names.size();
+    return pass;
 }
 
+MACH_EXPORT MachDxcCompileResult machDxcOptimize(MachDxcOptimizer optimizer, const MachDxcOptimizeOptions* options) {
+    return optimizeWithOptimizer(optimizer, options);
+}
 
 //---------------------
 // MachDxcCompileResult
@@ -130,84 +4403,338 @@ MACH_EXPORT MachDxcCompileResult machDxcCompile(
     MachDxcCompiler compiler,
     MachDxcCompileOptions* options
 ) {
-    CComPtr<IDxcCompiler3> dxcInstance = CComPtr(reinterpret_cast<IDxcCompiler3*>(compiler));
+    MachDxcContextLease context(compiler->pool);
+    return compileWithContext(compiler, context.get(), options, false);
+}
 
-    CComPtr<IDxcUtils> pUtils;
-    DxcCreateInstance(CLSID_DxcUtils, IID_PPV_ARGS(&pUtils));
-    CComPtr<IDxcBlobEncoding> pSource;
-    pUtils->CreateBlob(options->code, options->code_len, CP_UTF8, &pSource);
+MACH_EXPORT MachDxcCompileResult machDxcPreprocess(
+    MachDxcCompiler compiler,
+    MachDxcCompileOptions* options
+) {
+    MachDxcContextLease context(compiler->pool);
+    return compileWithContext(compiler, context.get(), options, true);
+}
 
-    DxcBuffer sourceBuffer;
-    sourceBuffer.Ptr = pSource->GetBufferPointer();
-    sourceBuffer.Size = pSource->GetBufferSize();
-    sourceBuffer.Encoding = 0;
+MACH_EXPORT void machDxcCompileBatch(
+    MachDxcCompiler compiler,
+    MachDxcCompileOptions* jobs,
+    size_t n,
+    MachDxcCompileResult* out,
+    size_t num_threads
+) {
+    parallelForOnContexts(compiler, n, num_threads, [&](size_t, MachDxcCompileContext* context, size_t index) {
+        out[index] = compileWithContext(compiler, context, &jobs[index], false);
+    });
+}
 
-    // We have args in char form, but dxcInstance->Compile expects wchar_t form.
-    LPCWSTR* arguments = (LPCWSTR*)malloc(sizeof(LPCWSTR) * options->args_len);
-    wchar_t* wtext_buf = (wchar_t*)malloc(4096);
-    wchar_t* wtext_cursor = wtext_buf;
-    assert(arguments);
-    assert(wtext_buf);
+MACH_EXPORT void machDxcCompilePermutations(
+    MachDxcCompiler compiler,
+    MachDxcCompileOptions* options,
+    const MachDxcPermutation* permutations,
+    size_t n,
+    int dedupe,
+    MachDxcCompileResult* out,
+    size_t num_threads
+) {
+    // The shared arguments are converted once and passed to every permutation as base args.
+    std::vector<const char*> shared_args;
+    if (options->base_args != nullptr)
+        shared_args = options->base_args->utf8_pointers;
+    shared_args.insert(shared_args.end(), options->args, options->args + options->args_len);
+    std::unique_ptr<MachDxcArgsImpl> base_args(machDxcArgsInit(shared_args.data(), shared_args.size()));
+
+    // The include cache already shares headers between compiles; without one, share them for the
+    // duration of the call.
+    std::unique_ptr<MachDxcIncludeMemo> include_memo;
+    if (options->include_callbacks != nullptr && compiler->include_cache == nullptr)
+        include_memo.reset(new MachDxcIncludeMemo(options->include_callbacks));
+
+    std::vector<MachDxcCompileOptions> jobs(n, *options);
+    for (size_t i = 0; i < n; i++) {
+        jobs[i].base_args = base_args.get();
+        jobs[i].args = permutations[i].args;
+        jobs[i].args_len = permutations[i].args_len;
+        if (include_memo != nullptr) {
+            jobs[i].include_callbacks = include_memo->callbacks();
+            jobs[i].pin_includes = 1;
+        }
+    }
 
-    for (int i=0; i < options->args_len; i++) {
-        size_t available = 4096 / sizeof(wchar_t) - (wtext_cursor - wtext_buf);
-        size_t written = std::mbstowcs(wtext_cursor, options->args[i], available);
-        arguments[i] = wtext_cursor;
-        wtext_cursor += written + 1;
+    // Permutations that preprocess to the same source and differ only in preprocessor arguments
+    // compile to the same result, so only the first of them is compiled.
+    std::vector<size_t> compiled_by(n);
+    std::vector<uint64_t> preprocess_ns(n, 0);
+    for (size_t i = 0; i < n; i++)
+        compiled_by[i] = i;
+    if (dedupe != 0 && n > 1) {
+        std::vector<MachDxcHash> keys(n);
+        std::vector<char> keyed(n, 0);
+        parallelForOnContexts(compiler, n, num_threads, [&](size_t, MachDxcCompileContext* context, size_t index) {
+            keyed[index] = hashPreprocessedCompile(compiler, context, &jobs[index], &keys[index], &preprocess_ns[index]);
+        });
+
+        std::unordered_map<MachDxcHash, size_t, MachDxcHashHasher> first_with_key;
+        for (size_t i = 0; i < n; i++) {
+            if (keyed[i])
+                compiled_by[i] = first_with_key.emplace(keys[i], i).first->second;
+        }
     }
 
-    MachDxcIncludeHandler* handler = nullptr;
-    if (options->include_callbacks != nullptr) // Leave include handler as default (nullptr) unless there's available callbacks
-        handler = new MachDxcIncludeHandler(options->include_callbacks, pUtils);
+    std::vector<size_t> compiled;
+    for (size_t i = 0; i < n; i++) {
+        if (compiled_by[i] == i)
+            compiled.push_back(i);
+    }
+    parallelForOnContexts(compiler, compiled.size(), num_threads, [&](size_t, MachDxcCompileContext* context, size_t index) {
+        out[compiled[index]] = compileWithContext(compiler, context, &jobs[compiled[index]], false);
+    });
 
-    CComPtr<IDxcResult> pCompileResult;
-    HRESULT hr = dxcInstance->Compile(
-        &sourceBuffer,
-        arguments,
-        (uint32_t)options->args_len,
-        handler,
-        IID_PPV_ARGS(&pCompileResult)
-    );
+    for (size_t i = 0; i < n; i++) {
+        if (compiled_by[i] == i)
+            continue;
+        MachDxcCompileResultImpl* result = new MachDxcCompileResultImpl();
+        result->object = out[compiled_by[i]]->object;
+        result->errors = out[compiled_by[i]]->errors;
+        result->timings.total_ns = preprocess_ns[i];
+        out[i] = result;
+    }
+}
+
+MACH_EXPORT void machDxcCompileEntryPoints(
+    MachDxcCompiler compiler,
+    MachDxcCompileOptions* options,
+    const MachDxcEntryPoint* entry_points,
+    size_t n,
+    MachDxcCompileResult* out,
+    size_t num_threads
+) {
+    std::vector<const char*> shared_args;
+    if (options->base_args != nullptr)
+        removeArgs(options->base_args->utf8_pointers.data(), options->base_args->utf8_pointers.size(), "ET", &shared_args);
+    removeArgs(options->args, options->args_len, "ET", &shared_args);
+
+    std::vector<const char*> entry_args;
+    for (size_t i = 0; i < n; i++) {
+        entry_args.push_back(entry_points[i].name);
+        entry_args.push_back(entry_points[i].target_profile);
+    }
+    std::unique_ptr<MachDxcArgsImpl> entry_args_wide(machDxcArgsInit(entry_args.data(), entry_args.size()));
+
+    // Compile the source once as a library holding every function, then link each entry point
+    // out of it. Only shader model 6 entry points declared with a shader attribute can be linked,
+    // and the library only pays off if at least two can. Linking needs shader model 6.3
+    // libraries, so the library targets the highest shader model among the entry points, but no
+    // lower than 6.3.
+    std::vector<std::string> shader_functions;
+    scanShaderFunctions(options->code, options->code_len, &shader_functions);
+    std::vector<size_t> linked_entries;
+    int library_minor = 3;
+    for (size_t i = 0; i < n; i++) {
+        int minor = shaderModel6Minor(entry_points[i].target_profile);
+        if (minor < 0 || std::find(shader_functions.begin(), shader_functions.end(), entry_points[i].name) == shader_functions.end())
+            continue;
+        linked_entries.push_back(i);
+        if (minor > library_minor)
+            library_minor = minor;
+    }
 
-    if (handler != nullptr)
-        delete handler;
+    for (size_t i = 0; i < n; i++)
+        out[i] = nullptr;
+    if (linked_entries.size() > 1) {
+        char library_profile[16];
+        snprintf(library_profile, sizeof(library_profile), "lib_6_%d", library_minor);
+        std::vector<const char*> library_args = shared_args;
+        library_args.insert(library_args.end(), {"-T", library_profile, "-default-linkage", "external"});
+        MachDxcCompileOptions library_options = *options;
+        library_options.base_args = nullptr;
+        library_options.args = library_args.data();
+        library_options.args_len = library_args.size();
 
-    assert(SUCCEEDED(hr));
-    free(arguments);
-    free(wtext_buf);
+        MachDxcCompileResult library;
+        {
+            MachDxcContextLease context(compiler->pool);
+            library = compileWithContext(compiler, context.get(), &library_options, false);
+        }
+
+        if (!hlsl::IsBlobNullOrEmpty(library->object)) {
+            // Options that only matter to the front end were already applied to the library.
+            std::vector<const char*> link_args;
+            removeArgs(shared_args.data(), shared_args.size(), "DUI", &link_args);
+            std::unique_ptr<MachDxcArgsImpl> link_args_wide(machDxcArgsInit(link_args.data(), link_args.size()));
+            std::vector<LPCWSTR> library_names(1, L"library");
+
+            // Each worker registers the library with a linker of its own, created with its
+            // context's allocator.
+            std::vector<CComPtr<IDxcLinker>> linkers(linked_entries.size());
+            parallelForOnContexts(compiler, linked_entries.size(), num_threads, [&](size_t worker, MachDxcCompileContext* context, size_t linked_index) {
+                size_t index = linked_entries[linked_index];
+                if (linkers[worker] == nullptr) {
+                    HRESULT hr = DxcCreateInstance2(context->allocator.p, CLSID_DxcLinker, IID_PPV_ARGS(&linkers[worker]));
+                    if (FAILED(hr) || FAILED(linkers[worker]->RegisterLibrary(L"library", library->object))) {
+                        linkers[worker].Release();
+                        return;
+                    }
+                }
+                MachDxcCompileResult result = linkEntryPoint(linkers[worker], compiler->utils, entry_args_wide->wide_pointers[index * 2],
+                    entry_args_wide->wide_pointers[index * 2 + 1], library_names, link_args_wide->wide_pointers);
+                if (hlsl::IsBlobNullOrEmpty(result->object)) {
+                    delete result;
+                } else {
+                    prependDiagnostics(result, library->errors);
+                    out[index] = result;
+                }
+            });
+        }
+        delete library;
+    }
+
+    // Whatever couldn't be linked, including every entry point of a source that doesn't compile as
+    // a library, is compiled on its own so that it gets its own diagnostics.
+    std::vector<size_t> unlinked;
+    for (size_t i = 0; i < n; i++) {
+        if (out[i] == nullptr)
+            unlinked.push_back(i);
+    }
+    if (unlinked.empty())
+        return;
 
-    return reinterpret_cast<MachDxcCompileResult>(pCompileResult.Detach());
+    std::unique_ptr<MachDxcArgsImpl> base_args(machDxcArgsInit(shared_args.data(), shared_args.size()));
+    std::vector<std::array<const char*, 4>> per_entry_args(n);
+    std::vector<MachDxcCompileOptions> jobs(n, *options);
+    for (size_t i : unlinked) {
+        per_entry_args[i] = {"-E", entry_points[i].name, "-T", entry_points[i].target_profile};
+        jobs[i].base_args = base_args.get();
+        jobs[i].args = per_entry_args[i].data();
+        jobs[i].args_len = per_entry_args[i].size();
+    }
+    parallelForOnContexts(compiler, unlinked.size(), num_threads, [&](size_t, MachDxcCompileContext* context, size_t index) {
+        out[unlinked[index]] = compileWithContext(compiler, context, &jobs[unlinked[index]], false);
+    });
 }
 
-MACH_EXPORT MachDxcCompileError machDxcCompileResultGetError(MachDxcCompileResult err) {
-    CComPtr<IDxcResult> pCompileResult = CComPtr(reinterpret_cast<IDxcResult*>(err));
-    
-    CComPtr<IDxcBlobEncoding> pErrors = nullptr;
-    HRESULT hr = pCompileResult->GetErrorBuffer(&pErrors);
+MACH_EXPORT MachDxcCompileRequest machDxcCompileAsync(
+    MachDxcCompiler compiler,
+    MachDxcCompileOptions* options,
+    MachDxcCompileCallback callback,
+    void* user_data
+) {
+    MachDxcCompileRequestImpl* request = new MachDxcCompileRequestImpl();
+    request->code.assign(options->code, options->code_len);
+    request->args.assign(options->args, options->args + options->args_len);
+    for (const std::string& arg : request->args)
+        request->arg_pointers.push_back(arg.c_str());
+    request->options = *options;
+    request->options.code = request->code.data();
+    request->options.args = request->arg_pointers.data();
+    request->callback = callback;
+    request->user_data = user_data;
 
-    if (hr == S_OK && !hlsl::IsBlobNullOrEmpty(pErrors)) {
-        return reinterpret_cast<MachDxcCompileError>(pErrors.Detach());
+    {
+        std::lock_guard<std::mutex> guard(compiler->executor_lock);
+        if (compiler->executor == nullptr)
+            compiler->executor.reset(new MachDxcExecutor(compiler));
     }
+    compiler->executor->submit(request);
+    return request;
+}
 
-    return nullptr;
+//----------------------
+// MachDxcCompileRequest
+//----------------------
+MACH_EXPORT MachDxcCompileStatus machDxcCompileRequestPoll(MachDxcCompileRequest request) {
+    std::lock_guard<std::mutex> guard(request->lock);
+    return request->status;
 }
 
-MACH_EXPORT MachDxcCompileObject machDxcCompileResultGetObject(MachDxcCompileResult err) {
-    CComPtr<IDxcResult> pCompileResult = CComPtr(reinterpret_cast<IDxcResult*>(err));
-    
-    CComPtr<IDxcBlob> pObject = nullptr;
-    HRESULT hr = pCompileResult->GetResult(&pObject);
+MACH_EXPORT MachDxcCompileStatus machDxcCompileRequestWait(MachDxcCompileRequest request) {
+    std::unique_lock<std::mutex> guard(request->lock);
+    request->completed.wait(guard, [&] { return request->status != MachDxcCompilePending; });
+    return request->status;
+}
 
-    if (hr == S_OK && !hlsl::IsBlobNullOrEmpty(pObject)) {
-        return reinterpret_cast<MachDxcCompileObject>(pObject.Detach());
+MACH_EXPORT int machDxcCompileRequestCancel(MachDxcCompileRequest request) {
+    {
+        std::lock_guard<std::mutex> guard(request->lock);
+        if (request->status != MachDxcCompilePending || request->cancel_requested)
+            return 0;
+        request->cancel_requested = true;
+        // A running compile can't be interrupted; the worker discards its result instead.
+        if (request->started)
+            return 1;
     }
+    completeRequest(request, nullptr);
+    return 1;
+}
+
+MACH_EXPORT MachDxcCompileResult machDxcCompileRequestGetResult(MachDxcCompileRequest request) {
+    std::lock_guard<std::mutex> guard(request->lock);
+    MachDxcCompileResult result = request->result;
+    request->result = nullptr;
+    return result;
+}
+
+MACH_EXPORT void machDxcCompileRequestDeinit(MachDxcCompileRequest request) {
+    releaseRequest(request);
+}
+
+//---------------------
+// MachDxcCompileResult
+//---------------------
+MACH_EXPORT MachDxcCompileError machDxcCompileResultGetError(MachDxcCompileResult err) {
+    if (hlsl::IsBlobNullOrEmpty(err->errors))
+        return nullptr;
+
+    IDxcBlobUtf8* pErrors = err->errors;
+    pErrors->AddRef();
+    return reinterpret_cast<MachDxcCompileError>(pErrors);
+}
+
+MACH_EXPORT MachDxcCompileObject machDxcCompileResultGetObject(MachDxcCompileResult err) {
+    if (hlsl::IsBlobNullOrEmpty(err->object))
+        return nullptr;
+
+    IDxcBlob* pObject = err->object;
+    pObject->AddRef();
+    return reinterpret_cast<MachDxcCompileObject>(pObject);
+}
+
+MACH_EXPORT int machDxcCompileResultIsLinked(MachDxcCompileResult result) {
+    return result->linked ? 1 : 0;
+}
 
-    return nullptr;
+MACH_EXPORT MachDxcCompileTimings machDxcCompileResultGetTimings(MachDxcCompileResult result) {
+    return result->timings;
+}
+
+MACH_EXPORT size_t machDxcCompileResultGetPassTimings(MachDxcCompileResult result, MachDxcPassTiming* out, size_t capacity) {
+    for (size_t i = 0; i < result->pass_timings.size() && i < capacity; i++)
+        out[i] = result->pass_timings[i];
+    return result->pass_timings.size();
+}
+
+MACH_EXPORT size_t machDxcCompileResultGetIncludeCount(MachDxcCompileResult result) {
+    return result->includes.size();
+}
+
+MACH_EXPORT const char* machDxcCompileResultGetInclude(MachDxcCompileResult result, size_t index) {
+    assert(index < result->includes.size());
+    return result->includes[index].c_str();
+}
+
+MACH_EXPORT MachDxcMemoryStats machDxcCompileResultGetMemoryStats(MachDxcCompileResult result) {
+    return result->memory;
+}
+
+MACH_EXPORT const char* machDxcCompileResultGetTrace(MachDxcCompileResult result) {
+    return result->trace.empty() ? nullptr : result->trace.c_str();
+}
+
+MACH_EXPORT size_t machDxcCompileResultGetTraceLength(MachDxcCompileResult result) {
+    return result->trace.size();
 }
 
 MACH_EXPORT void machDxcCompileResultDeinit(MachDxcCompileResult err) {
-    CComPtr<IDxcResult> pCompileResult = CComPtr(reinterpret_cast<IDxcResult*>(err));
-    pCompileResult.Release();
+    delete err;
 }
 
 //---------------------
@@ -224,8 +4751,8 @@ MACH_EXPORT size_t machDxcCompileObjectGetBytesLength(MachDxcCompileObject err)
 }
 
 MACH_EXPORT void machDxcCompileObjectDeinit(MachDxcCompileObject err) {
-    CComPtr<IDxcBlob> pObject = CComPtr(reinterpret_cast<IDxcBlob*>(err));
-    pObject.Release();
+    MachDxcHeapScope heap;
+    reinterpret_cast<IDxcBlob*>(err)->Release();
 }
 
 //--------------------
@@ -242,8 +4769,252 @@ MACH_EXPORT size_t machDxcCompileErrorGetStringLength(MachDxcCompileError err) {
 }
 
 MACH_EXPORT void machDxcCompileErrorDeinit(MachDxcCompileError err) {
-    CComPtr<IDxcBlobUtf8> pErrors = CComPtr(reinterpret_cast<IDxcBlobUtf8*>(err));
-    pErrors.Release();
+    MachDxcHeapScope heap;
+    reinterpret_cast<IDxcBlobUtf8*>(err)->Release();
+}
+
+//--------------------
+// Dependency scanning
+//--------------------
+MACH_EXPORT MachDxcDependencyGraph machDxcScanDependencies(
+    MachDxcCompiler compiler,
+    MachDxcIncludeCallbacks* callbacks,
+    char const* const* entries,
+    size_t entries_len,
+    size_t num_threads
+) {
+    assert(callbacks != nullptr && callbacks->include_func != nullptr && callbacks->free_func != nullptr);
+    MachDxcDependencyGraphImpl* graph = new MachDxcDependencyGraphImpl();
+    scanDependencies(compiler, callbacks, entries, entries_len, num_threads, false, graph);
+    return graph;
+}
+
+MACH_EXPORT size_t machDxcDependencyGraphGetNodeCount(MachDxcDependencyGraph graph) {
+    return graph->nodes.size();
+}
+
+MACH_EXPORT MachDxcDependencyNode machDxcDependencyGraphGetNode(MachDxcDependencyGraph graph, size_t index) {
+    const MachDxcDependencyNodeImpl& impl = graph->nodes[index];
+    MachDxcDependencyNode node;
+    node.name = impl.name.c_str();
+    std::memcpy(node.hash, impl.hash.bytes, sizeof(node.hash));
+    node.includes = impl.includes.data();
+    node.includes_len = impl.includes.size();
+    return node;
+}
+
+MACH_EXPORT void machDxcDependencyGraphDeinit(MachDxcDependencyGraph graph) {
+    delete graph;
+}
+
+//------------------
+// MachDxcReflection
+//------------------
+struct MachDxcReflectionVariable {
+    std::string name;
+    MachDxcConstantBufferVariable desc;
+};
+
+struct MachDxcReflectionBuffer {
+    std::string name;
+    uint32_t size;
+    std::vector<MachDxcReflectionVariable> variables;
+};
+
+// Container parts are only located up front; everything else is decoded from them on access.
+struct MachDxcReflectionImpl {
+    MachDxcCompilerImpl* compiler;
+    const void* bytes;
+    size_t len;
+    const hlsl::DxilPartHeader* signatures[3] = {};
+    DxilPipelineStateValidation psv;
+    bool has_psv = false;
+
+    std::once_flag buffers_loaded;
+    std::vector<MachDxcReflectionBuffer> buffers;
+};
+
+// Returns the number of elements of a signature part that lie within it.
+static size_t signatureElementCount(const hlsl::DxilPartHeader* part) {
+    if (part == nullptr || part->PartSize < sizeof(hlsl::DxilProgramSignature))
+        return 0;
+    hlsl::DxilProgramSignature signature;
+    std::memcpy(&signature, hlsl::GetDxilPartData(part), sizeof(signature));
+    if (signature.ParamOffset > part->PartSize)
+        return 0;
+    size_t fits = (part->PartSize - signature.ParamOffset) / sizeof(hlsl::DxilProgramSignatureElement);
+    return signature.ParamCount < fits ? signature.ParamCount : fits;
+}
+
+// Loads the module through ID3D12ShaderReflection and copies out the constant buffer layouts.
+static void loadReflectionBuffers(MachDxcReflectionImpl* reflection) {
+    DxcBuffer buffer;
+    buffer.Ptr = reflection->bytes;
+    buffer.Size = reflection->len;
+    buffer.Encoding = DXC_CP_ACP;
+    CComPtr<ID3D12ShaderReflection> shader_reflection;
+    if (FAILED(reflection->compiler->utils->CreateReflection(&buffer, IID_PPV_ARGS(&shader_reflection))))
+        return;
+
+    D3D12_SHADER_DESC shader_desc;
+    if (FAILED(shader_reflection->GetDesc(&shader_desc)))
+        return;
+    for (UINT i = 0; i < shader_desc.ConstantBuffers; i++) {
+        ID3D12ShaderReflectionConstantBuffer* constant_buffer = shader_reflection->GetConstantBufferByIndex(i);
+        D3D12_SHADER_BUFFER_DESC buffer_desc;
+        if (constant_buffer == nullptr || FAILED(constant_buffer->GetDesc(&buffer_desc)))
+            continue;
+        reflection->buffers.emplace_back();
+        MachDxcReflectionBuffer& out = reflection->buffers.back();
+        out.name = buffer_desc.Name != nullptr ? buffer_desc.Name : "";
+        out.size = buffer_desc.Size;
+        for (UINT v = 0; v < buffer_desc.Variables; v++) {
+            ID3D12ShaderReflectionVariable* variable = constant_buffer->GetVariableByIndex(v);
+            D3D12_SHADER_VARIABLE_DESC variable_desc;
+            if (variable == nullptr || FAILED(variable->GetDesc(&variable_desc)))
+                continue;
+            MachDxcReflectionVariable entry;
+            entry.name = variable_desc.Name != nullptr ? variable_desc.Name : "";
+            entry.desc = {};
+            entry.desc.offset = variable_desc.StartOffset;
+            entry.desc.size = variable_desc.Size;
+            D3D12_SHADER_TYPE_DESC type_desc;
+            ID3D12ShaderReflectionType* type = variable->GetType();
+            if (type != nullptr && SUCCEEDED(type->GetDesc(&type_desc))) {
+                entry.desc.type_class = (uint32_t)type_desc.Class;
+                entry.desc.type = (uint32_t)type_desc.Type;
+                entry.desc.rows = type_desc.Rows;
+                entry.desc.columns = type_desc.Columns;
+                entry.desc.elements = type_desc.Elements;
+            }
+            out.variables.push_back(std::move(entry));
+        }
+    }
+}
+
+MACH_EXPORT MachDxcReflection machDxcReflect(MachDxcCompiler compiler, const void* bytes, size_t len) {
+    const hlsl::DxilContainerHeader* container = hlsl::IsDxilContainerLike(bytes, len);
+    if (container == nullptr || !hlsl::IsValidDxilContainer(container, len))
+        return nullptr;
+
+    MachDxcReflectionImpl* reflection = new MachDxcReflectionImpl();
+    reflection->compiler = compiler;
+    reflection->bytes = bytes;
+    reflection->len = len;
+    reflection->signatures[MachDxcSignatureKindInput] = hlsl::GetDxilPartByType(container, hlsl::DFCC_InputSignature);
+    reflection->signatures[MachDxcSignatureKindOutput] = hlsl::GetDxilPartByType(container, hlsl::DFCC_OutputSignature);
+    reflection->signatures[MachDxcSignatureKindPatchConstant] = hlsl::GetDxilPartByType(container, hlsl::DFCC_PatchConstantSignature);
+    if (const hlsl::DxilPartHeader* psv = hlsl::GetDxilPartByType(container, hlsl::DFCC_PipelineStateValidation))
+        reflection->has_psv = reflection->psv.InitFromPSV0(hlsl::GetDxilPartData(psv), psv->PartSize);
+    return reflection;
+}
+
+MACH_EXPORT void machDxcReflectionDeinit(MachDxcReflection reflection) {
+    delete reflection;
+}
+
+MACH_EXPORT MachDxcShaderStage machDxcReflectionGetShaderStage(MachDxcReflection reflection) {
+    const PSVRuntimeInfo1* info = reflection->has_psv ? reflection->psv.GetPSVRuntimeInfo1() : nullptr;
+    if (info == nullptr || info->ShaderStage > MachDxcShaderStageAmplification)
+        return MachDxcShaderStageUnknown;
+    return (MachDxcShaderStage)info->ShaderStage;
+}
+
+MACH_EXPORT int machDxcReflectionGetThreadGroupSize(MachDxcReflection reflection, uint32_t out[3]) {
+    MachDxcShaderStage stage = machDxcReflectionGetShaderStage(reflection);
+    if (stage != MachDxcShaderStageCompute && stage != MachDxcShaderStageMesh && stage != MachDxcShaderStageAmplification)
+        return 0;
+    const PSVRuntimeInfo2* info = reflection->psv.GetPSVRuntimeInfo2();
+    if (info == nullptr)
+        return 0;
+    out[0] = info->NumThreadsX;
+    out[1] = info->NumThreadsY;
+    out[2] = info->NumThreadsZ;
+    return 1;
+}
+
+MACH_EXPORT size_t machDxcReflectionGetResourceBindingCount(MachDxcReflection reflection) {
+    return reflection->has_psv ? reflection->psv.GetBindCount() : 0;
+}
+
+MACH_EXPORT MachDxcResourceBinding machDxcReflectionGetResourceBinding(MachDxcReflection reflection, size_t index) {
+    assert(index < machDxcReflectionGetResourceBindingCount(reflection));
+    const PSVResourceBindInfo0* bind = reflection->psv.GetPSVResourceBindInfo0((uint32_t)index);
+    MachDxcResourceBinding binding = {};
+    binding.type = (MachDxcResourceType)bind->ResType;
+    binding.space = bind->Space;
+    binding.lower_bound = bind->LowerBound;
+    binding.upper_bound = bind->UpperBound;
+    if (const PSVResourceBindInfo1* bind1 = reflection->psv.GetPSVResourceBindInfo1((uint32_t)index)) {
+        binding.kind = bind1->ResKind;
+        binding.flags = bind1->ResFlags;
+    }
+    return binding;
+}
+
+MACH_EXPORT size_t machDxcReflectionGetSignatureElementCount(MachDxcReflection reflection, MachDxcSignatureKind kind) {
+    return signatureElementCount(reflection->signatures[kind]);
+}
+
+MACH_EXPORT MachDxcSignatureElement machDxcReflectionGetSignatureElement(
+    MachDxcReflection reflection,
+    MachDxcSignatureKind kind,
+    size_t index
+) {
+    const hlsl::DxilPartHeader* part = reflection->signatures[kind];
+    assert(index < signatureElementCount(part));
+    // Copied out, since nothing guarantees that the caller's bytes are aligned.
+    const char* data = hlsl::GetDxilPartData(part);
+    hlsl::DxilProgramSignature signature;
+    std::memcpy(&signature, data, sizeof(signature));
+    hlsl::DxilProgramSignatureElement element;
+    std::memcpy(&element, data + signature.ParamOffset + index * sizeof(element), sizeof(element));
+
+    MachDxcSignatureElement out;
+    // Names are offsets into the part; one running off the end of it reads as empty.
+    out.semantic_name = "";
+    if (element.SemanticName < part->PartSize &&
+        std::memchr(data + element.SemanticName, '\0', part->PartSize - element.SemanticName) != nullptr)
+        out.semantic_name = data + element.SemanticName;
+    out.semantic_index = element.SemanticIndex;
+    out.system_value = (uint32_t)element.SystemValue;
+    out.component_type = (uint32_t)element.CompType;
+    out.register_index = element.Register;
+    out.mask = element.Mask;
+    out.rw_mask = element.NeverWrites_Mask;
+    out.stream = element.Stream;
+    out.min_precision = (uint32_t)element.MinPrecision;
+    return out;
+}
+
+MACH_EXPORT size_t machDxcReflectionGetConstantBufferCount(MachDxcReflection reflection) {
+    std::call_once(reflection->buffers_loaded, loadReflectionBuffers, reflection);
+    return reflection->buffers.size();
+}
+
+MACH_EXPORT MachDxcConstantBuffer machDxcReflectionGetConstantBuffer(MachDxcReflection reflection, size_t index) {
+    std::call_once(reflection->buffers_loaded, loadReflectionBuffers, reflection);
+    assert(index < reflection->buffers.size());
+    const MachDxcReflectionBuffer& buffer = reflection->buffers[index];
+    MachDxcConstantBuffer out;
+    out.name = buffer.name.c_str();
+    out.size = buffer.size;
+    out.variables_len = buffer.variables.size();
+    return out;
+}
+
+MACH_EXPORT MachDxcConstantBufferVariable machDxcReflectionGetConstantBufferVariable(
+    MachDxcReflection reflection,
+    size_t buffer_index,
+    size_t variable_index
+) {
+    std::call_once(reflection->buffers_loaded, loadReflectionBuffers, reflection);
+    assert(buffer_index < reflection->buffers.size());
+    const MachDxcReflectionBuffer& buffer = reflection->buffers[buffer_index];
+    assert(variable_index < buffer.variables.size());
+    MachDxcConstantBufferVariable out = buffer.variables[variable_index].desc;
+    out.name = buffer.variables[variable_index].name.c_str();
+    return out;
 }
 
 #ifdef __cplusplus
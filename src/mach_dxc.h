@@ -28,11 +28,19 @@ extern "C" {
 #endif
 
 #include <stddef.h>
+#include <stdint.h>
 
 typedef struct MachDxcCompilerImpl* MachDxcCompiler MACH_OBJECT_ATTRIBUTE;
 typedef struct MachDxcCompileResultImpl* MachDxcCompileResult MACH_OBJECT_ATTRIBUTE;
 typedef struct MachDxcCompileErrorImpl* MachDxcCompileError MACH_OBJECT_ATTRIBUTE;
 typedef struct MachDxcCompileObjectImpl* MachDxcCompileObject MACH_OBJECT_ATTRIBUTE;
+typedef struct MachDxcArgsImpl* MachDxcArgs MACH_OBJECT_ATTRIBUTE;
+typedef struct MachDxcCompileRequestImpl* MachDxcCompileRequest MACH_OBJECT_ATTRIBUTE;
+typedef struct MachDxcPrefixHeaderImpl* MachDxcPrefixHeader MACH_OBJECT_ATTRIBUTE;
+typedef struct MachDxcLinkerImpl* MachDxcLinker MACH_OBJECT_ATTRIBUTE;
+typedef struct MachDxcOptimizerImpl* MachDxcOptimizer MACH_OBJECT_ATTRIBUTE;
+typedef struct MachDxcReflectionImpl* MachDxcReflection MACH_OBJECT_ATTRIBUTE;
+typedef struct MachDxcDependencyGraphImpl* MachDxcDependencyGraph MACH_OBJECT_ATTRIBUTE;
 
 
 typedef struct MachDxcIncludeResult {
@@ -44,12 +52,29 @@ typedef MachDxcIncludeResult* (*MachDxcIncludeFunc)(void* ctx, const char* heade
 
 typedef int (*MachDxcFreeIncludeFunc)(void* ctx, MachDxcIncludeResult* result);
 
+// Returns a token that changes whenever the content include_func would return for header_name
+// changes, such as a file's modification time or a generation counter.
+typedef uint64_t (*MachDxcIncludeVersionFunc)(void* ctx, const char* header_name);
+
 typedef struct MachDxcIncludeCallbacks {
     void* include_ctx;
     MachDxcIncludeFunc include_func;
     MachDxcFreeIncludeFunc free_func;
+    MachDxcIncludeVersionFunc version_func; // nullable, see MachDxcIncludeValidateVersion
 } MachDxcIncludeCallbacks;
 
+/// How finely a compile's time is broken down, see MachDxcCompileTimings.
+typedef enum MachDxcTimingDetail {
+    MachDxcTimingsNone = 0,
+    /// Phases and LLVM passes. DXC's profiler records every span, however short, which is what
+    /// pass timings need but makes tracing cost noticeably more on shaders with many functions.
+    MachDxcTimingsPasses = 1,
+    /// Phases only. The profiler keeps its default granularity, so only spans of at least 500us
+    /// are recorded, and no pass timings are gathered. Cheap enough to leave on for every compile
+    /// of a build, at the price of phases shorter than 500us reading as 0.
+    MachDxcTimingsPhases = 2,
+} MachDxcTimingDetail;
+
 
 typedef struct MachDxcCompileOptions {
     // Required
@@ -60,21 +85,397 @@ typedef struct MachDxcCompileOptions {
 
     // Optional
     MachDxcIncludeCallbacks* include_callbacks; // nullable
+    MachDxcArgs base_args; // nullable, passed to DXC ahead of args
+    MachDxcPrefixHeader prefix_header; // nullable, see machDxcPrefixHeaderInit
+
+    // When nonzero, header data returned by include_func is handed to DXC without being copied,
+    // and free_func is deferred until DXC releases the header instead of being called as soon as
+    // include_func returns. header_data must then be null-terminated at header_length.
+    int pin_includes;
+
+    // A MachDxcTimingDetail. Unless MachDxcTimingsNone, the compile is traced so that
+    // machDxcCompileResultGetTimings can break its time down by phase. See MachDxcCompileTimings
+    // for the cost.
+    int collect_timings;
+
+    // When nonzero, a Chrome trace of the compile is kept for machDxcCompileResultGetTrace. Spans
+    // shorter than 500us are left out unless collect_timings is MachDxcTimingsPasses.
+    int collect_trace;
+
+    // When nonzero, everything DXC allocates during the compile is bumped out of an arena owned
+    // by the pooled DXC instance running it, instead of coming from the heap one block at a time.
+    // The outputs are copied out once the compile finishes and the arena is then recycled as a
+    // whole, which avoids most malloc and free calls and the fragmentation they leave behind in
+    // long-running processes. Each instance's first compile runs without the arena, so that
+    // state DXC and LLVM set up lazily for the process comes from the heap. Should anything
+    // allocated from the arena outlive a compile regardless, the instance keeps that arena's
+    // memory and compiles on the heap from then on. The arena fields of MachDxcMemoryStats tell
+    // whether, and how much, a compile allocated from the arena.
+    int use_arena;
 } MachDxcCompileOptions;
 
 
+//--------
+// Globals
+//--------
+
+/// Process-wide LLVM and DXC state is set up when the first compiler is initialized and torn
+/// down when the last one is deinitialized. Creating and destroying compilers repeatedly, e.g. to
+/// scale a worker count, therefore pays for global setup every time the count drops to zero.
+///
+/// machDxcGlobalInit takes a reference of its own, keeping the state alive until a matching
+/// machDxcGlobalDeinit, typically at process shutdown. Both are thread-safe and may be called any
+/// number of times as long as the calls are balanced.
+MACH_EXPORT void machDxcGlobalInit();
+MACH_EXPORT void machDxcGlobalDeinit();
+
+//--------
+// Tracing
+//--------
+
+/// Starts tracing every compile in the process, on any compiler and thread, until machDxcTraceEnd.
+/// Calling it again while a trace is running discards what was recorded so far.
+///
+/// Traces use the Chrome trace-event format, which chrome://tracing, Perfetto and Speedscope can
+/// open. Each compile is a span on a track for the thread that ran it, with the headers it loaded
+/// and the spans recorded by DXC's profiler (front end, LLVM passes, validation, container
+/// writing) nested inside.
+MACH_EXPORT void machDxcTraceBegin();
+
+/// Stops tracing and writes the trace to the file at path. Returns 0 if it couldn't be written.
+MACH_EXPORT int machDxcTraceEnd(char const* path);
+
 //----------------
 // MachDxcCompiler
 //----------------
 
-/// Initializes a DXC compiler
+/// Initializes a DXC compiler, equivalent to machDxcInitPool(0).
+///
+/// Like the other initializers, returns null if DXC couldn't be initialized.
 ///
 /// Invoke machDxcDeinit when done with the compiler.
 MACH_EXPORT MachDxcCompiler machDxcInit();
 
+/// Initializes a DXC compiler backed by a pool of up to max_instances DXC compiler instances, or
+/// one per CPU core if max_instances is 0.
+///
+/// The compiler owns the DXC objects and scratch buffers used to compile, so it should be created
+/// once and reused for many compiles. machDxcCompile, machDxcCompileBatch and machDxcCompileAsync
+/// may be called from any number of threads at once: each compile leases an instance from the
+/// pool, which creates instances on first demand and makes compiles wait for one once all
+/// max_instances are in use. Enabling or disabling caches is not thread-safe and must not overlap
+/// with compiles.
+///
+/// Invoke machDxcDeinit when done with the compiler.
+MACH_EXPORT MachDxcCompiler machDxcInitPool(size_t max_instances);
+
+/// Allocation functions for machDxcInitWithAllocator. Blocks must be aligned like those from
+/// malloc. The functions are called from any thread compiling with the compiler, possibly
+/// concurrently, and must stay usable until the compiler and every result from it have been
+/// deinitialized.
+///
+/// Blocks from alloc_func and realloc_func are only ever released through free_func or
+/// realloc_func, which are never passed any other block, so the functions may keep a header in
+/// front of each block, such as its size. DXC also releases blocks outside of its own calls and
+/// through other compilers' allocators; to send each block back where it came from, the compiler
+/// records it in a process-wide table, at the cost of a lock and a hash lookup per call.
+typedef struct MachDxcAllocator {
+    void* ctx;
+    void* (*alloc_func)(void* ctx, size_t size);
+    void* (*realloc_func)(void* ctx, void* block, size_t size);
+    void (*free_func)(void* ctx, void* block);
+} MachDxcAllocator;
+
+/// Initializes a DXC compiler like machDxcInit whose DXC instances allocate through allocator
+/// rather than the C heap, which covers the memory DXC allocates internally while compiling and
+/// the blobs it returns. The compiler's own bookkeeping, such as its caches, still uses the C heap,
+/// as does the process-wide state DXC sets up on first use: before the first such compiler is
+/// created, a trivial shader is compiled on the C heap to set it up.
+///
+/// Invoke machDxcDeinit when done with the compiler.
+MACH_EXPORT MachDxcCompiler machDxcInitWithAllocator(const MachDxcAllocator* allocator);
+
 /// Deinitializes the DXC compiler.
 MACH_EXPORT void machDxcDeinit(MachDxcCompiler compiler);
 
+typedef struct MachDxcPoolStats {
+    size_t instances; // created so far
+    size_t max_instances;
+    size_t leases;
+    size_t contended_leases; // leases that had to wait for an instance to be returned
+    uint64_t total_wait_ns;
+    uint64_t max_wait_ns;
+} MachDxcPoolStats;
+
+typedef struct MachDxcPoolInstanceStats {
+    size_t compiles;
+    uint64_t busy_ns; // time spent leased, excluding a lease in progress
+    uint64_t age_ns; // time since the instance was created; busy_ns / age_ns is its utilization
+} MachDxcPoolInstanceStats;
+
+/// Returns lease counts and lease wait times of the compiler's instance pool.
+MACH_EXPORT MachDxcPoolStats machDxcCompilerGetPoolStats(MachDxcCompiler compiler);
+
+/// Writes the stats of up to `capacity` pool instances, in creation order, to `out` and returns
+/// the number of instances.
+MACH_EXPORT size_t machDxcCompilerGetPoolInstanceStats(MachDxcCompiler compiler, MachDxcPoolInstanceStats* out, size_t capacity);
+
+typedef struct MachDxcCacheStats {
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    size_t entries;
+    size_t bytes;
+} MachDxcCacheStats;
+
+/// Enables an in-memory LRU cache of compile results holding at most max_bytes, or disables it
+/// if max_bytes is 0. Any previously cached results and stats are discarded.
+///
+/// A compile is served from the cache when its source, its arguments (with joined and separated
+/// option spellings treated alike) and the content of every header it resolved through
+/// MachDxcIncludeCallbacks all match an earlier compile. Checking headers means a cache hit still
+/// invokes the include callbacks (unless the include cache already vouches for them), but never
+/// the compiler. Failed compiles are cached as well.
+///
+/// The cache is shared by all threads of a batch compile.
+MACH_EXPORT void machDxcCompilerEnableCache(MachDxcCompiler compiler, size_t max_bytes);
+
+/// Returns hit, miss and eviction counts and the current size of the compile cache. All zero if
+/// the cache is not enabled.
+MACH_EXPORT MachDxcCacheStats machDxcCompilerGetCacheStats(MachDxcCompiler compiler);
+
+/// Enables a persistent compile cache stored in `directory` (created if missing), or disables it
+/// if directory is null. Returns 0 if the cache directory could not be opened.
+///
+/// Results are keyed and validated like the in-memory cache, which is consulted first when both
+/// are enabled. Any number of processes may share one directory concurrently. Cache hits are
+/// served straight from memory-mapped pack files without copying. Records left incomplete by a
+/// crash are detected by checksum and ignored. Once the pack files exceed max_bytes the oldest
+/// are deleted.
+MACH_EXPORT int machDxcCompilerEnableDiskCache(MachDxcCompiler compiler, char const* directory, size_t max_bytes);
+
+/// Returns this process's hit, miss and eviction counts for the disk cache, along with the
+/// number of entries and bytes currently on disk. All zero if the disk cache is not enabled.
+MACH_EXPORT MachDxcCacheStats machDxcCompilerGetDiskCacheStats(MachDxcCompiler compiler);
+
+/// How the include cache decides whether a header it holds is still current.
+typedef enum MachDxcIncludeValidation {
+    /// Headers are resolved once and never re-read, for sessions where they cannot change.
+    MachDxcIncludeValidateNever = 0,
+    /// A header is re-read only when MachDxcIncludeCallbacks::version_func returns a different
+    /// token than when it was cached. Behaves like MachDxcIncludeValidateContent for callbacks
+    /// without a version_func.
+    MachDxcIncludeValidateVersion = 1,
+    /// Every header is re-read through include_func and served from the cache if its content
+    /// hash is unchanged, which saves the copy into the compiler but not the read.
+    MachDxcIncludeValidateContent = 2,
+} MachDxcIncludeValidation;
+
+typedef struct MachDxcIncludeCacheStats {
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    size_t entries;
+    size_t bytes;
+    size_t bytes_saved; // header bytes served from the cache instead of copied from include_func
+} MachDxcIncludeCacheStats;
+
+/// Enables a cache of headers resolved through MachDxcIncludeCallbacks holding at most max_bytes,
+/// or disables it if max_bytes is 0. Any previously cached headers and stats are discarded.
+///
+/// Headers are cached by name and by the include_ctx and include_func that resolved them, and
+/// shared as immutable blobs by every compile on this compiler, including all threads of a batch
+/// compile. When pin_includes is set, free_func for a cached header is deferred until it leaves
+/// the cache and may run on any thread that compiles with this compiler.
+MACH_EXPORT void machDxcCompilerEnableIncludeCache(MachDxcCompiler compiler, MachDxcIncludeValidation validation, size_t max_bytes);
+
+/// Returns hit, miss and eviction counts, the current size and the bytes saved by the include
+/// cache. All zero if the cache is not enabled.
+MACH_EXPORT MachDxcIncludeCacheStats machDxcCompilerGetIncludeCacheStats(MachDxcCompiler compiler);
+
+//------------
+// MachDxcArgs
+//------------
+
+/// Converts a list of dxc.exe CLI arguments (UTF-8) into the form DXC consumes once, so that many
+/// compiles can share them through MachDxcCompileOptions::base_args, e.g. the entry point,
+/// profile and common flags of a set of permutations that differ only in their defines.
+///
+/// The args are copied and the result is immutable, so it may be shared across compilers and
+/// threads. Invoke machDxcArgsDeinit once no compile uses it anymore.
+MACH_EXPORT MachDxcArgs machDxcArgsInit(char const* const* args, size_t args_len);
+
+/// Deinitializes the arguments.
+MACH_EXPORT void machDxcArgsDeinit(MachDxcArgs args);
+
+//--------------------
+// MachDxcPrefixHeader
+//--------------------
+
+/// Snapshots a set of headers shared by many shaders, together with the defines they are
+/// compiled with, for use as MachDxcCompileOptions::prefix_header. headers and everything they
+/// include are resolved through callbacks once, as by machDxcScanDependencies, and kept in
+/// memory. Compiles using the prefix header get the defines ahead of their arguments and the
+/// headers included ahead of their source, with line numbers in diagnostics unchanged, and any
+/// header in the snapshot is served from it without calling back or copying. The cache key of a
+/// compile covers the snapshot, so changed headers need a new prefix header.
+///
+/// DXC has no precompiled header support, so the headers are still parsed by every compile; what
+/// is saved is resolving and copying them. Headers served from the snapshot are not listed by
+/// machDxcCompileResultGetInclude.
+///
+/// The prefix header is immutable and may be shared by any number of compiles, on any compiler,
+/// at once. Invoke machDxcPrefixHeaderDeinit once no compile using it is in progress.
+MACH_EXPORT MachDxcPrefixHeader machDxcPrefixHeaderInit(
+    MachDxcCompiler compiler,
+    MachDxcIncludeCallbacks* callbacks,
+    char const* const* headers,
+    size_t headers_len,
+    char const* const* defines,
+    size_t defines_len
+);
+
+/// Deinitializes the prefix header.
+MACH_EXPORT void machDxcPrefixHeaderDeinit(MachDxcPrefixHeader prefix_header);
+
+//--------------
+// MachDxcLinker
+//--------------
+
+/// Initializes a linker for DXIL libraries, i.e. objects compiled with a lib_6_x target profile.
+/// Libraries holding shared code, such as lighting or BRDF functions, can be compiled once,
+/// registered, and linked into any number of entry points, so that only linking and the
+/// optimization and validation of the linked shader run per entry point. Compiling with
+/// "-default-linkage external" exports functions that aren't marked with a shader attribute.
+/// Entry points themselves must be marked, e.g. with [shader("pixel")], to be linked.
+///
+/// Links may run on any number of threads at once; each concurrent link uses a DXC linker
+/// instance of its own, which allocates through the compiler's allocator.
+///
+/// Invoke machDxcLinkerDeinit when done with the linker, before deinitializing the compiler.
+MACH_EXPORT MachDxcLinker machDxcLinkerInit(MachDxcCompiler compiler);
+
+/// Deinitializes the linker. Results linked with it stay valid.
+MACH_EXPORT void machDxcLinkerDeinit(MachDxcLinker linker);
+
+/// Registers a library under name, holding a reference to it rather than copying it, so the object
+/// may be deinitialized right away. Returns 0 if a library is already registered under name.
+MACH_EXPORT int machDxcLinkerRegisterLibrary(MachDxcLinker linker, char const* name, MachDxcCompileObject library);
+
+typedef struct MachDxcLinkJob {
+    char const* entry_point;
+    char const* target_profile; // e.g. "ps_6_0"
+    char const* const* libraries; // names given to machDxcLinkerRegisterLibrary
+    size_t libraries_len;
+    char const* const* args; // dxc.exe CLI arguments, such as -O3 or -Qstrip_debug
+    size_t args_len;
+} MachDxcLinkJob;
+
+/// Keeps the libraries registered under names[i] up to date with the sources in libraries[i],
+/// compiling n libraries on num_threads threads (0 means one per CPU core). Call it again after
+/// sources or headers change, e.g. for hot reloading, and only libraries whose preprocessed source
+/// or code generation arguments changed are recompiled; an edit to one shared function then costs
+/// a compile of its library plus relinking, rather than a compile of every shader using it.
+///
+/// out[i] is null if library i was already up to date. Otherwise it is the result of compiling it,
+/// or of reusing the module of another library with the same content; if it has an object, that
+/// now replaces whatever was registered under names[i] for subsequent links. On errors, the
+/// previous version stays registered. The compiler's result caches are used as for any compile,
+/// so with machDxcCompilerEnableDiskCache unchanged libraries aren't recompiled across runs either.
+///
+/// Invoke machDxcCompileResultDeinit on each non-null result when done with it.
+MACH_EXPORT void machDxcLinkerUpdateLibraries(
+    MachDxcLinker linker,
+    char const* const* names,
+    MachDxcCompileOptions* libraries,
+    size_t n,
+    MachDxcCompileResult* out,
+    size_t num_threads
+);
+
+/// Links entry_point out of the given libraries. Failures, including libraries that were never
+/// registered, are reported through machDxcCompileResultGetError.
+///
+/// Invoke machDxcCompileResultDeinit when done with the result.
+MACH_EXPORT MachDxcCompileResult machDxcLinkerLink(MachDxcLinker linker, const MachDxcLinkJob* job);
+
+/// Links n jobs on num_threads threads (0 means one per CPU core), writing the result of jobs[i]
+/// to out[i].
+///
+/// Invoke machDxcCompileResultDeinit on each result when done with it.
+MACH_EXPORT void machDxcLinkerLinkBatch(
+    MachDxcLinker linker,
+    const MachDxcLinkJob* jobs,
+    size_t n,
+    MachDxcCompileResult* out,
+    size_t num_threads
+);
+
+//-----------------
+// MachDxcOptimizer
+//-----------------
+
+/// Initializes DXC's standalone optimizer, which runs LLVM passes over an already compiled module
+/// without running the front end again. For example, shaders can be compiled quickly with -Od
+/// while iterating, then optimized by a background job later on.
+///
+/// Optimizations may run on any number of threads at once; each concurrent run uses a DXC
+/// optimizer instance of its own, which allocates through the compiler's allocator. Returns null
+/// if DXC's optimizer couldn't be created.
+///
+/// Invoke machDxcOptimizerDeinit when done with the optimizer, before deinitializing the compiler.
+MACH_EXPORT MachDxcOptimizer machDxcOptimizerInit(MachDxcCompiler compiler);
+
+/// Deinitializes the optimizer. Results optimized with it stay valid.
+MACH_EXPORT void machDxcOptimizerDeinit(MachDxcOptimizer optimizer);
+
+/// A pass the optimizer can run. Strings are null-terminated and owned by the optimizer.
+typedef struct MachDxcOptimizerPass {
+    const char* name; // passed to machDxcOptimize as "-" followed by the name, e.g. "-mem2reg"
+    const char* description;
+    const char* const* arg_names;
+    const char* const* arg_descriptions;
+    size_t args_len;
+} MachDxcOptimizerPass;
+
+/// Returns how many passes the optimizer can run.
+MACH_EXPORT size_t machDxcOptimizerGetPassCount(MachDxcOptimizer optimizer);
+
+/// Returns the pass at index, which must be less than machDxcOptimizerGetPassCount.
+MACH_EXPORT MachDxcOptimizerPass machDxcOptimizerGetPass(MachDxcOptimizer optimizer, size_t index);
+
+typedef struct MachDxcOptimizeOptions {
+    // A DXIL container, such as the object of a compile, or a bare LLVM bitcode module. Only read
+    // during machDxcOptimize.
+    const void* module;
+    size_t module_len;
+
+    // The passes to run, in order, in the syntax of DXC's dxopt tool, e.g. "-mem2reg".
+    char const* const* passes;
+    size_t passes_len;
+
+    // Options applied ahead of the passes, such as "-hlsl-passes-resume" to continue the pass
+    // pipeline of a module compiled with -Od.
+    char const* const* args;
+    size_t args_len;
+
+    // When nonzero, each pass runs on its own so that machDxcCompileResultGetPassTimings can
+    // report its time. Every pass then also pays for reading and writing the module once.
+    int collect_timings;
+
+    // When nonzero, the optimized module is wrapped in a DXIL container, as objects of
+    // machDxcCompile are. Otherwise the result is a bare LLVM bitcode module.
+    int assemble;
+} MachDxcOptimizeOptions;
+
+/// Runs the passes over a module. The optimized module is the result's object, and anything the
+/// passes printed (e.g. with "-print-module") or why optimizing failed is reported through
+/// machDxcCompileResultGetError. total_ns and, with collect_timings, optimize_ns are the only
+/// phase timings set, plus container_ns with assemble.
+///
+/// Invoke machDxcCompileResultDeinit when done with the result.
+MACH_EXPORT MachDxcCompileResult machDxcOptimize(MachDxcOptimizer optimizer, const MachDxcOptimizeOptions* options);
+
 //---------------------
 // MachDxcCompileResult
 //---------------------
@@ -87,6 +488,158 @@ MACH_EXPORT MachDxcCompileResult machDxcCompile(
     MachDxcCompileOptions* options
 );
 
+/// Compiles n jobs in parallel, writing the result of jobs[i] to out[i].
+///
+/// Jobs are spread over num_threads worker threads (0 means one per CPU core, and never more than
+/// the compiler's max_instances), each leasing its own DXC compiler instance. A worker that runs
+/// out of jobs steals queued jobs from the busiest worker, so a few slow shaders don't leave the
+/// other threads idle. Include callbacks may be invoked concurrently from several worker threads.
+///
+/// Invoke machDxcCompileResultDeinit on each result when done with it.
+MACH_EXPORT void machDxcCompileBatch(
+    MachDxcCompiler compiler,
+    MachDxcCompileOptions* jobs,
+    size_t n,
+    MachDxcCompileResult* out,
+    size_t num_threads
+);
+
+/// The arguments that make one variant of a shader for machDxcCompilePermutations, such as its
+/// defines or optimization level.
+typedef struct MachDxcPermutation {
+    char const* const* args;
+    size_t args_len;
+} MachDxcPermutation;
+
+/// Compiles n variants of one shader in parallel, writing the result of permutations[i] to out[i].
+/// Each variant is compiled from options, with permutations[i].args following options->args.
+///
+/// Work that doesn't depend on the variant is done once: the shared arguments are converted once,
+/// and each header is read through the include callbacks once for all variants (or through the
+/// include cache, if it is enabled). Threads are used as by machDxcCompileBatch.
+///
+/// When dedupe is nonzero, every variant is first preprocessed, and variants that expand to the
+/// same source with the same arguments other than -D, -U and -I share the result of one compile,
+/// with only total_ns in their timings. This pays off when many defines don't affect a given shader
+/// and otherwise costs a preprocess per variant. DXC can't keep a parsed AST between compiles, so
+/// variants that differ in code generation options are still each parsed.
+///
+/// Invoke machDxcCompileResultDeinit on each result when done with it.
+MACH_EXPORT void machDxcCompilePermutations(
+    MachDxcCompiler compiler,
+    MachDxcCompileOptions* options,
+    const MachDxcPermutation* permutations,
+    size_t n,
+    int dedupe,
+    MachDxcCompileResult* out,
+    size_t num_threads
+);
+
+/// An entry point for machDxcCompileEntryPoints.
+typedef struct MachDxcEntryPoint {
+    char const* name;
+    char const* target_profile; // e.g. "vs_6_0"
+} MachDxcEntryPoint;
+
+/// Compiles several entry points of one source, such as the vertex and pixel shaders of a
+/// material, writing the result for entry_points[i] to out[i]. Any -E and -T in options are
+/// ignored.
+///
+/// Entry points that can be linked are compiled once as a library, with DXC's default linkage set
+/// to external, so that preprocessing, parsing and code generation run once for all of them. Each
+/// is then linked out of the library, on num_threads threads as by machDxcCompileBatch; only
+/// linking, its optimization and validation, and container writing run per entry point. Linked
+/// results carry the library's warnings ahead of their own.
+///
+/// DXC only links functions that a library marks as shader entry points, so an entry point needs
+/// a shader model 6 target and a [shader("vertex")], [shader("pixel")] etc. attribute matching it
+/// to be linked. The attributes are looked for in code before anything is compiled, and the
+/// library is only compiled if at least two entry points have one, so sources without them cost
+/// no more than separate compiles. Other entry points are compiled on their own, as are those that
+/// fail to link and all of them if the source doesn't compile as a library, so that each result
+/// carries the same diagnostics a separate compile would. Only attributes written out in code are
+/// found, not ones spelled by macros or in headers. machDxcCompileResultIsLinked tells which
+/// results were linked. The compile
+/// caches apply to the library and to those compiles, but not to linked results, whose timings
+/// only have total_ns.
+///
+/// Invoke machDxcCompileResultDeinit on each result when done with it.
+MACH_EXPORT void machDxcCompileEntryPoints(
+    MachDxcCompiler compiler,
+    MachDxcCompileOptions* options,
+    const MachDxcEntryPoint* entry_points,
+    size_t n,
+    MachDxcCompileResult* out,
+    size_t num_threads
+);
+
+/// Runs only the preprocessor over the given code with the given dxc.exe CLI arguments, which costs
+/// a fraction of a compile. Useful to hash the expanded source, e.g. to find permutations whose
+/// defines don't change the code, or to find what a shader depends on.
+///
+/// machDxcCompileResultGetObject returns the preprocessed source as UTF-8 text, and
+/// machDxcCompileResultGetInclude the headers resolved through the include callbacks. The compile
+/// caches are never used, but the include cache is.
+///
+/// Invoke machDxcCompileResultDeinit when done with the result.
+MACH_EXPORT MachDxcCompileResult machDxcPreprocess(
+    MachDxcCompiler compiler,
+    MachDxcCompileOptions* options
+);
+
+typedef enum MachDxcCompileStatus {
+    MachDxcCompilePending = 0,
+    MachDxcCompileComplete = 1,
+    MachDxcCompileCancelled = 2,
+} MachDxcCompileStatus;
+
+/// Invoked once an asynchronous compile completes or is cancelled. `request` stays valid for the
+/// duration of the call even if its handle has already been deinitialized, so the callback may
+/// take the result with machDxcCompileRequestGetResult.
+typedef void (*MachDxcCompileCallback)(void* user_data, MachDxcCompileRequest request);
+
+/// Starts compiling on the compiler's internal worker threads and returns immediately. The code
+/// and args are copied; include_callbacks and base_args must stay valid until the request is no
+/// longer pending.
+///
+/// callback (nullable) is invoked on a worker thread once the compile finishes, or on the thread
+/// that cancels a request before it started. Requests share the compiler's instance pool with
+/// blocking compiles, and caches must not be enabled or disabled while any is pending.
+/// machDxcDeinit cancels requests that have not started and waits for those that have.
+///
+/// Invoke machDxcCompileRequestDeinit when done with the request.
+MACH_EXPORT MachDxcCompileRequest machDxcCompileAsync(
+    MachDxcCompiler compiler,
+    MachDxcCompileOptions* options,
+    MachDxcCompileCallback callback,
+    void* user_data
+);
+
+//----------------------
+// MachDxcCompileRequest
+//----------------------
+
+/// Returns the status of the request without blocking.
+MACH_EXPORT MachDxcCompileStatus machDxcCompileRequestPoll(MachDxcCompileRequest request);
+
+/// Blocks until the request is no longer pending and returns its status.
+MACH_EXPORT MachDxcCompileStatus machDxcCompileRequestWait(MachDxcCompileRequest request);
+
+/// Cancels a pending request, returning 0 if it had already completed or been cancelled. A
+/// request whose compile has already started finishes compiling, but its result is discarded and
+/// it completes as cancelled.
+MACH_EXPORT int machDxcCompileRequestCancel(MachDxcCompileRequest request);
+
+/// Takes ownership of the result of a completed request. Returns null if the request is pending,
+/// was cancelled, or its result was already taken.
+///
+/// Invoke machDxcCompileResultDeinit when done with the result.
+MACH_EXPORT MachDxcCompileResult machDxcCompileRequestGetResult(MachDxcCompileRequest request);
+
+/// Releases the request handle. A pending request keeps running and still invokes its callback;
+/// a result that was never taken is freed.
+MACH_EXPORT void machDxcCompileRequestDeinit(MachDxcCompileRequest request);
+
 /// Returns an error object, or null in the case of success.
 ///
 /// Invoke machDxcCompileErrorDeinit when done with the error, iff it was non-null.
@@ -98,6 +651,99 @@ MACH_EXPORT MachDxcCompileObject machDxcCompileResultGetObject(MachDxcCompileRes
 /// Deinitializes the DXC compiler.
 MACH_EXPORT void machDxcCompileResultDeinit(MachDxcCompileResult err);
 
+/// Where the time of a compile went, in nanoseconds of a monotonic clock.
+///
+/// total_ns, argument_conversion_ns and include_callbacks_ns are measured for every compile at the
+/// cost of a few clock reads. The remaining phases are only filled in for compiles with
+/// collect_timings set, which run DXC with -ftime-trace and split the spans it records into
+/// phases; see MachDxcTimingDetail for what each level costs. Results served from a cache only
+/// have total_ns.
+///
+/// Clang preprocesses on demand while it parses, so preprocessing has no span of its own and is
+/// counted in parse_ns. machDxcPreprocess times it on its own.
+typedef struct MachDxcCompileTimings {
+    uint64_t total_ns; // the whole compile, including cache lookups
+    uint64_t argument_conversion_ns; // converting the arguments to the wide strings DXC takes
+    uint64_t include_callbacks_ns; // resolving headers, through the include cache or MachDxcIncludeCallbacks
+    uint64_t parse_ns; // preprocessing, parsing and semantic analysis, including include_callbacks_ns
+    uint64_t codegen_ns; // generating the high-level module
+    uint64_t optimize_ns; // the HL to DXIL pass pipeline
+    uint64_t validation_ns;
+    uint64_t container_ns; // assembling the DXIL container
+} MachDxcCompileTimings;
+
+MACH_EXPORT MachDxcCompileTimings machDxcCompileResultGetTimings(MachDxcCompileResult result);
+
+/// Returns nonzero if the result's object was linked out of DXIL libraries, by a MachDxcLinker or
+/// by machDxcCompileEntryPoints, rather than compiled.
+MACH_EXPORT int machDxcCompileResultIsLinked(MachDxcCompileResult result);
+
+/// Time spent in one LLVM pass during a compile, summed over every time it ran.
+typedef struct MachDxcPassTiming {
+    const char* name; // null-terminated, owned by the result
+    uint64_t runs; // e.g. once per function for function passes
+    uint64_t total_ns; // including passes run from within this one, such as by a pass manager
+    uint64_t self_ns; // excluding them
+} MachDxcPassTiming;
+
+/// Writes the timings of up to capacity passes to out, ordered by self_ns from most to least
+/// expensive, and returns how many passes ran. This is the per-pass part of -time-passes, taken
+/// from the spans DXC's profiler records around each pass, so it is only available for compiles
+/// with collect_timings set to MachDxcTimingsPasses and isn't mixed up with other compiles running
+/// at the same time.
+///
+/// LLVM statistics (-stats) are compiled out of release builds of DXC, so there are no
+/// counters to report alongside the timings.
+MACH_EXPORT size_t machDxcCompileResultGetPassTimings(MachDxcCompileResult result, MachDxcPassTiming* out, size_t capacity);
+
+/// Heap use of a compile, as seen by the IMalloc each DXC instance in a compiler's pool is
+/// created with. DXC routes its operator new and delete through it (unless built with
+/// DXC_DISABLE_ALLOCATOR_OVERRIDES), so this covers nearly all memory DXC allocates, in bytes as
+/// rounded up by the C heap, or as requested from a MachDxcAllocator. Counting costs a few atomic
+/// operations per allocation.
+///
+/// Frees of blocks from earlier compiles, such as outputs released while the compile runs, are
+/// counted too, so peak_bytes can be slightly low when results are released concurrently.
+/// Results served from a cache report zeros.
+typedef struct MachDxcMemoryStats {
+    uint64_t peak_bytes; // most bytes allocated at once, beyond what was allocated at the start
+    uint64_t retained_bytes; // still allocated when the compile returned, such as its outputs
+    uint64_t allocated_bytes; // the sum of all allocations, plus what reallocations grew blocks by
+    uint64_t allocations;
+    uint64_t frees;
+    // size_histogram[i] counts allocations of up to 16 << i bytes that don't fit the previous
+    // entry. The last entry counts everything larger.
+    uint64_t size_histogram[16];
+    // Bytes of input copied before DXC could read them: headers that weren't pinned (see
+    // pin_includes), the source when a prefix header is prepended to it, and DXC's own copy of a
+    // source whose last byte within code_len isn't a null terminator.
+    uint64_t copied_bytes;
+    uint64_t reallocations; // blocks resized, which count as neither allocations nor frees
+    // The part of allocated_bytes, allocations and frees served by the arena (see use_arena). All
+    // zero if the compile didn't use it; equal to the totals if it allocated nothing on the heap.
+    uint64_t arena_bytes;
+    uint64_t arena_allocations;
+    uint64_t arena_frees;
+} MachDxcMemoryStats;
+
+MACH_EXPORT MachDxcMemoryStats machDxcCompileResultGetMemoryStats(MachDxcCompileResult result);
+
+/// Returns how many distinct headers machDxcPreprocess resolved through the include callbacks, or
+/// 0 for results of other functions.
+MACH_EXPORT size_t machDxcCompileResultGetIncludeCount(MachDxcCompileResult result);
+
+/// Returns the name of the index-th header, in the order they were first included, as a
+/// null-terminated UTF-8 string owned by the result.
+MACH_EXPORT const char* machDxcCompileResultGetInclude(MachDxcCompileResult result, size_t index);
+
+/// Returns the Chrome trace-event JSON of a compile with collect_trace set as a null-terminated
+/// UTF-8 string owned by the result, or null if it wasn't traced. Results served from a cache
+/// only have the outer "Compile" span. See machDxcTraceBegin for the format.
+MACH_EXPORT const char* machDxcCompileResultGetTrace(MachDxcCompileResult result);
+
+/// Returns the length of machDxcCompileResultGetTrace in bytes.
+MACH_EXPORT size_t machDxcCompileResultGetTraceLength(MachDxcCompileResult result);
+
 //---------------------
 // MachDxcCompileObject
 //---------------------
@@ -125,6 +771,188 @@ MACH_EXPORT size_t machDxcCompileErrorGetStringLength(MachDxcCompileError err);
 /// Deinitializes the error, calling Get methods after this is illegal.
 MACH_EXPORT void machDxcCompileErrorDeinit(MachDxcCompileError err);
 
+//--------------------
+// Dependency scanning
+//--------------------
+
+/// A file in a MachDxcDependencyGraph. The pointers are owned by the graph.
+typedef struct MachDxcDependencyNode {
+    char const* name; // null-terminated UTF-8, as passed to include_func
+    uint8_t hash[16]; // MD5 of the file's content
+    size_t const* includes; // indices of the nodes this file includes, in include order
+    size_t includes_len;
+} MachDxcDependencyNode;
+
+/// Returns the transitive include graph of entry files resolved through callbacks, without
+/// compiling them, for build systems deciding what a changed header invalidates. The first
+/// entries_len nodes are the entries, in order; entries must be distinct.
+///
+/// Files are only lexed for #include directives. Conditional blocks are not evaluated, so the
+/// graph is a superset of what a compile with any defines would include, and includes spelled
+/// through a macro are not followed. Quoted includes resolve relative to the including file and
+/// angled includes are resolved as spelled; a file include_func can't resolve is a node with the
+/// hash of empty content and no includes. Names are normalized to '/' separators with "." and
+/// ".." segments resolved, so each file appears once.
+///
+/// Entries are scanned on num_threads threads (0 means one per CPU core), so the callbacks may be
+/// invoked concurrently. Files are resolved through the include cache if it is enabled, and the
+/// directives found in a file are remembered by content hash, so rescanning after an edit only
+/// lexes the files that changed.
+///
+/// Invoke machDxcDependencyGraphDeinit when done with the graph.
+MACH_EXPORT MachDxcDependencyGraph machDxcScanDependencies(
+    MachDxcCompiler compiler,
+    MachDxcIncludeCallbacks* callbacks,
+    char const* const* entries,
+    size_t entries_len,
+    size_t num_threads
+);
+
+/// Returns the number of files in the graph.
+MACH_EXPORT size_t machDxcDependencyGraphGetNodeCount(MachDxcDependencyGraph graph);
+
+/// Returns the file at index, which must be less than machDxcDependencyGraphGetNodeCount.
+MACH_EXPORT MachDxcDependencyNode machDxcDependencyGraphGetNode(MachDxcDependencyGraph graph, size_t index);
+
+/// Deinitializes the graph, invalidating the nodes returned for it.
+MACH_EXPORT void machDxcDependencyGraphDeinit(MachDxcDependencyGraph graph);
+
+//------------------
+// MachDxcReflection
+//------------------
+
+/// Reflects a compiled shader by reading the parts of its DXIL container directly: the pipeline
+/// state validation part for the shader stage, thread group size and resource bindings, and the
+/// signature parts for inputs and outputs. None of these load the LLVM module, unlike
+/// IDxcContainerReflection, so reflecting is cheap enough to do for every shader at load time.
+/// Constant buffer layouts are only recorded in the module, so it is loaded the first time one
+/// of them is asked for.
+///
+/// bytes is read in place and must stay valid, unchanged, until the reflection is deinitialized;
+/// strings returned by the reflection may point into it. Returns null if bytes isn't a valid
+/// DXIL container.
+///
+/// Invoke machDxcReflectionDeinit when done with the reflection, before deinitializing the
+/// compiler.
+MACH_EXPORT MachDxcReflection machDxcReflect(MachDxcCompiler compiler, const void* bytes, size_t len);
+
+/// Deinitializes the reflection, invalidating the strings returned for it.
+MACH_EXPORT void machDxcReflectionDeinit(MachDxcReflection reflection);
+
+/// Values match DXC's PSVShaderKind.
+typedef enum MachDxcShaderStage {
+    MachDxcShaderStagePixel = 0,
+    MachDxcShaderStageVertex = 1,
+    MachDxcShaderStageGeometry = 2,
+    MachDxcShaderStageHull = 3,
+    MachDxcShaderStageDomain = 4,
+    MachDxcShaderStageCompute = 5,
+    MachDxcShaderStageLibrary = 6,
+    MachDxcShaderStageRayGeneration = 7,
+    MachDxcShaderStageIntersection = 8,
+    MachDxcShaderStageAnyHit = 9,
+    MachDxcShaderStageClosestHit = 10,
+    MachDxcShaderStageMiss = 11,
+    MachDxcShaderStageCallable = 12,
+    MachDxcShaderStageMesh = 13,
+    MachDxcShaderStageAmplification = 14,
+    MachDxcShaderStageUnknown = 255,
+} MachDxcShaderStage;
+
+MACH_EXPORT MachDxcShaderStage machDxcReflectionGetShaderStage(MachDxcReflection reflection);
+
+/// Writes the [numthreads] of a compute, mesh or amplification shader to out and returns 1, or
+/// returns 0 for other stages and for containers written by validators too old to record it.
+MACH_EXPORT int machDxcReflectionGetThreadGroupSize(MachDxcReflection reflection, uint32_t out[3]);
+
+/// Values match DXC's PSVResourceType.
+typedef enum MachDxcResourceType {
+    MachDxcResourceTypeInvalid = 0,
+    MachDxcResourceTypeSampler = 1,
+    MachDxcResourceTypeCBV = 2,
+    MachDxcResourceTypeSRVTyped = 3,
+    MachDxcResourceTypeSRVRaw = 4,
+    MachDxcResourceTypeSRVStructured = 5,
+    MachDxcResourceTypeUAVTyped = 6,
+    MachDxcResourceTypeUAVRaw = 7,
+    MachDxcResourceTypeUAVStructured = 8,
+    MachDxcResourceTypeUAVStructuredWithCounter = 9,
+} MachDxcResourceType;
+
+typedef struct MachDxcResourceBinding {
+    MachDxcResourceType type;
+    uint32_t space;
+    uint32_t lower_bound;
+    uint32_t upper_bound; // inclusive; UINT32_MAX for unbounded arrays
+    uint32_t kind; // DXC's PSVResourceKind, e.g. the texture dimension; 0 if not recorded
+    uint32_t flags; // DXC's PSVResourceFlag bits; 0 if not recorded
+} MachDxcResourceBinding;
+
+MACH_EXPORT size_t machDxcReflectionGetResourceBindingCount(MachDxcReflection reflection);
+
+/// Returns the binding at index, which must be less than machDxcReflectionGetResourceBindingCount.
+MACH_EXPORT MachDxcResourceBinding machDxcReflectionGetResourceBinding(MachDxcReflection reflection, size_t index);
+
+typedef enum MachDxcSignatureKind {
+    MachDxcSignatureKindInput = 0,
+    MachDxcSignatureKindOutput = 1,
+    MachDxcSignatureKindPatchConstant = 2, // or per-primitive outputs of mesh shaders
+} MachDxcSignatureKind;
+
+typedef struct MachDxcSignatureElement {
+    const char* semantic_name; // null-terminated, points into the container
+    uint32_t semantic_index;
+    uint32_t system_value; // D3D_NAME, e.g. 1 for SV_Position
+    uint32_t component_type; // D3D_REGISTER_COMPONENT_TYPE
+    uint32_t register_index;
+    uint8_t mask; // components used
+    uint8_t rw_mask; // never-written components of outputs, always-read components of inputs
+    uint32_t stream;
+    uint32_t min_precision; // D3D_MIN_PRECISION
+} MachDxcSignatureElement;
+
+MACH_EXPORT size_t machDxcReflectionGetSignatureElementCount(MachDxcReflection reflection, MachDxcSignatureKind kind);
+
+/// Returns the element at index, which must be less than
+/// machDxcReflectionGetSignatureElementCount for kind.
+MACH_EXPORT MachDxcSignatureElement machDxcReflectionGetSignatureElement(
+    MachDxcReflection reflection,
+    MachDxcSignatureKind kind,
+    size_t index
+);
+
+typedef struct MachDxcConstantBuffer {
+    const char* name; // null-terminated, owned by the reflection
+    uint32_t size; // in bytes
+    size_t variables_len;
+} MachDxcConstantBuffer;
+
+typedef struct MachDxcConstantBufferVariable {
+    const char* name; // null-terminated, owned by the reflection
+    uint32_t offset; // in bytes, from the start of the buffer
+    uint32_t size; // in bytes
+    uint32_t type_class; // D3D_SHADER_VARIABLE_CLASS, e.g. vector or matrix
+    uint32_t type; // D3D_SHADER_VARIABLE_TYPE, e.g. float
+    uint32_t rows;
+    uint32_t columns;
+    uint32_t elements; // array length, 0 if not an array
+} MachDxcConstantBufferVariable;
+
+/// Returns the number of constant buffers, loading the module on the first call. Safe to call
+/// from several threads at once.
+MACH_EXPORT size_t machDxcReflectionGetConstantBufferCount(MachDxcReflection reflection);
+
+/// Returns the buffer at index, which must be less than machDxcReflectionGetConstantBufferCount.
+MACH_EXPORT MachDxcConstantBuffer machDxcReflectionGetConstantBuffer(MachDxcReflection reflection, size_t index);
+
+/// Returns a top-level variable of a buffer; variable_index must be less than the buffer's
+/// variables_len.
+MACH_EXPORT MachDxcConstantBufferVariable machDxcReflectionGetConstantBufferVariable(
+    MachDxcReflection reflection,
+    size_t buffer_index,
+    size_t variable_index
+);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
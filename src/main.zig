@@ -1,3 +1,5 @@
+const std = @import("std");
+
 const c = @cImport(
     @cInclude("mach_dxc.h"),
 );
@@ -6,27 +8,609 @@ pub const Compiler = struct {
     handle: c.MachDxcCompiler,
 
     pub fn init() Compiler {
-        const handle = c.machDxcInit();
-        return .{ .handle = handle };
+        return initPool(0);
+    }
+
+    /// Keeps process-wide DXC state alive until a matching `globalDeinit`, so that compilers can
+    /// be created and destroyed without re-running global setup and teardown.
+    pub fn globalInit() void {
+        c.machDxcGlobalInit();
+    }
+
+    pub fn globalDeinit() void {
+        c.machDxcGlobalDeinit();
+    }
+
+    /// Starts recording a Chrome trace of every compile in the process, see `traceEnd`.
+    pub fn traceBegin() void {
+        c.machDxcTraceBegin();
+    }
+
+    /// Stops recording and writes the trace to `path`.
+    pub fn traceEnd(path: [*:0]const u8) error{TraceWriteFailed}!void {
+        if (c.machDxcTraceEnd(path) == 0) return error.TraceWriteFailed;
+    }
+
+    /// Initializes a compiler that may be used from any number of threads at once, backed by up
+    /// to `max_instances` DXC instances (0 means one per CPU core).
+    pub fn initPool(max_instances: usize) Compiler {
+        return .{ .handle = c.machDxcInitPool(max_instances) orelse @panic("DXC couldn't be initialized") };
+    }
+
+    /// Initializes a compiler whose DXC instances allocate through `allocator`, which must stay
+    /// valid and thread-safe until the compiler and every result from it have been deinitialized.
+    pub fn initWithAllocator(allocator: *const std.mem.Allocator) Compiler {
+        const callbacks = c.MachDxcAllocator{
+            .ctx = @constCast(allocator),
+            .alloc_func = AllocatorCallbacks.alloc,
+            .realloc_func = AllocatorCallbacks.realloc,
+            .free_func = AllocatorCallbacks.free,
+        };
+        return .{ .handle = c.machDxcInitWithAllocator(&callbacks) orelse @panic("DXC couldn't be initialized") };
     }
 
+    /// Adapts a `std.mem.Allocator` to `MachDxcAllocator`, which doesn't pass block sizes to
+    /// realloc and free, by keeping each block's size in a header in front of it.
+    const AllocatorCallbacks = struct {
+        const alignment = 16;
+        const header_size = alignment;
+
+        fn alloc(ctx: ?*anyopaque, size: usize) callconv(.C) ?*anyopaque {
+            const allocator: *const std.mem.Allocator = @ptrCast(@alignCast(ctx));
+            const block = allocator.alignedAlloc(u8, alignment, header_size + size) catch return null;
+            return withHeader(block, size);
+        }
+
+        fn realloc(ctx: ?*anyopaque, ptr: ?*anyopaque, size: usize) callconv(.C) ?*anyopaque {
+            const allocator: *const std.mem.Allocator = @ptrCast(@alignCast(ctx));
+            const block = allocator.realloc(blockOf(ptr orelse return alloc(ctx, size)), header_size + size) catch return null;
+            return withHeader(block, size);
+        }
+
+        fn free(ctx: ?*anyopaque, ptr: ?*anyopaque) callconv(.C) void {
+            const allocator: *const std.mem.Allocator = @ptrCast(@alignCast(ctx));
+            allocator.free(blockOf(ptr orelse return));
+        }
+
+        fn withHeader(block: []align(alignment) u8, size: usize) *anyopaque {
+            @as(*usize, @ptrCast(block.ptr)).* = size;
+            return block.ptr + header_size;
+        }
+
+        fn blockOf(ptr: *anyopaque) []align(alignment) u8 {
+            const base: [*]align(alignment) u8 = @ptrFromInt(@intFromPtr(ptr) - header_size);
+            return base[0 .. header_size + @as(*usize, @ptrCast(base)).*];
+        }
+    };
+
     pub fn deinit(compiler: Compiler) void {
         c.machDxcDeinit(compiler.handle);
     }
 
+    pub const PoolStats = c.MachDxcPoolStats;
+    pub const PoolInstanceStats = c.MachDxcPoolInstanceStats;
+
+    pub fn getPoolStats(compiler: Compiler) PoolStats {
+        return c.machDxcCompilerGetPoolStats(compiler.handle);
+    }
+
+    /// Fills `out` with the stats of up to `out.len` pool instances and returns how many
+    /// instances the pool has.
+    pub fn getPoolInstanceStats(compiler: Compiler, out: []PoolInstanceStats) usize {
+        return c.machDxcCompilerGetPoolInstanceStats(compiler.handle, out.ptr, out.len);
+    }
+
+    pub const CacheStats = c.MachDxcCacheStats;
+
+    /// Enables an in-memory cache of compile results holding at most `max_bytes`, or disables it
+    /// if `max_bytes` is 0.
+    pub fn enableCache(compiler: Compiler, max_bytes: usize) void {
+        c.machDxcCompilerEnableCache(compiler.handle, max_bytes);
+    }
+
+    pub fn getCacheStats(compiler: Compiler) CacheStats {
+        return c.machDxcCompilerGetCacheStats(compiler.handle);
+    }
+
+    /// Enables a persistent compile cache in `directory` shared with other processes, or disables
+    /// it if `directory` is null.
+    pub fn enableDiskCache(compiler: Compiler, directory: ?[*:0]const u8, max_bytes: usize) error{DiskCacheUnavailable}!void {
+        if (c.machDxcCompilerEnableDiskCache(compiler.handle, directory, max_bytes) == 0) return error.DiskCacheUnavailable;
+    }
+
+    pub fn getDiskCacheStats(compiler: Compiler) CacheStats {
+        return c.machDxcCompilerGetDiskCacheStats(compiler.handle);
+    }
+
+    pub const IncludeCallbacks = c.MachDxcIncludeCallbacks;
+    pub const IncludeResult = c.MachDxcIncludeResult;
+    pub const IncludeCacheStats = c.MachDxcIncludeCacheStats;
+
+    pub const IncludeValidation = enum(c.MachDxcIncludeValidation) {
+        never = c.MachDxcIncludeValidateNever,
+        version = c.MachDxcIncludeValidateVersion,
+        content = c.MachDxcIncludeValidateContent,
+    };
+
+    /// Enables a cache of headers shared by every compile on this compiler holding at most
+    /// `max_bytes`, or disables it if `max_bytes` is 0.
+    pub fn enableIncludeCache(compiler: Compiler, validation: IncludeValidation, max_bytes: usize) void {
+        c.machDxcCompilerEnableIncludeCache(compiler.handle, @intFromEnum(validation), max_bytes);
+    }
+
+    pub fn getIncludeCacheStats(compiler: Compiler) IncludeCacheStats {
+        return c.machDxcCompilerGetIncludeCacheStats(compiler.handle);
+    }
+
     pub fn compile(compiler: Compiler, code: []const u8, args: []const [*:0]const u8) Result {
-        var options: c.MachDxcCompileOptions = .{
-            .code = code.ptr,
-            .code_len = code.len,
-            .args = args.ptr,
-            .args_len = args.len,
-            .include_callbacks = null,
-        };
+        return compiler.compileJob(.{ .code = code, .args = args });
+    }
 
+    pub fn compileJob(compiler: Compiler, job: Job) Result {
+        var options = job.options();
         const result = c.machDxcCompile(compiler.handle, @ptrCast(&options));
         return .{ .handle = result };
     }
 
+    /// Runs only the preprocessor. The result's object holds the preprocessed source, and
+    /// `Result.getInclude` lists the headers it resolved through the include callbacks.
+    pub fn preprocess(compiler: Compiler, job: Job) Result {
+        var options = job.options();
+        const result = c.machDxcPreprocess(compiler.handle, @ptrCast(&options));
+        return .{ .handle = result };
+    }
+
+    /// Returns the transitive include graph of `entries` by lexing them for `#include`
+    /// directives on `num_threads` threads (0 means one per CPU core), without compiling them.
+    /// The first `entries.len` nodes are the entries. See `machDxcScanDependencies`.
+    pub fn scanDependencies(
+        compiler: Compiler,
+        callbacks: *IncludeCallbacks,
+        entries: []const [*:0]const u8,
+        num_threads: usize,
+    ) DependencyGraph {
+        return .{ .handle = c.machDxcScanDependencies(compiler.handle, callbacks, entries.ptr, entries.len, num_threads) };
+    }
+
+    pub const DependencyGraph = struct {
+        handle: c.MachDxcDependencyGraph,
+
+        pub const Node = struct {
+            name: [:0]const u8,
+            hash: [16]u8,
+            includes: []const usize, // node indices
+        };
+
+        pub fn deinit(graph: DependencyGraph) void {
+            c.machDxcDependencyGraphDeinit(graph.handle);
+        }
+
+        pub fn getNodeCount(graph: DependencyGraph) usize {
+            return c.machDxcDependencyGraphGetNodeCount(graph.handle);
+        }
+
+        pub fn getNode(graph: DependencyGraph, index: usize) Node {
+            const node = c.machDxcDependencyGraphGetNode(graph.handle, index);
+            return .{
+                .name = std.mem.span(node.name),
+                .hash = node.hash,
+                .includes = if (node.includes_len == 0) &.{} else node.includes[0..node.includes_len],
+            };
+        }
+    };
+
+    /// Reflects a compiled shader from its container parts without loading its module, see
+    /// `machDxcReflect`. `bytes` must outlive the reflection. Returns null if `bytes` isn't a
+    /// valid DXIL container.
+    pub fn reflect(compiler: Compiler, bytes: []const u8) ?Reflection {
+        const handle = c.machDxcReflect(compiler.handle, bytes.ptr, bytes.len) orelse return null;
+        return .{ .handle = handle };
+    }
+
+    pub const Reflection = struct {
+        handle: c.MachDxcReflection,
+
+        pub const ShaderStage = c.MachDxcShaderStage;
+        pub const ResourceBinding = c.MachDxcResourceBinding;
+        pub const SignatureKind = c.MachDxcSignatureKind;
+        pub const SignatureElement = c.MachDxcSignatureElement;
+        pub const ConstantBuffer = c.MachDxcConstantBuffer;
+        pub const ConstantBufferVariable = c.MachDxcConstantBufferVariable;
+
+        pub fn deinit(reflection: Reflection) void {
+            c.machDxcReflectionDeinit(reflection.handle);
+        }
+
+        pub fn getShaderStage(reflection: Reflection) ShaderStage {
+            return c.machDxcReflectionGetShaderStage(reflection.handle);
+        }
+
+        /// The [numthreads] of compute, mesh and amplification shaders.
+        pub fn getThreadGroupSize(reflection: Reflection) ?[3]u32 {
+            var size: [3]u32 = undefined;
+            if (c.machDxcReflectionGetThreadGroupSize(reflection.handle, &size) == 0) return null;
+            return size;
+        }
+
+        pub fn getResourceBindingCount(reflection: Reflection) usize {
+            return c.machDxcReflectionGetResourceBindingCount(reflection.handle);
+        }
+
+        pub fn getResourceBinding(reflection: Reflection, index: usize) ResourceBinding {
+            return c.machDxcReflectionGetResourceBinding(reflection.handle, index);
+        }
+
+        pub fn getSignatureElementCount(reflection: Reflection, kind: SignatureKind) usize {
+            return c.machDxcReflectionGetSignatureElementCount(reflection.handle, kind);
+        }
+
+        pub fn getSignatureElement(reflection: Reflection, kind: SignatureKind, index: usize) SignatureElement {
+            return c.machDxcReflectionGetSignatureElement(reflection.handle, kind, index);
+        }
+
+        /// Loads the shader's module on the first call.
+        pub fn getConstantBufferCount(reflection: Reflection) usize {
+            return c.machDxcReflectionGetConstantBufferCount(reflection.handle);
+        }
+
+        pub fn getConstantBuffer(reflection: Reflection, index: usize) ConstantBuffer {
+            return c.machDxcReflectionGetConstantBuffer(reflection.handle, index);
+        }
+
+        pub fn getConstantBufferVariable(reflection: Reflection, buffer_index: usize, variable_index: usize) ConstantBufferVariable {
+            return c.machDxcReflectionGetConstantBufferVariable(reflection.handle, buffer_index, variable_index);
+        }
+    };
+
+    /// Arguments converted once and shared by many compiles, see `Job.base_args`.
+    pub const Args = struct {
+        handle: c.MachDxcArgs,
+
+        pub fn init(args: []const [*:0]const u8) Args {
+            return .{ .handle = c.machDxcArgsInit(args.ptr, args.len) };
+        }
+
+        pub fn deinit(args: Args) void {
+            c.machDxcArgsDeinit(args.handle);
+        }
+    };
+
+    /// A snapshot of headers shared by many shaders and the defines they are compiled with, see
+    /// `Job.prefix_header`.
+    pub const PrefixHeader = struct {
+        handle: c.MachDxcPrefixHeader,
+
+        /// Resolves `headers` and everything they include through `callbacks` once. See
+        /// `machDxcPrefixHeaderInit`.
+        pub fn init(
+            compiler: Compiler,
+            callbacks: *IncludeCallbacks,
+            headers: []const [*:0]const u8,
+            defines: []const [*:0]const u8,
+        ) PrefixHeader {
+            return .{ .handle = c.machDxcPrefixHeaderInit(compiler.handle, callbacks, headers.ptr, headers.len, defines.ptr, defines.len) };
+        }
+
+        pub fn deinit(prefix_header: PrefixHeader) void {
+            c.machDxcPrefixHeaderDeinit(prefix_header.handle);
+        }
+    };
+
+    /// How finely `Job.collect_timings` breaks a compile's time down, see `MachDxcTimingDetail` in
+    /// mach_dxc.h for what each costs.
+    pub const TimingDetail = enum(c.MachDxcTimingDetail) {
+        none = c.MachDxcTimingsNone,
+        passes = c.MachDxcTimingsPasses,
+        phases = c.MachDxcTimingsPhases,
+    };
+
+    pub const Job = struct {
+        code: []const u8,
+        args: []const [*:0]const u8,
+        /// Passed to the compiler ahead of `args`.
+        base_args: ?Args = null,
+        /// Headers included ahead of `code`, served from the snapshot.
+        prefix_header: ?PrefixHeader = null,
+        include_callbacks: ?*IncludeCallbacks = null,
+        /// Break the compile time down by phase, and with `.passes` by LLVM pass, see
+        /// `Result.getTimings`.
+        collect_timings: TimingDetail = .none,
+        /// Keep a Chrome trace of the compile, see `Result.getTrace`.
+        collect_trace: bool = false,
+        /// Allocate from a per-instance arena recycled after the compile, see `use_arena` in
+        /// mach_dxc.h.
+        use_arena: bool = false,
+
+        fn options(job: Job) c.MachDxcCompileOptions {
+            return .{
+                .code = job.code.ptr,
+                .code_len = job.code.len,
+                .args = job.args.ptr,
+                .args_len = job.args.len,
+                .include_callbacks = job.include_callbacks,
+                .base_args = if (job.base_args) |base| base.handle else null,
+                .prefix_header = if (job.prefix_header) |prefix| prefix.handle else null,
+                .pin_includes = 0,
+                .collect_timings = @intCast(@intFromEnum(job.collect_timings)),
+                .collect_trace = @intFromBool(job.collect_trace),
+                .use_arena = @intFromBool(job.use_arena),
+            };
+        }
+    };
+
+    /// Compiles all jobs in parallel on `num_threads` worker threads (0 means one per CPU core),
+    /// writing the result of `jobs[i]` to `results[i]`.
+    pub fn compileBatch(
+        compiler: Compiler,
+        allocator: std.mem.Allocator,
+        jobs: []const Job,
+        results: []Result,
+        num_threads: usize,
+    ) !void {
+        std.debug.assert(results.len == jobs.len);
+
+        const options = try allocator.alloc(c.MachDxcCompileOptions, jobs.len);
+        defer allocator.free(options);
+        const handles = try allocator.alloc(c.MachDxcCompileResult, jobs.len);
+        defer allocator.free(handles);
+
+        for (jobs, options) |job, *opt| opt.* = job.options();
+
+        c.machDxcCompileBatch(compiler.handle, options.ptr, jobs.len, handles.ptr, num_threads);
+        for (handles, results) |handle, *result| result.* = .{ .handle = handle };
+    }
+
+    /// Compiles one variant of `job` per entry of `permutations`, each entry holding the arguments
+    /// that follow `job.args` for that variant, writing the result of `permutations[i]` to
+    /// `results[i]`. Headers are read once for all variants. With `dedupe`, variants that
+    /// preprocess to the same source share one compile. See `machDxcCompilePermutations`.
+    pub fn compilePermutations(
+        compiler: Compiler,
+        allocator: std.mem.Allocator,
+        job: Job,
+        permutations: []const []const [*:0]const u8,
+        dedupe: bool,
+        results: []Result,
+        num_threads: usize,
+    ) !void {
+        std.debug.assert(results.len == permutations.len);
+
+        const c_permutations = try allocator.alloc(c.MachDxcPermutation, permutations.len);
+        defer allocator.free(c_permutations);
+        const handles = try allocator.alloc(c.MachDxcCompileResult, permutations.len);
+        defer allocator.free(handles);
+
+        for (permutations, c_permutations) |args, *permutation| permutation.* = .{ .args = args.ptr, .args_len = args.len };
+
+        var options = job.options();
+        c.machDxcCompilePermutations(compiler.handle, &options, c_permutations.ptr, permutations.len, @intFromBool(dedupe), handles.ptr, num_threads);
+        for (handles, results) |handle, *result| result.* = .{ .handle = handle };
+    }
+
+    pub const EntryPoint = c.MachDxcEntryPoint;
+
+    /// Compiles each of `entry_points` out of `job.code`, writing the result of `entry_points[i]`
+    /// to `results[i]`. The source is parsed once and the entry points are linked out of it where
+    /// possible, which requires a `[shader("...")]` attribute on each entry point, see
+    /// `machDxcCompileEntryPoints`. Any `-E` and `-T` in `job.args` are ignored.
+    pub fn compileEntryPoints(
+        compiler: Compiler,
+        allocator: std.mem.Allocator,
+        job: Job,
+        entry_points: []const EntryPoint,
+        results: []Result,
+        num_threads: usize,
+    ) !void {
+        std.debug.assert(results.len == entry_points.len);
+
+        const handles = try allocator.alloc(c.MachDxcCompileResult, entry_points.len);
+        defer allocator.free(handles);
+
+        var options = job.options();
+        c.machDxcCompileEntryPoints(compiler.handle, &options, entry_points.ptr, entry_points.len, handles.ptr, num_threads);
+        for (handles, results) |handle, *result| result.* = .{ .handle = handle };
+    }
+
+    /// Links entry points out of DXIL libraries, i.e. objects compiled with a lib_6_x target
+    /// profile, so that shared code is compiled once. See `machDxcLinkerInit`.
+    pub const Linker = struct {
+        handle: c.MachDxcLinker,
+
+        pub const LinkJob = struct {
+            entry_point: [*:0]const u8,
+            target_profile: [*:0]const u8,
+            /// Names given to `registerLibrary`.
+            libraries: []const [*:0]const u8,
+            args: []const [*:0]const u8 = &.{},
+
+            fn linkJob(job: LinkJob) c.MachDxcLinkJob {
+                return .{
+                    .entry_point = job.entry_point,
+                    .target_profile = job.target_profile,
+                    .libraries = @ptrCast(job.libraries.ptr),
+                    .libraries_len = job.libraries.len,
+                    .args = @ptrCast(job.args.ptr),
+                    .args_len = job.args.len,
+                };
+            }
+        };
+
+        pub fn init(compiler: Compiler) Linker {
+            return .{ .handle = c.machDxcLinkerInit(compiler.handle) };
+        }
+
+        pub fn deinit(linker: Linker) void {
+            c.machDxcLinkerDeinit(linker.handle);
+        }
+
+        /// Registers `library` under `name` without copying it; `library` may be deinitialized
+        /// afterwards.
+        pub fn registerLibrary(linker: Linker, name: [*:0]const u8, library: Result.Object) error{LibraryAlreadyRegistered}!void {
+            if (c.machDxcLinkerRegisterLibrary(linker.handle, name, library.handle) == 0)
+                return error.LibraryAlreadyRegistered;
+        }
+
+        /// Compiles the libraries in `jobs` whose preprocessed source changed since they were last
+        /// registered, registering each under `names[i]`. `results[i]` is null if library `i` was
+        /// up to date. See `machDxcLinkerUpdateLibraries`.
+        pub fn updateLibraries(
+            linker: Linker,
+            allocator: std.mem.Allocator,
+            names: []const [*:0]const u8,
+            jobs: []const Compiler.Job,
+            results: []?Result,
+            num_threads: usize,
+        ) !void {
+            std.debug.assert(names.len == jobs.len and results.len == jobs.len);
+
+            const options = try allocator.alloc(c.MachDxcCompileOptions, jobs.len);
+            defer allocator.free(options);
+            const handles = try allocator.alloc(c.MachDxcCompileResult, jobs.len);
+            defer allocator.free(handles);
+
+            for (jobs, options) |job, *option| option.* = job.options();
+            c.machDxcLinkerUpdateLibraries(linker.handle, @ptrCast(names.ptr), options.ptr, jobs.len, handles.ptr, num_threads);
+            for (handles, results) |handle, *result| result.* = if (handle == null) null else .{ .handle = handle };
+        }
+
+        pub fn link(linker: Linker, job: LinkJob) Result {
+            const link_job = job.linkJob();
+            return .{ .handle = c.machDxcLinkerLink(linker.handle, &link_job) };
+        }
+
+        /// Links each of `jobs` on `num_threads` threads (0 means one per CPU core), writing the
+        /// result of `jobs[i]` to `results[i]`.
+        pub fn linkBatch(
+            linker: Linker,
+            allocator: std.mem.Allocator,
+            jobs: []const LinkJob,
+            results: []Result,
+            num_threads: usize,
+        ) !void {
+            std.debug.assert(results.len == jobs.len);
+
+            const link_jobs = try allocator.alloc(c.MachDxcLinkJob, jobs.len);
+            defer allocator.free(link_jobs);
+            const handles = try allocator.alloc(c.MachDxcCompileResult, jobs.len);
+            defer allocator.free(handles);
+
+            for (jobs, link_jobs) |job, *link_job| link_job.* = job.linkJob();
+            c.machDxcLinkerLinkBatch(linker.handle, link_jobs.ptr, jobs.len, handles.ptr, num_threads);
+            for (handles, results) |handle, *result| result.* = .{ .handle = handle };
+        }
+    };
+
+    /// Runs LLVM passes over compiled modules without running the front end again, e.g. to
+    /// optimize shaders compiled with `-Od` in the background. See `machDxcOptimizerInit`.
+    pub const Optimizer = struct {
+        handle: c.MachDxcOptimizer,
+
+        pub const Pass = c.MachDxcOptimizerPass;
+
+        pub const Options = struct {
+            /// A DXIL container, such as a compiled object, or a bare LLVM bitcode module.
+            module: []const u8,
+            /// e.g. "-mem2reg", see `getPass`.
+            passes: []const [*:0]const u8,
+            /// Applied ahead of the passes, e.g. "-hlsl-passes-resume".
+            args: []const [*:0]const u8 = &.{},
+            /// Run each pass on its own to time it, see `Result.getPassTimings`.
+            collect_timings: bool = false,
+            /// Wrap the optimized module in a DXIL container.
+            assemble: bool = false,
+        };
+
+        pub fn init(compiler: Compiler) Optimizer {
+            return .{ .handle = c.machDxcOptimizerInit(compiler.handle) orelse @panic("DXC's optimizer couldn't be initialized") };
+        }
+
+        pub fn deinit(optimizer: Optimizer) void {
+            c.machDxcOptimizerDeinit(optimizer.handle);
+        }
+
+        pub fn getPassCount(optimizer: Optimizer) usize {
+            return c.machDxcOptimizerGetPassCount(optimizer.handle);
+        }
+
+        pub fn getPass(optimizer: Optimizer, index: usize) Pass {
+            return c.machDxcOptimizerGetPass(optimizer.handle, index);
+        }
+
+        /// Returns the optimized module as the result's object. Anything the passes printed is
+        /// reported through `Result.getError`.
+        pub fn optimize(optimizer: Optimizer, options: Options) Result {
+            const c_options = c.MachDxcOptimizeOptions{
+                .module = options.module.ptr,
+                .module_len = options.module.len,
+                .passes = @ptrCast(options.passes.ptr),
+                .passes_len = options.passes.len,
+                .args = @ptrCast(options.args.ptr),
+                .args_len = options.args.len,
+                .collect_timings = @intFromBool(options.collect_timings),
+                .assemble = @intFromBool(options.assemble),
+            };
+            return .{ .handle = c.machDxcOptimize(optimizer.handle, &c_options) };
+        }
+    };
+
+    /// Starts compiling `job` on the compiler's worker threads and returns immediately; the
+    /// calling thread is never blocked. If `callback` is given it is invoked with `context` on a
+    /// worker thread once the request completes or is cancelled, e.g. to wake an event loop that
+    /// then collects the result with `Request.takeResult`.
+    pub fn compileAsync(
+        compiler: Compiler,
+        job: Job,
+        context: anytype,
+        comptime callback: ?fn (@TypeOf(context), Request) void,
+    ) Request {
+        var options = job.options();
+        const Wrapper = struct {
+            fn complete(user_data: ?*anyopaque, request: c.MachDxcCompileRequest) callconv(.C) void {
+                callback.?(@ptrCast(@alignCast(user_data)), .{ .handle = request });
+            }
+        };
+        const handle = if (callback == null)
+            c.machDxcCompileAsync(compiler.handle, @ptrCast(&options), null, null)
+        else
+            c.machDxcCompileAsync(compiler.handle, @ptrCast(&options), Wrapper.complete, @ptrCast(@constCast(context)));
+        return .{ .handle = handle };
+    }
+
+    pub const Request = struct {
+        handle: c.MachDxcCompileRequest,
+
+        pub const Status = enum(c.MachDxcCompileStatus) {
+            pending = c.MachDxcCompilePending,
+            complete = c.MachDxcCompileComplete,
+            cancelled = c.MachDxcCompileCancelled,
+        };
+
+        /// Releases the handle. A pending request keeps running and still invokes its callback.
+        pub fn deinit(request: Request) void {
+            c.machDxcCompileRequestDeinit(request.handle);
+        }
+
+        pub fn poll(request: Request) Status {
+            return @enumFromInt(c.machDxcCompileRequestPoll(request.handle));
+        }
+
+        pub fn wait(request: Request) Status {
+            return @enumFromInt(c.machDxcCompileRequestWait(request.handle));
+        }
+
+        /// Returns false if the request had already completed or been cancelled.
+        pub fn cancel(request: Request) bool {
+            return c.machDxcCompileRequestCancel(request.handle) != 0;
+        }
+
+        /// Takes the result of a completed request, or null if it is pending, was cancelled or
+        /// its result was already taken.
+        pub fn takeResult(request: Request) ?Result {
+            if (c.machDxcCompileRequestGetResult(request.handle)) |result| return .{ .handle = result };
+            return null;
+        }
+    };
+
     pub const Result = struct {
         handle: c.MachDxcCompileResult,
 
@@ -43,6 +627,51 @@ pub const Compiler = struct {
             return .{ .handle = c.machDxcCompileResultGetObject(result.handle) };
         }
 
+        /// Nanosecond durations of the phases of the compile. Only `total_ns`,
+        /// `argument_conversion_ns` and `include_callbacks_ns` are measured unless the job set
+        /// `collect_timings`.
+        pub const Timings = c.MachDxcCompileTimings;
+
+        pub fn getTimings(result: Result) Timings {
+            return c.machDxcCompileResultGetTimings(result.handle);
+        }
+
+        /// Whether the object was linked out of DXIL libraries rather than compiled, see
+        /// `compileEntryPoints`.
+        pub fn isLinked(result: Result) bool {
+            return c.machDxcCompileResultIsLinked(result.handle) != 0;
+        }
+
+        /// Heap use of the compile by DXC, see `MachDxcMemoryStats` in mach_dxc.h.
+        pub const MemoryStats = c.MachDxcMemoryStats;
+
+        pub fn getMemoryStats(result: Result) MemoryStats {
+            return c.machDxcCompileResultGetMemoryStats(result.handle);
+        }
+
+        /// The number of headers resolved by `Compiler.preprocess`.
+        pub fn getIncludeCount(result: Result) usize {
+            return c.machDxcCompileResultGetIncludeCount(result.handle);
+        }
+
+        pub fn getInclude(result: Result, index: usize) [:0]const u8 {
+            return std.mem.span(c.machDxcCompileResultGetInclude(result.handle, index));
+        }
+
+        pub const PassTiming = c.MachDxcPassTiming;
+
+        /// Fills `out` with the timings of the most expensive LLVM passes first and returns how
+        /// many passes ran. Empty unless the job set `collect_timings` to `.passes`.
+        pub fn getPassTimings(result: Result, out: []PassTiming) usize {
+            return c.machDxcCompileResultGetPassTimings(result.handle, out.ptr, out.len);
+        }
+
+        /// The Chrome trace-event JSON of the compile, if the job set `collect_trace`.
+        pub fn getTrace(result: Result) ?[]const u8 {
+            const trace = c.machDxcCompileResultGetTrace(result.handle) orelse return null;
+            return trace[0..c.machDxcCompileResultGetTraceLength(result.handle)];
+        }
+
         pub const Error = struct {
             handle: c.MachDxcCompileError,
 
@@ -69,35 +698,841 @@ pub const Compiler = struct {
     };
 };
 
+const test_code =
+    \\ Texture1D<float4> tex[5] : register(t3);
+    \\ SamplerState SS[3] : register(s2);
+    \\
+    \\ [RootSignature("DescriptorTable(SRV(t3, numDescriptors=5)), DescriptorTable(Sampler(s2, numDescriptors=3))")]
+    \\ float4 main(int i : A, float j : B) : SV_TARGET
+    \\ {
+    \\   float4 r = tex[NonUniformResourceIndex(i)].Sample(SS[NonUniformResourceIndex(i)], i);
+    \\   r += tex[NonUniformResourceIndex(j)].Sample(SS[i], j+2);
+    \\   return r;
+    \\ };
+;
+const test_args = &[_][*:0]const u8{ "-E", "main", "-T", "ps_6_0", "-D", "MYDEFINE=1", "-Qstrip_debug", "-Qstrip_reflect" };
+
 test {
-    const std = @import("std");
+    const compiler = Compiler.init();
+    defer compiler.deinit();
+
+    const result = compiler.compile(test_code, test_args);
+    if (result.getError()) |err| {
+        defer err.deinit();
+        std.debug.print("compiler error: {s}\n", .{err.getString()});
+        return error.ShaderCompilationFailed;
+    }
+
+    const object = result.getObject();
+    defer object.deinit();
+
+    try std.testing.expectEqual(@as(usize, 2392), object.getBytes().len);
+}
+
+test "compileBatch" {
+    const compiler = Compiler.init();
+    defer compiler.deinit();
+
+    const jobs = [_]Compiler.Job{.{ .code = test_code, .args = test_args }} ** 8;
+    var results: [jobs.len]Compiler.Result = undefined;
+    try compiler.compileBatch(std.testing.allocator, &jobs, &results, 4);
+
+    for (results) |result| {
+        defer result.deinit();
+        if (result.getError()) |err| {
+            defer err.deinit();
+            std.debug.print("compiler error: {s}\n", .{err.getString()});
+            return error.ShaderCompilationFailed;
+        }
+
+        const object = result.getObject();
+        defer object.deinit();
+        try std.testing.expectEqual(@as(usize, 2392), object.getBytes().len);
+    }
+}
+
+test "compile cache" {
+    const compiler = Compiler.init();
+    defer compiler.deinit();
+    compiler.enableCache(16 * 1024 * 1024);
+
+    for (0..2) |_| {
+        const result = compiler.compile(test_code, test_args);
+        defer result.deinit();
+
+        const object = result.getObject();
+        defer object.deinit();
+        try std.testing.expectEqual(@as(usize, 2392), object.getBytes().len);
+    }
+
+    const stats = compiler.getCacheStats();
+    try std.testing.expectEqual(@as(usize, 1), stats.hits);
+    try std.testing.expectEqual(@as(usize, 1), stats.misses);
+    try std.testing.expectEqual(@as(usize, 1), stats.entries);
+}
+
+test "disk cache" {
+    var tmp = std.testing.tmpDir(.{});
+    defer tmp.cleanup();
+    const path = try tmp.dir.realpathAlloc(std.testing.allocator, ".");
+    defer std.testing.allocator.free(path);
+    const cache_dir = try std.fs.path.joinZ(std.testing.allocator, &.{ path, "shader-cache" });
+    defer std.testing.allocator.free(cache_dir);
+
+    // The second compiler starts cold in memory and must be served from the first one's files.
+    for (0..2) |_| {
+        const compiler = Compiler.init();
+        defer compiler.deinit();
+        try compiler.enableDiskCache(cache_dir, 16 * 1024 * 1024);
+
+        const result = compiler.compile(test_code, test_args);
+        defer result.deinit();
+        const object = result.getObject();
+        defer object.deinit();
+        try std.testing.expectEqual(@as(usize, 2392), object.getBytes().len);
+    }
+
+    const compiler = Compiler.init();
+    defer compiler.deinit();
+    try compiler.enableDiskCache(cache_dir, 16 * 1024 * 1024);
+    try std.testing.expectEqual(@as(usize, 1), compiler.getDiskCacheStats().entries);
+}
+
+// Compiles test_code with MYDEFINE set to `variant`, so that each variant is cached separately,
+// and returns the size of the object.
+fn compileVariant(compiler: Compiler, variant: usize) !usize {
+    var define_buf: [32]u8 = undefined;
+    const define = try std.fmt.bufPrintZ(&define_buf, "MYDEFINE={d}", .{variant});
+    const result = compiler.compile(test_code, &.{ "-E", "main", "-T", "ps_6_0", "-D", define.ptr, "-Qstrip_debug", "-Qstrip_reflect" });
+    defer result.deinit();
+    const object = result.getObject();
+    defer object.deinit();
+    return object.getBytes().len;
+}
+
+test "disk cache torn record" {
+    var tmp = std.testing.tmpDir(.{});
+    defer tmp.cleanup();
+    const path = try tmp.dir.realpathAlloc(std.testing.allocator, ".");
+    defer std.testing.allocator.free(path);
+    const cache_dir = try std.fs.path.joinZ(std.testing.allocator, &.{ path, "shader-cache" });
+    defer std.testing.allocator.free(cache_dir);
+
+    {
+        const compiler = Compiler.init();
+        defer compiler.deinit();
+        try compiler.enableDiskCache(cache_dir, 16 * 1024 * 1024);
+        try std.testing.expectEqual(@as(usize, 2392), try compileVariant(compiler, 0));
+    }
+
+    // Cut the record short, as a crash in the middle of writing it would.
+    {
+        const pack = try tmp.dir.openFile("shader-cache/pack-0", .{ .mode = .read_write });
+        defer pack.close();
+        try pack.setEndPos((try pack.stat()).size / 2);
+    }
+
+    // The torn record is a miss and is written again, after which it is served from disk.
+    for (0..2) |i| {
+        const compiler = Compiler.init();
+        defer compiler.deinit();
+        try compiler.enableDiskCache(cache_dir, 16 * 1024 * 1024);
+        try std.testing.expectEqual(@as(usize, 2392), try compileVariant(compiler, 0));
+        const stats = compiler.getDiskCacheStats();
+        try std.testing.expectEqual(@as(usize, i), stats.hits);
+        try std.testing.expectEqual(@as(usize, 1 - i), stats.misses);
+    }
+}
+
+test "disk cache eviction" {
+    var tmp = std.testing.tmpDir(.{});
+    defer tmp.cleanup();
+    const path = try tmp.dir.realpathAlloc(std.testing.allocator, ".");
+    defer std.testing.allocator.free(path);
+    const cache_dir = try std.fs.path.joinZ(std.testing.allocator, &.{ path, "shader-cache" });
+    defer std.testing.allocator.free(cache_dir);
+
+    // Packs hold a quarter of the limit, so about one record each.
+    const max_bytes = 16 * 1024;
+    const compiler = Compiler.init();
+    defer compiler.deinit();
+    try compiler.enableDiskCache(cache_dir, max_bytes);
+    for (0..16) |variant| try std.testing.expectEqual(@as(usize, 2392), try compileVariant(compiler, variant));
+
+    const stats = compiler.getDiskCacheStats();
+    try std.testing.expect(stats.evictions > 0);
+    try std.testing.expect(stats.bytes <= max_bytes);
+    try std.testing.expect(stats.entries < 16);
+    try std.testing.expectError(error.FileNotFound, tmp.dir.access("shader-cache/pack-0", .{}));
+
+    // The newest variant is still cached, the oldest was evicted with its pack.
+    _ = try compileVariant(compiler, 15);
+    try std.testing.expectEqual(stats.hits + 1, compiler.getDiskCacheStats().hits);
+    _ = try compileVariant(compiler, 0);
+    try std.testing.expectEqual(stats.misses + 1, compiler.getDiskCacheStats().misses);
+}
+
+test "disk cache concurrent writers" {
+    var tmp = std.testing.tmpDir(.{});
+    defer tmp.cleanup();
+    const path = try tmp.dir.realpathAlloc(std.testing.allocator, ".");
+    defer std.testing.allocator.free(path);
+    const cache_dir = try std.fs.path.joinZ(std.testing.allocator, &.{ path, "shader-cache" });
+    defer std.testing.allocator.free(cache_dir);
+
+    // Compilers sharing a directory write the same records at the same time, as separate
+    // processes building the same shaders would.
+    const Worker = struct {
+        fn run(dir: [*:0]const u8, failures: *std.atomic.Value(usize)) void {
+            const compiler = Compiler.init();
+            defer compiler.deinit();
+            compiler.enableDiskCache(dir, 16 * 1024 * 1024) catch {
+                _ = failures.fetchAdd(1, .monotonic);
+                return;
+            };
+            for (0..8) |variant| {
+                const size = compileVariant(compiler, variant) catch 0;
+                if (size != 2392) _ = failures.fetchAdd(1, .monotonic);
+            }
+        }
+    };
+
+    var failures = std.atomic.Value(usize).init(0);
+    var threads: [4]std.Thread = undefined;
+    for (&threads) |*thread| thread.* = try std.Thread.spawn(.{}, Worker.run, .{ cache_dir.ptr, &failures });
+    for (threads) |thread| thread.join();
+    try std.testing.expectEqual(@as(usize, 0), failures.load(.monotonic));
+
+    const compiler = Compiler.init();
+    defer compiler.deinit();
+    try compiler.enableDiskCache(cache_dir, 16 * 1024 * 1024);
+    for (0..8) |variant| try std.testing.expectEqual(@as(usize, 2392), try compileVariant(compiler, variant));
+    try std.testing.expectEqual(@as(usize, 8), compiler.getDiskCacheStats().hits);
+}
+
+test "base args" {
+    const compiler = Compiler.init();
+    defer compiler.deinit();
+
+    const base_args = Compiler.Args.init(&.{ "-E", "main", "-T", "ps_6_0" });
+    defer base_args.deinit();
+
+    for (0..2) |_| {
+        const result = compiler.compileJob(.{
+            .code = test_code,
+            .args = &.{ "-D", "MYDEFINE=1", "-Qstrip_debug", "-Qstrip_reflect" },
+            .base_args = base_args,
+        });
+        defer result.deinit();
+        if (result.getError()) |err| {
+            defer err.deinit();
+            std.debug.print("compiler error: {s}\n", .{err.getString()});
+            return error.ShaderCompilationFailed;
+        }
+
+        const object = result.getObject();
+        defer object.deinit();
+        try std.testing.expectEqual(@as(usize, 2392), object.getBytes().len);
+    }
+}
+
+test "include cache" {
+    const compiler = Compiler.init();
+    defer compiler.deinit();
+    compiler.enableIncludeCache(.never, 1024 * 1024);
+
+    const Header = struct {
+        var reads: usize = 0;
+        var result: Compiler.IncludeResult = undefined;
+        const text = "#define COLOR float4(1, 0, 0, 1)";
+
+        fn include(_: ?*anyopaque, _: [*c]const u8) callconv(.C) [*c]Compiler.IncludeResult {
+            reads += 1;
+            result = .{ .header_data = text, .header_length = text.len };
+            return &result;
+        }
+
+        fn free(_: ?*anyopaque, _: [*c]Compiler.IncludeResult) callconv(.C) c_int {
+            return 0;
+        }
+    };
+    var callbacks: Compiler.IncludeCallbacks = .{
+        .include_ctx = null,
+        .include_func = Header.include,
+        .free_func = Header.free,
+        .version_func = null,
+    };
+
+    for (0..3) |_| {
+        const result = compiler.compileJob(.{
+            .code = "#include \"color.h\"\nfloat4 main() : SV_Target { return COLOR; }",
+            .args = &.{ "-E", "main", "-T", "ps_6_0" },
+            .include_callbacks = &callbacks,
+        });
+        defer result.deinit();
+        if (result.getError()) |err| {
+            defer err.deinit();
+            std.debug.print("compiler error: {s}\n", .{err.getString()});
+            return error.ShaderCompilationFailed;
+        }
+    }
+
+    try std.testing.expectEqual(@as(usize, 1), Header.reads);
+    const stats = compiler.getIncludeCacheStats();
+    try std.testing.expectEqual(@as(usize, 2), stats.hits);
+    try std.testing.expectEqual(@as(usize, 1), stats.misses);
+    try std.testing.expectEqual(@as(usize, 2 * Header.text.len), stats.bytes_saved);
+}
+
+test "compileAsync" {
+    const compiler = Compiler.init();
+    defer compiler.deinit();
+
+    var completed = std.Thread.ResetEvent{};
+    const onComplete = struct {
+        fn onComplete(event: *std.Thread.ResetEvent, _: Compiler.Request) void {
+            event.set();
+        }
+    }.onComplete;
+
+    const request = compiler.compileAsync(.{ .code = test_code, .args = test_args }, &completed, onComplete);
+    defer request.deinit();
+    completed.wait();
+    try std.testing.expectEqual(Compiler.Request.Status.complete, request.poll());
+
+    const result = request.takeResult() orelse return error.ShaderCompilationFailed;
+    defer result.deinit();
+    const object = result.getObject();
+    defer object.deinit();
+    try std.testing.expectEqual(@as(usize, 2392), object.getBytes().len);
+    try std.testing.expect(!request.cancel());
+}
+
+test "initPool" {
+    const compiler = Compiler.initPool(2);
+    defer compiler.deinit();
+
+    const Worker = struct {
+        fn run(comp: Compiler, failures: *std.atomic.Value(usize)) void {
+            for (0..4) |_| {
+                const result = comp.compile(test_code, test_args);
+                defer result.deinit();
+                const object = result.getObject();
+                defer object.deinit();
+                if (object.getBytes().len != 2392) _ = failures.fetchAdd(1, .monotonic);
+            }
+        }
+    };
+
+    var failures = std.atomic.Value(usize).init(0);
+    var threads: [4]std.Thread = undefined;
+    for (&threads) |*thread| thread.* = try std.Thread.spawn(.{}, Worker.run, .{ compiler, &failures });
+    for (threads) |thread| thread.join();
+    try std.testing.expectEqual(@as(usize, 0), failures.load(.monotonic));
+
+    const stats = compiler.getPoolStats();
+    try std.testing.expectEqual(@as(usize, 16), stats.leases);
+    try std.testing.expect(stats.instances <= 2);
+
+    var instances: [2]Compiler.PoolInstanceStats = undefined;
+    try std.testing.expectEqual(stats.instances, compiler.getPoolInstanceStats(&instances));
+}
+
+test "concurrent init" {
+    const Worker = struct {
+        fn run(failures: *std.atomic.Value(usize)) void {
+            for (0..4) |_| {
+                const compiler = Compiler.init();
+                defer compiler.deinit();
+
+                const result = compiler.compile(test_code, test_args);
+                defer result.deinit();
+                const object = result.getObject();
+                defer object.deinit();
+                if (object.getBytes().len != 2392) _ = failures.fetchAdd(1, .monotonic);
+            }
+        }
+    };
+
+    var failures = std.atomic.Value(usize).init(0);
+    var threads: [8]std.Thread = undefined;
+    for (&threads) |*thread| thread.* = try std.Thread.spawn(.{}, Worker.run, .{&failures});
+    for (threads) |thread| thread.join();
+    try std.testing.expectEqual(@as(usize, 0), failures.load(.monotonic));
+}
+
+test "timings" {
+    const compiler = Compiler.init();
+    defer compiler.deinit();
+
+    for ([_]Compiler.TimingDetail{ .passes, .phases }) |detail| {
+        const result = compiler.compileJob(.{ .code = test_code, .args = test_args, .collect_timings = detail });
+        defer result.deinit();
+
+        const timings = result.getTimings();
+        try std.testing.expect(timings.total_ns > 0);
+        try std.testing.expect(timings.parse_ns + timings.codegen_ns + timings.optimize_ns + timings.validation_ns +
+            timings.container_ns <= timings.total_ns);
+
+        var passes: [256]Compiler.Result.PassTiming = undefined;
+        const count = @min(result.getPassTimings(&passes), passes.len);
+        if (detail == .phases) try std.testing.expectEqual(@as(usize, 0), count);
+        for (passes[0..count]) |pass| try std.testing.expect(pass.runs > 0 and pass.self_ns <= pass.total_ns);
+    }
+}
+
+test "trace" {
+    const compiler = Compiler.init();
+    defer compiler.deinit();
+
+    const result = compiler.compileJob(.{ .code = test_code, .args = test_args, .collect_trace = true });
+    defer result.deinit();
+
+    const trace = result.getTrace() orelse return error.MissingTrace;
+    try std.testing.expect(std.mem.startsWith(u8, trace, "{\"traceEvents\":["));
+    try std.testing.expect(std.mem.indexOf(u8, trace, "\"name\":\"Compile\"") != null);
+
+    const untraced = compiler.compile(test_code, test_args);
+    defer untraced.deinit();
+    try std.testing.expect(untraced.getTrace() == null);
+}
+
+test "memory stats" {
+    const compiler = Compiler.init();
+    defer compiler.deinit();
+
+    const result = compiler.compile(test_code, test_args);
+    defer result.deinit();
+
+    const stats = result.getMemoryStats();
+    try std.testing.expect(stats.allocations > 0 and stats.peak_bytes > 0);
+    try std.testing.expect(stats.peak_bytes <= stats.allocated_bytes);
+    var histogram_total: u64 = 0;
+    for (stats.size_histogram) |count| histogram_total += count;
+    try std.testing.expectEqual(stats.allocations, histogram_total);
+}
+
+test "initWithAllocator" {
+    // std.testing.allocator fails the test if any block DXC allocated through it isn't freed, or
+    // if anything it didn't allocate is passed back to it.
+    {
+        const compiler = Compiler.initWithAllocator(&std.testing.allocator);
+        defer compiler.deinit();
+
+        for (0..2) |_| {
+            const result = compiler.compile(test_code, test_args);
+            try std.testing.expect(result.getError() == null);
+            try std.testing.expect(result.getMemoryStats().allocations > 0);
+            // The object outlives the result it came from.
+            const object = result.getObject();
+            result.deinit();
+            try std.testing.expect(object.getBytes().len > 0);
+            object.deinit();
+        }
+    }
+}
+
+test "use_arena" {
+    const compiler = Compiler.initPool(1);
+    defer compiler.deinit();
+
+    // The first compile on an instance never uses the arena, the ones after it allocate nothing
+    // on the heap.
+    for (0..3) |i| {
+        const result = compiler.compileJob(.{ .code = test_code, .args = test_args, .use_arena = true });
+        defer result.deinit();
+
+        const object = result.getObject();
+        defer object.deinit();
+        try std.testing.expectEqual(@as(usize, 2392), object.getBytes().len);
+
+        const memory = result.getMemoryStats();
+        if (i == 0) {
+            try std.testing.expectEqual(@as(u64, 0), memory.arena_allocations);
+        } else {
+            try std.testing.expect(memory.arena_bytes > 0);
+            try std.testing.expectEqual(memory.allocations, memory.arena_allocations);
+            try std.testing.expectEqual(memory.frees, memory.arena_frees);
+        }
+    }
+}
+
+test "preprocess" {
+    const compiler = Compiler.init();
+    defer compiler.deinit();
+
+    const Headers = struct {
+        var result: Compiler.IncludeResult = undefined;
+
+        fn include(_: ?*anyopaque, _: [*c]const u8) callconv(.C) [*c]Compiler.IncludeResult {
+            const header = "#define SCALE 2\n";
+            result = .{ .header_data = header, .header_length = header.len };
+            return &result;
+        }
+
+        fn free(_: ?*anyopaque, _: [*c]Compiler.IncludeResult) callconv(.C) c_int {
+            return 0;
+        }
+    };
+    var callbacks = Compiler.IncludeCallbacks{
+        .include_ctx = null,
+        .include_func = Headers.include,
+        .free_func = Headers.free,
+        .version_func = null,
+    };
+
+    const code = "#include \"scale.hlsli\"\nfloat4 main() : SV_Target { return SCALE; }";
+    const result = compiler.preprocess(.{ .code = code, .args = test_args, .include_callbacks = &callbacks });
+    defer result.deinit();
+    try std.testing.expect(result.getError() == null);
+
+    const object = result.getObject();
+    defer object.deinit();
+    try std.testing.expect(std.mem.indexOf(u8, object.getBytes(), "return 2;") != null);
+    try std.testing.expectEqual(@as(usize, 1), result.getIncludeCount());
+    try std.testing.expect(std.mem.endsWith(u8, result.getInclude(0), "scale.hlsli"));
+}
+
+test "scanDependencies" {
+    const compiler = Compiler.init();
+    defer compiler.deinit();
+
+    const Files = struct {
+        var results: [3]Compiler.IncludeResult = undefined;
+        const names = [_][]const u8{ "main.hlsl", "lights.hlsli", "common.hlsli" };
+        const texts = [_][]const u8{
+            "#include \"lights.hlsli\"\n#include \"common.hlsli\"\nfloat4 main() : SV_Target { return LIGHT; }",
+            "#include \"common.hlsli\"\n#define LIGHT float4(1, 1, 1, 1)",
+            "// #include \"unused.hlsli\"\n",
+        };
+
+        fn include(_: ?*anyopaque, name: [*c]const u8) callconv(.C) [*c]Compiler.IncludeResult {
+            for (names, texts, &results) |file_name, text, *result| {
+                if (std.mem.eql(u8, std.mem.span(name), file_name)) {
+                    result.* = .{ .header_data = text.ptr, .header_length = text.len };
+                    return result;
+                }
+            }
+            return null;
+        }
+
+        fn free(_: ?*anyopaque, _: [*c]Compiler.IncludeResult) callconv(.C) c_int {
+            return 0;
+        }
+    };
+    var callbacks = Compiler.IncludeCallbacks{
+        .include_ctx = null,
+        .include_func = Files.include,
+        .free_func = Files.free,
+        .version_func = null,
+    };
+
+    const graph = compiler.scanDependencies(&callbacks, &.{"main.hlsl"}, 1);
+    defer graph.deinit();
+    try std.testing.expectEqual(@as(usize, 3), graph.getNodeCount());
+
+    const main_node = graph.getNode(0);
+    try std.testing.expectEqualStrings("main.hlsl", main_node.name);
+    try std.testing.expectEqual(@as(usize, 2), main_node.includes.len);
+    const lights = graph.getNode(main_node.includes[0]);
+    try std.testing.expectEqualStrings("lights.hlsli", lights.name);
+    try std.testing.expectEqualSlices(usize, &.{main_node.includes[1]}, lights.includes);
+    try std.testing.expectEqual(@as(usize, 0), graph.getNode(main_node.includes[1]).includes.len);
+}
+
+test "prefix header" {
+    const compiler = Compiler.init();
+    defer compiler.deinit();
+
+    const Header = struct {
+        var reads: usize = 0;
+        var result: Compiler.IncludeResult = undefined;
+        const text = "#define COLOR float4(SCALE, 0, 0, 1)";
+
+        fn include(_: ?*anyopaque, _: [*c]const u8) callconv(.C) [*c]Compiler.IncludeResult {
+            reads += 1;
+            result = .{ .header_data = text, .header_length = text.len };
+            return &result;
+        }
+
+        fn free(_: ?*anyopaque, _: [*c]Compiler.IncludeResult) callconv(.C) c_int {
+            return 0;
+        }
+    };
+    var callbacks: Compiler.IncludeCallbacks = .{
+        .include_ctx = null,
+        .include_func = Header.include,
+        .free_func = Header.free,
+        .version_func = null,
+    };
+
+    const prefix_header = Compiler.PrefixHeader.init(compiler, &callbacks, &.{"color.hlsli"}, &.{"SCALE=1"});
+    defer prefix_header.deinit();
+    try std.testing.expectEqual(@as(usize, 1), Header.reads);
+
+    for (0..3) |_| {
+        const result = compiler.compileJob(.{
+            .code = "float4 main() : SV_Target { return COLOR; }",
+            .args = &.{ "-E", "main", "-T", "ps_6_0" },
+            .prefix_header = prefix_header,
+        });
+        defer result.deinit();
+        if (result.getError()) |err| {
+            defer err.deinit();
+            std.debug.print("compiler error: {s}\n", .{err.getString()});
+            return error.ShaderCompilationFailed;
+        }
+    }
+    try std.testing.expectEqual(@as(usize, 1), Header.reads);
+}
+
+test "compilePermutations" {
+    const compiler = Compiler.init();
+    defer compiler.deinit();
 
     const code =
-        \\ Texture1D<float4> tex[5] : register(t3);
-        \\ SamplerState SS[3] : register(s2);
-        \\
-        \\ [RootSignature("DescriptorTable(SRV(t3, numDescriptors=5)), DescriptorTable(Sampler(s2, numDescriptors=3))")]
-        \\ float4 main(int i : A, float j : B) : SV_TARGET
-        \\ {
-        \\   float4 r = tex[NonUniformResourceIndex(i)].Sample(SS[NonUniformResourceIndex(i)], i);
-        \\   r += tex[NonUniformResourceIndex(j)].Sample(SS[i], j+2);
-        \\   return r;
-        \\ };
+        \\float4 main() : SV_Target {
+        \\#if RED
+        \\  return float4(1, 0, 0, 1);
+        \\#else
+        \\  return float4(0, 0, 1, 1);
+        \\#endif
+        \\}
     ;
-    const args = &[_][*:0]const u8{ "-E", "main", "-T", "ps_6_0", "-D", "MYDEFINE=1", "-Qstrip_debug", "-Qstrip_reflect" };
+    const permutations = [_][]const [*:0]const u8{
+        &.{ "-D", "RED=1" },
+        &.{ "-D", "RED=1", "-D", "UNUSED=1" },
+        &.{ "-D", "RED=0" },
+        &.{ "-D", "RED=0", "-O0" },
+    };
+    var results: [permutations.len]Compiler.Result = undefined;
+    try compiler.compilePermutations(std.testing.allocator, .{ .code = code, .args = &.{ "-E", "main", "-T", "ps_6_0" } }, &permutations, true, &results, 0);
+    defer for (results) |result| result.deinit();
+
+    var objects: [permutations.len]Compiler.Result.Object = undefined;
+    for (results, &objects) |result, *object| {
+        try std.testing.expect(result.getError() == null);
+        object.* = result.getObject();
+    }
+    defer for (objects) |object| object.deinit();
+
+    try std.testing.expectEqualSlices(u8, objects[0].getBytes(), objects[1].getBytes());
+    try std.testing.expect(!std.mem.eql(u8, objects[0].getBytes(), objects[2].getBytes()));
+}
 
+test "compileEntryPoints" {
     const compiler = Compiler.init();
     defer compiler.deinit();
 
-    const result = compiler.compile(code, args);
-    if (result.getError()) |err| {
+    const entry_points = [_]Compiler.EntryPoint{
+        .{ .name = "vs_main", .target_profile = "vs_6_0" },
+        .{ .name = "ps_main", .target_profile = "ps_6_0" },
+    };
+
+    // Entry points with a shader attribute are linked out of one library, those without one are
+    // compiled on their own.
+    const linkable =
+        \\[shader("vertex")] float4 vs_main(float4 position : POSITION) : SV_Position { return position; }
+        \\[shader("pixel")] float4 ps_main() : SV_Target { return float4(1, 0, 0, 1); }
+    ;
+    const plain =
+        \\float4 vs_main(float4 position : POSITION) : SV_Position { return position; }
+        \\float4 ps_main() : SV_Target { return float4(1, 0, 0, 1); }
+    ;
+    for ([_][]const u8{ linkable, plain }, [_]bool{ true, false }) |code, linked| {
+        var results: [entry_points.len]Compiler.Result = undefined;
+        try compiler.compileEntryPoints(std.testing.allocator, .{ .code = code, .args = &.{"-Qstrip_debug"} }, &entry_points, &results, 0);
+        defer for (results) |result| result.deinit();
+
+        for (results) |result| {
+            if (result.getError()) |err| {
+                defer err.deinit();
+                std.debug.print("compiler error: {s}\n", .{err.getString()});
+                return error.ShaderCompilationFailed;
+            }
+            try std.testing.expectEqual(linked, result.isLinked());
+            const object = result.getObject();
+            defer object.deinit();
+            try std.testing.expect(std.mem.startsWith(u8, object.getBytes(), "DXBC"));
+        }
+    }
+}
+
+test "Linker" {
+    const compiler = Compiler.init();
+    defer compiler.deinit();
+
+    const code =
+        \\[shader("vertex")] float4 vs_main(float4 position : POSITION) : SV_Position { return position; }
+        \\[shader("pixel")] float4 ps_main() : SV_Target { return float4(1, 0, 0, 1); }
+    ;
+    const library = compiler.compile(code, &.{ "-T", "lib_6_3", "-default-linkage", "external" });
+    defer library.deinit();
+    if (library.getError()) |err| {
         defer err.deinit();
         std.debug.print("compiler error: {s}\n", .{err.getString()});
         return error.ShaderCompilationFailed;
     }
 
+    const linker = Compiler.Linker.init(compiler);
+    defer linker.deinit();
+    {
+        const object = library.getObject();
+        defer object.deinit();
+        try linker.registerLibrary("shaders", object);
+        try std.testing.expectError(error.LibraryAlreadyRegistered, linker.registerLibrary("shaders", object));
+    }
+
+    const libraries = [_][*:0]const u8{"shaders"};
+    const jobs = [_]Compiler.Linker.LinkJob{
+        .{ .entry_point = "vs_main", .target_profile = "vs_6_0", .libraries = &libraries },
+        .{ .entry_point = "ps_main", .target_profile = "ps_6_0", .libraries = &libraries },
+    };
+    var results: [jobs.len]Compiler.Result = undefined;
+    try linker.linkBatch(std.testing.allocator, &jobs, &results, 0);
+    defer for (results) |result| result.deinit();
+
+    for (results) |result| {
+        if (result.getError()) |err| {
+            defer err.deinit();
+            std.debug.print("linker error: {s}\n", .{err.getString()});
+            return error.ShaderCompilationFailed;
+        }
+        const object = result.getObject();
+        defer object.deinit();
+        try std.testing.expect(std.mem.startsWith(u8, object.getBytes(), "DXBC"));
+    }
+
+    const missing = linker.link(.{ .entry_point = "ps_main", .target_profile = "ps_6_0", .libraries = &.{"missing"} });
+    defer missing.deinit();
+    const err = missing.getError() orelse return error.ExpectedLinkError;
+    defer err.deinit();
+    try std.testing.expect(std.mem.indexOf(u8, err.getString(), "missing") != null);
+}
+
+test "Linker.updateLibraries" {
+    const compiler = Compiler.init();
+    defer compiler.deinit();
+    const linker = Compiler.Linker.init(compiler);
+    defer linker.deinit();
+
+    const names = [_][*:0]const u8{ "vertex", "pixel" };
+    var jobs = [_]Compiler.Job{
+        .{ .code = "[shader(\"vertex\")] float4 vs_main(float4 position : POSITION) : SV_Position { return position; }", .args = &.{ "-T", "lib_6_3" } },
+        .{ .code = "[shader(\"pixel\")] float4 ps_main() : SV_Target { return float4(1, 0, 0, 1); }", .args = &.{ "-T", "lib_6_3" } },
+    };
+    var results: [jobs.len]?Compiler.Result = undefined;
+    try linker.updateLibraries(std.testing.allocator, &names, &jobs, &results, 0);
+    for (results) |result| {
+        const compiled = result orelse return error.ExpectedCompile;
+        defer compiled.deinit();
+        if (compiled.getError()) |err| {
+            defer err.deinit();
+            std.debug.print("compiler error: {s}\n", .{err.getString()});
+            return error.ShaderCompilationFailed;
+        }
+    }
+
+    // Only the edited library is compiled again.
+    jobs[1].code = "[shader(\"pixel\")] float4 ps_main() : SV_Target { return float4(0, 1, 0, 1); }";
+    try linker.updateLibraries(std.testing.allocator, &names, &jobs, &results, 0);
+    try std.testing.expect(results[0] == null);
+    const recompiled = results[1] orelse return error.ExpectedCompile;
+    recompiled.deinit();
+
+    const result = linker.link(.{ .entry_point = "ps_main", .target_profile = "ps_6_0", .libraries = names[1..] });
+    defer result.deinit();
     const object = result.getObject();
     defer object.deinit();
+    try std.testing.expect(std.mem.startsWith(u8, object.getBytes(), "DXBC"));
+}
 
-    try std.testing.expectEqual(@as(usize, 2392), object.getBytes().len);
+test "Optimizer" {
+    const compiler = Compiler.init();
+    defer compiler.deinit();
+    const optimizer = Compiler.Optimizer.init(compiler);
+    defer optimizer.deinit();
+
+    var found = false;
+    for (0..optimizer.getPassCount()) |i| {
+        found = found or std.mem.eql(u8, std.mem.span(optimizer.getPass(i).name), "mem2reg");
+    }
+    try std.testing.expect(found);
+
+    const code = "float4 main() : SV_Target { float4 color = float4(1, 0, 0, 1); return color; }";
+    const compiled = compiler.compile(code, &.{ "-E", "main", "-T", "ps_6_0", "-Od" });
+    defer compiled.deinit();
+    const object = compiled.getObject();
+    defer object.deinit();
+
+    const result = optimizer.optimize(.{
+        .module = object.getBytes(),
+        .passes = &.{ "-mem2reg", "-instcombine" },
+        .collect_timings = true,
+    });
+    defer result.deinit();
+    if (result.getError()) |err| {
+        defer err.deinit();
+        std.debug.print("optimizer error: {s}\n", .{err.getString()});
+        return error.OptimizationFailed;
+    }
+    const optimized = result.getObject();
+    defer optimized.deinit();
+    try std.testing.expect(optimized.getBytes().len > 0);
+
+    var passes: [4]Compiler.Result.PassTiming = undefined;
+    try std.testing.expectEqual(@as(usize, 2), result.getPassTimings(&passes));
+}
+
+test "reflect" {
+    const compiler = Compiler.init();
+    defer compiler.deinit();
+
+    const code =
+        \\cbuffer Params : register(b0) { float4 tint; float scale; };
+        \\RWStructuredBuffer<float4> output : register(u1, space2);
+        \\[numthreads(8, 4, 1)]
+        \\void main(uint3 id : SV_DispatchThreadID) { output[id.x] = tint * scale; }
+    ;
+    const result = compiler.compile(code, &.{ "-E", "main", "-T", "cs_6_6" });
+    defer result.deinit();
+    if (result.getError()) |err| {
+        defer err.deinit();
+        std.debug.print("compiler error: {s}\n", .{err.getString()});
+        return error.ShaderCompilationFailed;
+    }
+    const object = result.getObject();
+    defer object.deinit();
+
+    const reflection = compiler.reflect(object.getBytes()) orelse return error.InvalidContainer;
+    defer reflection.deinit();
+    try std.testing.expect(reflection.getShaderStage() == c.MachDxcShaderStageCompute);
+    try std.testing.expectEqual([3]u32{ 8, 4, 1 }, reflection.getThreadGroupSize().?);
+    // System values such as SV_DispatchThreadID aren't part of a compute shader's signature.
+    try std.testing.expectEqual(@as(usize, 0), reflection.getSignatureElementCount(c.MachDxcSignatureKindInput));
+
+    var found_uav = false;
+    for (0..reflection.getResourceBindingCount()) |i| {
+        const binding = reflection.getResourceBinding(i);
+        if (binding.type == c.MachDxcResourceTypeUAVStructured) {
+            try std.testing.expectEqual(@as(u32, 2), binding.space);
+            try std.testing.expectEqual(@as(u32, 1), binding.lower_bound);
+            found_uav = true;
+        }
+    }
+    try std.testing.expect(found_uav);
+
+    try std.testing.expectEqual(@as(usize, 1), reflection.getConstantBufferCount());
+    const params = reflection.getConstantBuffer(0);
+    try std.testing.expectEqualStrings("Params", std.mem.span(params.name));
+    try std.testing.expectEqual(@as(usize, 2), params.variables_len);
+    try std.testing.expectEqual(@as(u32, 16), reflection.getConstantBufferVariable(0, 1).offset);
+
+    // Constant buffers are loaded on first use by any of their getters, not only by the count.
+    const fresh = compiler.reflect(object.getBytes()) orelse return error.InvalidContainer;
+    defer fresh.deinit();
+    try std.testing.expectEqualStrings("Params", std.mem.span(fresh.getConstantBuffer(0).name));
+    const fresh_variables = compiler.reflect(object.getBytes()) orelse return error.InvalidContainer;
+    defer fresh_variables.deinit();
+    try std.testing.expectEqual(@as(u32, 16), fresh_variables.getConstantBufferVariable(0, 1).offset);
 }